@@ -0,0 +1,260 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/crc16.h>
+#include <util/delay.h>
+#include <stdbool.h>
+
+#include "usart.h"
+#include "sdcard.h"
+#include "spi.h"
+#include "timer.h"
+
+#include "pins.h"
+
+/*
+  PORTB
+  pin5 |-> pin13 (SCK)
+  pin4 |-> pin12 (MISO)
+  pin3 |-> pin11 (MOSI)
+  pin2 |-> pin10 (output/SS)
+  pin1 |-> pin9  (error pin, defined in makefile)
+
+  Connected to: SD Card
+  Arduino pin13 (SCK) connected to (SCK)
+  Arduino pin12 (MISO) connected to (DO)
+  Arduino pin11 (MOSI) connected to (DI)
+  Arduino pin10 (SS) connected to (CS)
+
+  Description:
+  Program serves the sectors of the SD card over the usart, so a card
+  can be read (and written) without removing it, see tools/sdbridge.py.
+
+  Each request is 7 bytes:
+
+    op, tag, sector (4 bytes, little endian), count
+
+  with op 'I' (info), 'R' (read count sectors) or 'W' (write count
+  sectors, the data follows the request). Each response starts with
+
+    0xA5, tag, status, count
+
+  followed for 'I' by the number of sectors on the card (4 bytes), and
+  for 'R' by each sector as a status byte and (if the status is 0) the
+  512 bytes of data and a crc (2 bytes). For 'W' each sector is sent as
+  512 bytes of data and a crc, the response is sent once all have been
+  written, count is the number of sectors written (the next sector of
+  a write is received while the card programs the previous one, with
+  no flow control a count above 1 relies on the card keeping up with
+  the usart, so tools/sdbridge.py writes single sectors). The crc is the
+  avr-libc _crc_ccitt_update (initial value 0xFFFF) over the data.
+
+  Requests are processed in order, the host can send several read
+  requests before the first response has arrived (up to as many as
+  fit into the receive buffer), so the card is read while the previous
+  response is still being sent and the usart is kept busy. The sector
+  data is streamed from the spi bus into the send buffer, no sector
+  buffer is used for reads.
+*/
+
+#define BRIDGE_SYNC 0xA5
+
+#define BRIDGE_OK           0x00
+#define BRIDGE_BAD_REQUEST  0xBF
+#define BRIDGE_BAD_CRC      0xBE
+#define BRIDGE_TIMEOUT      0xBD
+#define BRIDGE_OVERRUN      0xBC
+
+#define BRIDGE_TIMEOUT_MS 1000
+
+SSDCard g_sdcard;
+
+/*
+  reads bytes from the usart, waiting at most BRIDGE_TIMEOUT_MS for
+  each byte when b_timeout is set
+*/
+static
+bool bridge_read(uint8_t* p_data, uint16_t ui_length, const bool b_timeout) {
+  uint32_t ui_timeout = timer_millis() + BRIDGE_TIMEOUT_MS;
+
+  while (ui_length > 0) {
+    if (usart_get_char(p_data)) {
+      p_data++;
+      ui_length--;
+      ui_timeout = timer_millis() + BRIDGE_TIMEOUT_MS;
+    } else if (b_timeout && timer_millis() >= ui_timeout) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static
+void bridge_header(const uint8_t ui_tag,
+                   const uint8_t ui_status,
+                   const uint8_t ui_count) {
+  usart_write_byte(BRIDGE_SYNC);
+  usart_write_byte(ui_tag);
+  usart_write_byte(ui_status);
+  usart_write_byte(ui_count);
+}
+
+static
+void bridge_read_sectors(const uint8_t ui_tag,
+                         uint32_t ui_sector,
+                         const uint8_t ui_count) {
+  uint16_t ui_crc;
+  uint16_t i;
+  uint8_t ui_sent;
+  uint8_t data;
+  uint8_t r;
+
+  bridge_header(ui_tag, BRIDGE_OK, ui_count);
+
+  for (ui_sent = 0; ui_sent < ui_count; ui_sent++, ui_sector++) {
+    r = sdcard_sector_read_begin(&g_sdcard, ui_sector);
+    usart_write_byte(r);
+    if (r != 0) {
+      /* the rest of the batch is not sent */
+      return;
+    }
+
+    /* stream the sector from the card into the send buffer, the spi
+       transfer is faster than the usart so this is paced by the
+       send buffer draining */
+    ui_crc = 0xFFFF;
+    for (i = 0; i < 512; i++) {
+      data = spi_master_transmit(0xFF);
+      ui_crc = _crc_ccitt_update(ui_crc, data);
+      usart_write_byte(data);
+    }
+    sdcard_send_command_frame_data_end();
+
+    usart_write_byte(ui_crc & 0xFF);
+    usart_write_byte(ui_crc >> 8);
+  }
+}
+
+static
+void bridge_write_sectors(const uint8_t ui_tag,
+                          uint32_t ui_sector,
+                          const uint8_t ui_count) {
+  uint8_t* const pch_sector = g_sdcard.pch_sector;
+  uint8_t pch_crc[2];
+  uint16_t ui_crc;
+  uint16_t i;
+  uint8_t ui_written = 0;
+  uint8_t ui_status = BRIDGE_OK;
+  uint8_t ui_received;
+  SUsartStats s_before;
+  SUsartStats s_after;
+
+  usart_stats(&s_before);
+
+  for (ui_received = 0; ui_received < ui_count; ui_received++, ui_sector++) {
+    /* the buffer is overwritten while the card programs the previous
+       sector */
+    g_sdcard.ui_sector = 0xFFFFFFFF;
+    if (!bridge_read(pch_sector, 512, true) ||
+        !bridge_read(pch_crc, sizeof(pch_crc), true)) {
+      ui_status = BRIDGE_TIMEOUT;
+      break;
+    }
+
+    /* after an error, the rest of the data is only consumed */
+    if (ui_status != BRIDGE_OK) {
+      continue;
+    }
+
+    ui_crc = 0xFFFF;
+    for (i = 0; i < 512; i++) {
+      ui_crc = _crc_ccitt_update(ui_crc, pch_sector[i]);
+    }
+    if (ui_crc != (pch_crc[0] | (uint16_t)pch_crc[1] << 8)) {
+      ui_status = BRIDGE_BAD_CRC;
+      continue;
+    }
+
+    ui_status = sdcard_wait_ready();
+    if (ui_status == 0) {
+      ui_status = sdcard_sector_write_begin(&g_sdcard, ui_sector, pch_sector);
+    }
+    if (ui_status == 0) {
+      ui_written++;
+    }
+  }
+
+  if (sdcard_wait_ready() != 0 && ui_status == BRIDGE_OK) {
+    ui_status = 0xFF;
+  }
+
+  usart_stats(&s_after);
+  if (s_after.ui_rx_overruns != s_before.ui_rx_overruns &&
+      ui_status == BRIDGE_OK) {
+    ui_status = BRIDGE_OVERRUN;
+  }
+
+  bridge_header(ui_tag, ui_status, ui_written);
+}
+
+int main(void) {
+  uint8_t pch_request[7];
+  uint32_t ui_sector;
+  uint8_t data;
+  uint8_t r;
+
+  /* flash led on on boot */
+  writePin(PIN_ERROR, true);
+  setMode(PIN_ERROR, output);
+  _delay_ms(250);
+  writePin(PIN_ERROR, false);
+
+  usart_init_baud();
+  timer_init();
+
+  /* enable interrupts, used for timer and usart */
+  sei();
+
+  /* initilise the sdcard interface (includes spi), the mbr is not
+     required to be valid as the whole card is served */
+  r = sdcard_init(&g_sdcard);
+  if (r != 0 && g_sdcard.ui_sectors == 0) {
+    goto end;
+  }
+
+  while (1) {
+    bridge_read(pch_request, sizeof(pch_request), false);
+
+    ui_sector
+      = (uint32_t)pch_request[2]
+      | ((uint32_t)pch_request[3] << 8)
+      | ((uint32_t)pch_request[4] << 16)
+      | ((uint32_t)pch_request[5] << 24);
+
+    switch (pch_request[0]) {
+    case 'I':
+      bridge_header(pch_request[1], BRIDGE_OK, 0);
+      usart_write((const uint8_t*)&(g_sdcard.ui_sectors),
+                  sizeof(g_sdcard.ui_sectors),
+                  USART_BLOCK);
+      break;
+    case 'R':
+      bridge_read_sectors(pch_request[1], ui_sector, pch_request[6]);
+      break;
+    case 'W':
+      bridge_write_sectors(pch_request[1], ui_sector, pch_request[6]);
+      break;
+    default:
+      /* out of step with the host, drop everything received */
+      bridge_header(pch_request[1], BRIDGE_BAD_REQUEST, 0);
+      _delay_ms(BRIDGE_TIMEOUT_MS);
+      while (usart_get_char(&data)) {}
+      break;
+    }
+  }
+
+ end:
+  /* on error set led to always on */
+  writePin(PIN_ERROR, true);
+  while(1) {}
+}
@@ -2,17 +2,41 @@
 #include <avr/interrupt.h>
 #include <util/delay.h>
 
-#include "usart_p.h"
+#include "usart_fmt.h"
 #include "usart.h"
+#if defined USE_PRINTF
+  #include "usart_p.h"
+#endif
 #include "spi.h"
 #include "timer.h"
-#include "icr-pulse.h"
-#include "pwm.h"
+#if defined USE_RANGER
+  #include "ranger.h"
+#else
+  #include "icr-pulse.h"
+#endif
+#if defined USE_BAM
+  #include "bam595.h"
+#else
+  #include "pwm.h"
+#endif
+#include "sched.h"
+#include "prof.h"
+#include "trace.h"
+#if defined USE_SONAR
+  #include "sonar.h"
+#endif
+#if defined USE_TELEMETRY
+  #include "telemetry.h"
+#endif
 
 #include "pins.h"
 
+#if defined USE_PRINTF && !defined TIMER_BENCHMARK
+/* the same messages through vfprintf, to compare the size */
+#define usart_fmt_P usart_printf_P
+#endif
+
 #define DELAY_MS 500
-#define MYUBRR F_CPU/16/BAUD-1
 
 #define SCK       13
 #define MOSI      11
@@ -20,9 +44,51 @@
 #define ERROR_LED 9
 #define ECHO      8
 #define OE        7
+#if defined USE_RANGER
+/* the trigger is OC0B */
+#define NO_REPORT 6
+#define TRIGGER   5
+
+/* posted by the icr-capture isr for each edge, see the Makefile */
+#define EVENT_EDGE ICR_CAPTURE_EVENT
+#else
 #define NO_REPORT 5
 #define TRIGGER   6
 
+/* posted by the icr-pulse isrs, see the Makefile */
+#define EVENT_ECHO ICR_PULSE_EVENT
+#endif
+
+#if defined USE_SONAR
+/* posted by the sonar isrs */
+#define EVENT_RANGE SONAR_EVENT
+#define SONARS 4
+
+/* front and back range together, then left and right */
+static const SSonarSensor s_sonars[SONARS] = {
+  { SONAR_ECHO(8), SONAR_TRIGGER(6), 0 },
+  { SONAR_ECHO(A0), SONAR_TRIGGER(2), 1 },
+  { SONAR_ECHO(A1), SONAR_TRIGGER(4), 0 },
+  { SONAR_ECHO(A2), SONAR_TRIGGER(A3), 1 },
+};
+static uint16_t pui_ranges[SONARS] = {
+  SONAR_DISTANCE_NONE, SONAR_DISTANCE_NONE,
+  SONAR_DISTANCE_NONE, SONAR_DISTANCE_NONE
+};
+#endif
+
+static SSchedTask s_scan_task;
+#if !defined USE_TELEMETRY
+static SSchedTask s_report_task;
+#if defined PROF
+static SSchedTask s_prof_task;
+#endif
+#if defined TRACE
+static SSchedTask s_trace_task;
+#endif
+#endif
+static uint8_t depth = 0;
+
 /*
   PORTB
   pin5 |-> pin13 (SCK)
@@ -47,13 +113,282 @@
   Connected to: HC-SR04
   Arduino pin6 (output) to HC-SR04 trigger
   Arduino pin8 (ICP1) to HC-SR04 echo
+
+  With USE_RANGER pin5 (OC0B) is the trigger and pin6 the report
+  input.
+
+  With USE_SONAR, three more HC-SR04
+  Arduino pin2, pin4, A3 (output) to trigger
+  Arduino A0, A1, A2 to echo
 */
 
-int main (void) {
-  uint32_t next_time_print = 0;
-  uint32_t next_time_scan = 0;
-  uint8_t depth = 0;
+static
+void show(const uint16_t cm) {
+  if (cm < 10) {
+    depth = 0x01;
+  } else if (cm < 15) {
+    depth = 0x03;
+  } else if (cm < 20) {
+    depth = 0x07;
+  } else if (cm < 25) {
+    depth = 0x0F;
+  } else if (cm < 30) {
+    depth = 0x1F;
+  } else if (cm < 35) {
+    depth = 0x3F;
+  } else if (cm < 45) {
+    depth = 0x7F;
+  } else {
+    depth = 0xFF;
+  }
+
+#if defined USE_BAM
+  /* the leds fade in over each 5cm instead of switching, in 1/256 of
+     a led from 5cm on */
+  {
+    const uint32_t ui_fill = cm < 5 ? 0 : (uint32_t)(cm - 5) * 256 / 5;
+    uint8_t i;
+    for (i = 0; i < 8; i++) {
+      if (ui_fill >= (uint16_t)(i + 1) * 256) {
+        bam595_set(i, 0xFF);
+      } else if (ui_fill <= (uint16_t)i * 256) {
+        bam595_set(i, 0);
+      } else {
+        bam595_set(i, ui_fill - (uint16_t)i * 256);
+      }
+    }
+    /* a frame is 2ms, the reading is shown with the next one */
+    bam595_commit();
+  }
+#else
+  /* set ss to low, write data to SN74HC595, then ss high to store
+     data */
+  writePin(SS,false);
+  spi_master_transmit(depth);
+  pwm_set_value(depth);
+  writePin(SS,true);
+#endif
+}
+
+#if defined USE_SONAR
+/* runs again when the sonar is next due, or when an echo is in, so a
+   tickless timer sleeps in between */
+static
+void scan(void* p_arg) {
+  (void)p_arg;
+  sonar_poll();
+  sched_start(&s_scan_task, sonar_due_ms(), 0);
+}
+#elif defined USE_RANGER
+/* runs again when the ranger is next due, or for each edge of the
+   echo, so a tickless timer sleeps in between */
+static
+void scan(void* p_arg) {
+  (void)p_arg;
+  /* triggers again as soon as the echo is in */
+  if (ranger_poll()) {
+    show(ranger_mm() / 10);
+  }
+  sched_start(&s_scan_task, ranger_due_ms(), 0);
+}
+
+static
+void edge(uint16_t ui_data) {
+  (void)ui_data;
+  sched_start(&s_scan_task, 0, 0);
+}
+#else
+static
+void scan(void* p_arg) {
+  (void)p_arg;
+  /* enable pin change interrupt */
+  icr_pulse_enable();
+  /* set portd pin 6 high for 10 microseconds */
+  writePin(TRIGGER,true);
+  _delay_us(10);
+  writePin(TRIGGER,false);
+}
+#endif
+
+#if defined USE_RANGER
+/* the ranger is polled by the scan task */
+#elif !defined USE_SONAR
+static
+void echo(uint16_t ui_value) {
+  if (ui_value == ICR_PULSE_ERROR) {
+#if defined USE_TELEMETRY
+    telemetry_send_bytes(2, NULL, 0);
+#else
+    usart_fmt_P(PSTR("Error\n"));
+#endif
+    return;
+  }
+
+  show(ui_value/58);
+
+#if defined USE_TELEMETRY
+  {
+    struct {
+      uint32_t ui_time;
+      uint16_t ui_echo;
+      uint8_t ui_depth;
+    } s_sample = { timer_millis(), ui_value, depth };
+    telemetry_send(1, s_sample);
+  }
+#endif
+}
+#else
+/* the display shows the nearest obstacle */
+static
+void range(uint16_t ui_sensor) {
+  uint16_t ui_nearest = SONAR_DISTANCE_NONE;
+  uint8_t i;
+
+  /* the slot ends with its last echo */
+  sched_start(&s_scan_task, 0, 0);
+
+  sonar_distance(ui_sensor, &pui_ranges[ui_sensor]);
+  for (i = 0; i < SONARS; i++) {
+    if (pui_ranges[i] < ui_nearest) {
+      ui_nearest = pui_ranges[i];
+    }
+  }
+  show(ui_nearest / 10);
+}
+#endif
+
+#if !defined USE_TELEMETRY
+/* text report is not mixed with telemetry frames */
+static
+void report_task(const char* pch_name, const SSchedTask* const p_task) {
+  usart_fmt_P(PSTR("Task %s: runs %u, run max %luus avg %luus,"
+                   " late max %ums\n"),
+              pch_name,
+              p_task->ui_runs,
+              p_task->ui_run_max,
+              p_task->ui_runs == 0 ? 0 : p_task->ui_run_total / p_task->ui_runs,
+              p_task->ui_late_max);
+}
 
+static
+void report(void* p_arg) {
+  (void)p_arg;
+  /* check input on pin 7 of port d, if low, do nothing */
+  if (!readPin(NO_REPORT)) {
+    return;
+  }
+  /* print number that is being written to SN74HC595 */
+  usart_fmt_P(PSTR("Displaying: 0x%02X\n"), depth);
+  usart_fmt_P(PSTR("Time: %lu\n"), timer_millis());
+  {
+    SUsartStats s_stats;
+    usart_stats(&s_stats);
+    usart_fmt_P(PSTR("RX overruns: %u/%u, frame errors: %u\n"),
+                s_stats.ui_rx_overruns,
+                s_stats.ui_rx_data_overruns,
+                s_stats.ui_rx_frame_errors);
+  }
+  {
+    static uint32_t ui_last = 0;
+    static uint16_t ui_last_interrupts = 0;
+    const uint32_t ui_now = timer_micros();
+    const uint16_t ui_interrupts = timer_interrupts();
+    SSchedStats s_stats;
+    sched_stats(&s_stats);
+    usart_fmt_P(PSTR("Events: %u, dropped %u, queued max %u,"
+                     " handler max %luus\n"),
+                s_stats.ui_posted,
+                s_stats.ui_dropped,
+                s_stats.ui_queue_max,
+                s_stats.ui_handler_max);
+    /* since the last report, i.e. per second */
+    usart_fmt_P(PSTR("Idle: %lu/%luus, wakeups %u, timer interrupts %u,"
+                     " wake late max %uus\n"),
+                s_stats.ui_idle_micros,
+                ui_now - ui_last,
+                s_stats.ui_wakeups,
+                ui_interrupts - ui_last_interrupts,
+                s_stats.ui_wake_late_max);
+    ui_last = ui_now;
+    ui_last_interrupts = ui_interrupts;
+    sched_stats_reset();
+  }
+  report_task("scan", &s_scan_task);
+  report_task("report", &s_report_task);
+#if defined USE_SONAR
+  {
+    SSonarStats s_stats;
+    sonar_stats(&s_stats);
+    /* per second, a single sensor every 123ms makes 8 */
+    usart_fmt_P(PSTR("Sonar: readings %u, timeouts %u, pings %u,"
+                     " mm %u %u %u %u\n"),
+                s_stats.ui_readings,
+                s_stats.ui_timeouts,
+                s_stats.ui_pings,
+                pui_ranges[0],
+                pui_ranges[1],
+                pui_ranges[2],
+                pui_ranges[3]);
+    sonar_stats_reset();
+  }
+#elif defined USE_RANGER
+  {
+    SRangerStats s_stats;
+    ranger_stats(&s_stats);
+    /* per second, triggering every 123ms makes 8 */
+    usart_fmt_P(PSTR("Ranger: readings %u, timeouts %u, mm %u raw %u\n"),
+                s_stats.ui_readings,
+                s_stats.ui_timeouts,
+                ranger_mm(),
+                ranger_raw_mm());
+    ranger_stats_reset();
+  }
+#endif
+#if defined USE_BAM
+  {
+    SBam595Stats s_stats;
+    bam595_stats(&s_stats);
+    usart_fmt_P(PSTR("Frames: %u, overruns %u\n"),
+                s_stats.ui_frames,
+                s_stats.ui_overruns);
+  }
+#endif
+}
+
+#if defined PROF
+static
+void prof(void* p_arg) {
+  (void)p_arg;
+  prof_dump();
+}
+#endif
+
+#if defined TRACE
+static
+void trace(void* p_arg) {
+  (void)p_arg;
+  trace_dump();
+}
+#endif
+#endif
+
+#if defined TIMER_BENCHMARK
+typedef void (*FFormat)(const char* pch_fmt, ...);
+
+/* cycles of one message written into the empty send buffer, with the
+   udre interrupts that start sending it during the call */
+static
+uint32_t format_benchmark(const FFormat f_format) {
+  uint32_t ui_start;
+  usart_flush();
+  ui_start = timer_cycles();
+  f_format(PSTR("Value %u %5d %04X %lu %S\n"),
+           1234, -56, 0xBEEF, 123456789UL, PSTR("text"));
+  return timer_cycles() - ui_start;
+}
+#endif
+
+int main (void) {
   setMode(ERROR_LED, output);
   setMode(SS, output);
   setMode(TRIGGER, output);
@@ -61,8 +396,15 @@ int main (void) {
   writePin(OE,true);
   setMode(OE,output);
 
+#if !defined USE_BAM
   /* initilise pwm  */
   pwm_init();
+#endif
+
+#if defined TRACE || defined TRACE_GPIO
+  /* trace pins on port c, statistics */
+  trace_init();
+#endif
 
   /* enable interrupts, used for usart */
   sei();
@@ -70,10 +412,41 @@ int main (void) {
   /* initilise timer/counter, should be called after sei */
   timer_init();
 
-  /* initilise the usart and write boot message */
-  usart_init(MYUBRR);
-  usart_printf_P(PSTR("Hello World\n"));
+  /* initilise the usart and write boot message, not into the
+     telemetry frames */
+  usart_init_baud();
+#if !defined USE_TELEMETRY
+  usart_fmt_P(PSTR("Hello World\n"));
+#endif
 
+#if defined TIMER_BENCHMARK
+  {
+    STimerBenchmark s_benchmark;
+    timer_benchmark(&s_benchmark);
+    usart_fmt_P(PSTR("Cycles per call, millis: %u micros: %u"
+                     " cycles: %u stamp: %u\n"),
+                s_benchmark.ui_millis,
+                s_benchmark.ui_micros,
+                s_benchmark.ui_cycles,
+                s_benchmark.ui_stamp);
+  }
+  {
+    uint32_t ui_fmt = format_benchmark(usart_fmt_P);
+#if defined USE_PRINTF
+    uint32_t ui_printf = format_benchmark(usart_printf_P);
+    usart_fmt_P(PSTR("Cycles per message, fmt: %lu printf: %lu\n"),
+                ui_fmt, ui_printf);
+#else
+    usart_fmt_P(PSTR("Cycles per message, fmt: %lu\n"), ui_fmt);
+#endif
+  }
+#endif
+
+#if defined USE_BAM
+  /* refresh of the SN74HC595 from timer 2 and the spi interrupt, all
+     outputs off */
+  bam595_init();
+#else
   /* set ss high */
   writePin(SS,true);
   spi_master_init();
@@ -83,67 +456,53 @@ int main (void) {
   writePin(SS,false);
   spi_master_transmit(0x00);
   writePin(SS,true);
+#endif
 
   /* enable outputs on SN74HC595 */
   writePin(OE,false);
 
-  while(1) {
-    uint32_t now = timer_millis();
-
-    if (now >= next_time_scan) {
-      next_time_scan += 123;
-      /* enable pin change interrupt */
-      icr_pulse_enable();
-      /* set portd pin 6 high for 10 microseconds */
-      writePin(TRIGGER,true);
-      _delay_us(10);
-      writePin(TRIGGER,false);
-    }
-
-    if (icr_pulse_done) {
-      uint16_t cm = icr_pulse_value/58;
-      if (cm < 10) {
-        depth = 0x01;
-      } else if (cm < 15) {
-        depth = 0x03;
-      } else if (cm < 20) {
-        depth = 0x07;
-      } else if (cm < 25) {
-        depth = 0x0F;
-      } else if (cm < 30) {
-        depth = 0x1F;
-      } else if (cm < 35) {
-        depth = 0x3F;
-      } else if (cm < 45) {
-        depth = 0x7F;
-      } else {
-        depth = 0xFF;
-      }
-
-      icr_pulse_done = false;
-
-      /* set ss to low, write data to SN74HC595, then ss high to store
-         data */
-      writePin(SS,false);
-      spi_master_transmit(depth);
-      pwm_set_value(depth);
-      writePin(SS,true);
-    }
-
-    if (icr_pulse_error) {
-      icr_pulse_error = false;
-      usart_printf("Error\n");
-    }
-
-    if (now >= next_time_print) {
-      next_time_print += 1000;
+  sched_init();
+#if defined USE_SONAR
+  if (!sonar_init(s_sonars, SONARS)) {
+    /* too many sensors, or a slot out of range */
+    writePin(ERROR_LED, true);
+  }
+  sched_event_handler(EVENT_RANGE, range);
+  /* fires the next slot as soon as it is due, the task starts itself
+     again */
+  sched_task_init(&s_scan_task, scan, NULL);
+  sched_start(&s_scan_task, 0, 0);
+#elif defined USE_RANGER
+  ranger_init();
+  sched_event_handler(EVENT_EDGE, edge);
+  sched_task_init(&s_scan_task, scan, NULL);
+  sched_start(&s_scan_task, 0, 0);
+#else
+  sched_event_handler(EVENT_ECHO, echo);
+  sched_task_init(&s_scan_task, scan, NULL);
+  sched_start(&s_scan_task, 0, 123);
+#endif
+#if !defined USE_TELEMETRY
+  sched_task_init(&s_report_task, report, NULL);
+  sched_start(&s_report_task, 0, 1000);
+#if defined PROF
+  prof_reset();
+  sched_task_init(&s_prof_task, prof, NULL);
+  sched_start(&s_prof_task, 5000, 5000);
+#endif
+#if defined TRACE
+  sched_task_init(&s_trace_task, trace, NULL);
+  sched_start(&s_trace_task, 5000, 5000);
+#endif
+#endif
 
-      /* check input on pin 7 of port d, if low, do nothing */
-      if (readPin(NO_REPORT)) {
-       /* print number that is being written to SN74HC595 */
-        usart_printf("Displaying: 0x%02X\n", depth);
-        usart_printf("Time: %lu\n", now);
-      }
+  while(1) {
+#if defined TRACE
+    /* drain the isr records before the ring fills */
+    trace_poll();
+#endif
+    if (!sched_run()) {
+      sched_idle();
     }
   }
 }
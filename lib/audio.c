@@ -0,0 +1,236 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "audio.h"
+#include "timer.h"
+#include "prof.h"
+
+#if AUDIO_OUTPUT == AUDIO_OUTPUT_R2R
+/* the R2R ladder on all pins of portd */
+#define AUDIO_OUTPUT_INIT() (DDRD = 0xFF)
+#define AUDIO_OUTPUT_WRITE(pui_sample) (PORTD = (pui_sample)[0])
+#elif AUDIO_OUTPUT == AUDIO_OUTPUT_PWM
+/* OC1A, starting at the middle. 16 bit register writes from the isr
+   only, the high byte is 0 */
+#define AUDIO_OUTPUT_INIT() (DDRB |= _BV(DDB1), OCR1A = 0x80)
+#define AUDIO_OUTPUT_WRITE(pui_sample) (OCR1A = (pui_sample)[0])
+#define AUDIO_OUTPUT_COM _BV(COM1A1)
+#elif AUDIO_OUTPUT == AUDIO_OUTPUT_PWM_DUAL
+/* the high byte on OC1A, the low byte on OC1B */
+#define AUDIO_OUTPUT_INIT() \
+  (DDRB |= _BV(DDB1) | _BV(DDB2), OCR1A = 0x80, OCR1B = 0)
+#define AUDIO_OUTPUT_WRITE(pui_sample) \
+  (OCR1A = (pui_sample)[1], OCR1B = (pui_sample)[0])
+#define AUDIO_OUTPUT_COM (_BV(COM1A1) | _BV(COM1B1))
+#else
+  #error "AUDIO_OUTPUT is not one of AUDIO_OUTPUT_R2R, _PWM or _PWM_DUAL"
+#endif
+
+static uint8_t ppui_audio_buffer[2][AUDIO_HALF_SIZE * AUDIO_SAMPLE_BYTES];
+
+static FAudioFill f_audio_fill;
+static void* p_audio_arg;
+/* main program, the half to fill next and the end of the stream */
+static uint8_t ui_audio_fill;
+static volatile bool b_audio_end;
+
+/* samples in each half, 0 once played (the main program fills it) */
+static volatile uint16_t pui_audio_count[2];
+/* isr, the playing half and position */
+static volatile uint8_t ui_audio_half;
+static volatile uint16_t ui_audio_position;
+#if AUDIO_OUTPUT == AUDIO_OUTPUT_R2R
+/* cycles per sample (TOP + 1) and the remainder of F_CPU / rate, the
+   accumulated remainder is under the rate */
+static uint16_t ui_audio_period;
+static uint16_t ui_audio_remainder;
+#endif
+static uint16_t ui_audio_rate;
+#if AUDIO_OUTPUT != AUDIO_OUTPUT_R2R
+/* with pwm the rate is added each period, a sample is due when it
+   has added up to AUDIO_PWM_HZ. the carry stays under it, compared
+   with AUDIO_PWM_HZ - rate to stay in 16 bits */
+static uint16_t ui_audio_gap;
+#endif
+static uint16_t ui_audio_carry;
+
+static SAudioStats s_audio_stats;
+
+/* fills the next half, false at the end of the stream */
+static
+bool audio_fill(void) {
+  const uint8_t ui_half = ui_audio_fill;
+  uint16_t ui_count;
+  uint16_t ui_queued;
+
+  /* the time to read (and decode) a half, to compare with the time
+     it takes to play */
+  PROF_BEGIN(PROF_AUDIO_FILL);
+  ui_count = f_audio_fill(p_audio_arg, ppui_audio_buffer[ui_half],
+                          AUDIO_HALF_SIZE);
+  PROF_END(PROF_AUDIO_FILL);
+  if (ui_count == 0) {
+    b_audio_end = true;
+    return false;
+  }
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    /* left in the other half, which is playing */
+    ui_queued = pui_audio_count[ui_half ^ 1] - ui_audio_position;
+    pui_audio_count[ui_half] = ui_count;
+  }
+  if (ui_queued < s_audio_stats.ui_headroom_min) {
+    s_audio_stats.ui_headroom_min = ui_queued;
+  }
+  s_audio_stats.ui_fills++;
+  ui_audio_fill = ui_half ^ 1;
+  return true;
+}
+
+bool audio_start(const uint16_t ui_rate, const FAudioFill f_fill,
+                 void* const p_arg) {
+#if AUDIO_OUTPUT != AUDIO_OUTPUT_R2R
+  if (ui_rate > AUDIO_PWM_HZ) {
+    return false;
+  }
+#endif
+  if (!timer_claim(1, TIMER_OWNER_AUDIO)) {
+    return false;
+  }
+
+  f_audio_fill = f_fill;
+  p_audio_arg = p_arg;
+  ui_audio_fill = 0;
+  b_audio_end = false;
+  pui_audio_count[0] = 0;
+  pui_audio_count[1] = 0;
+  ui_audio_half = 0;
+  ui_audio_position = 0;
+#if AUDIO_OUTPUT == AUDIO_OUTPUT_R2R
+  ui_audio_period = F_CPU / ui_rate;
+  ui_audio_remainder = F_CPU % ui_rate;
+#else
+  ui_audio_gap = AUDIO_PWM_HZ - ui_rate;
+#endif
+  ui_audio_rate = ui_rate;
+  ui_audio_carry = 0;
+
+  s_audio_stats.ui_samples = 0;
+  s_audio_stats.ui_underruns = 0;
+  s_audio_stats.ui_fills = 0;
+  s_audio_stats.ui_headroom_min = 0xFFFF;
+
+  /* both halves, the first must not be empty */
+  if (!audio_fill()) {
+    timer_release(1, TIMER_OWNER_AUDIO);
+    return false;
+  }
+  audio_fill();
+  /* the fills above had no playing half */
+  s_audio_stats.ui_headroom_min = 0xFFFF;
+
+  AUDIO_OUTPUT_INIT();
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+#if AUDIO_OUTPUT == AUDIO_OUTPUT_R2R
+    /* timer 1 in ctc mode (4), counting to OCR1A at F_CPU */
+    TCCR1A = 0;
+    TCNT1 = 0;
+    OCR1A = ui_audio_period - 1;
+    TIFR1 = _BV(OCF1A);
+    TIMSK1 = _BV(OCIE1A);
+#else
+    /* timer 1 in 8 bit fast pwm mode (5) at F_CPU, clear on compare */
+    TCCR1A = AUDIO_OUTPUT_COM | _BV(WGM10);
+    TCNT1 = 0;
+    TIFR1 = _BV(TOV1);
+    TIMSK1 = _BV(TOIE1);
+#endif
+    TCCR1B = _BV(WGM12) | _BV(CS10);
+  }
+  return true;
+}
+
+bool audio_poll(void) {
+  if (!b_audio_end) {
+    if (pui_audio_count[ui_audio_fill] == 0) {
+      audio_fill();
+    }
+    return true;
+  }
+  /* the stream has ended, until both halves are played */
+  return pui_audio_count[0] != 0 || pui_audio_count[1] != 0;
+}
+
+void audio_stop(void) {
+  TIMSK1 = 0;
+  TCCR1B = 0;
+  /* with pwm the pins keep their port value (low) */
+  TCCR1A = 0;
+  timer_release(1, TIMER_OWNER_AUDIO);
+}
+
+void audio_stats(SAudioStats* const p_stats) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    *p_stats = s_audio_stats;
+  }
+}
+
+/* writes the next sample, from the timer isr */
+static inline
+void audio_next(void) {
+  uint8_t ui_half = ui_audio_half;
+  uint16_t ui_position = ui_audio_position;
+
+  if (pui_audio_count[ui_half] == 0) {
+    /* hold the last sample, not an underrun at the end */
+    if (!b_audio_end) {
+      s_audio_stats.ui_underruns++;
+    }
+    return;
+  }
+
+  AUDIO_OUTPUT_WRITE(
+    &ppui_audio_buffer[ui_half][ui_position * AUDIO_SAMPLE_BYTES]);
+  s_audio_stats.ui_samples++;
+
+  if (++ui_position == pui_audio_count[ui_half]) {
+    /* played, to be filled by the main program */
+    pui_audio_count[ui_half] = 0;
+    ui_audio_half = ui_half ^ 1;
+    ui_position = 0;
+  }
+  ui_audio_position = ui_position;
+}
+
+#if AUDIO_OUTPUT == AUDIO_OUTPUT_R2R
+ISR(TIMER1_COMPA_vect) {
+  /* the next period, one cycle longer when the remainder has added
+     up to a cycle. the counter has just been cleared, so the new TOP
+     is ahead of it */
+  if (ui_audio_carry >= ui_audio_rate - ui_audio_remainder) {
+    ui_audio_carry -= ui_audio_rate - ui_audio_remainder;
+    OCR1A = ui_audio_period;
+  } else {
+    ui_audio_carry += ui_audio_remainder;
+    OCR1A = ui_audio_period - 1;
+  }
+
+  audio_next();
+}
+#else
+ISR(TIMER1_OVF_vect) {
+  /* the new compare values are taken at the end of this period, a
+     sample is due every AUDIO_PWM_HZ / rate periods */
+  if (ui_audio_carry < ui_audio_gap) {
+    ui_audio_carry += ui_audio_rate;
+    return;
+  }
+  ui_audio_carry -= ui_audio_gap;
+
+  audio_next();
+}
+#endif
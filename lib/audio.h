@@ -0,0 +1,124 @@
+#ifndef _AUDIO_H
+#define _AUDIO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+  Audio playback at an exact sample rate. Timer 1 in ctc mode
+  interrupts once per sample and writes it to the output (the R2R
+  ladder on portd). F_CPU is rarely a multiple of the rate (16MHz /
+  44100 is 362.8 cycles), so the isr alternates between periods of
+  362 and 363 cycles, carrying the remainder, and the average rate is
+  exact with a jitter of one cycle.
+
+  Samples (unsigned 8 bit) are played from two halves of a 512 byte
+  buffer, one sector of the card. While the isr plays one half the
+  main program refills the other through a fill function, e.g. from a
+  file on the card:
+
+    static uint16_t fill(void* p_arg, uint8_t* pui_buffer,
+                         const uint16_t ui_size) {
+      ... read up to ui_size samples, 0 at the end ...
+    }
+
+    audio_start(44100, fill, &s_file);
+    while (audio_poll()) {}
+
+  When the isr finds the next half still empty the output holds the
+  last sample and the underrun is counted. The headroom is the
+  smallest number of samples left in the playing half when a refill
+  finished, the time to spare for the card.
+
+  The output stage is chosen with AUDIO_OUTPUT:
+
+  * AUDIO_OUTPUT_R2R, 8 bit samples on the R2R ladder on portd, as
+    above
+  * AUDIO_OUTPUT_PWM, 8 bit samples as the duty cycle of OC1A (portb
+    pin1, arduino pin 9), fast pwm at 62.5kHz (F_CPU / 256)
+  * AUDIO_OUTPUT_PWM_DUAL, 16 bit samples, the high byte on OC1A and
+    the low byte on OC1B (portb pin2, arduino pin 10), to be mixed
+    through resistors of 1:256 (e.g. 3.9k and 1M) and a low pass
+    filter
+
+  With pwm the timer interrupts at the end of every pwm period (the
+  overflow) and adds the rate to a counter, a new sample is taken when
+  it passes 62500, so each sample is held for one or two periods and
+  the average rate is exact. 16 bit samples take two bytes (low byte
+  first), so the halves are 128 samples to keep the buffer at 512
+  bytes.
+*/
+
+#define AUDIO_OUTPUT_R2R 0
+#define AUDIO_OUTPUT_PWM 1
+#define AUDIO_OUTPUT_PWM_DUAL 2
+
+#if !defined(AUDIO_OUTPUT)
+  #define AUDIO_OUTPUT AUDIO_OUTPUT_R2R
+#endif
+
+#if AUDIO_OUTPUT == AUDIO_OUTPUT_PWM_DUAL
+  #define AUDIO_SAMPLE_BYTES 2
+#else
+  #define AUDIO_SAMPLE_BYTES 1
+#endif
+/* pwm periods per second, the highest rate with pwm */
+#define AUDIO_PWM_HZ (F_CPU / 256)
+
+/* samples in a half */
+#if !defined(AUDIO_HALF_SIZE)
+  #define AUDIO_HALF_SIZE (256 / AUDIO_SAMPLE_BYTES)
+#endif
+
+/* fills up to ui_size samples (of AUDIO_SAMPLE_BYTES each) into
+   pui_buffer, returns the number filled, 0 at the end of the stream */
+typedef uint16_t (*FAudioFill)(void* p_arg, uint8_t* pui_buffer,
+                               const uint16_t ui_size);
+
+/*
+  stores sample i of a buffer from an unsigned 16 bit value (biased at
+  0x8000), only the high byte with 8 bit samples. for fill functions
+  that do not depend on the output stage.
+*/
+static inline
+void audio_sample_set(uint8_t* const pui_buffer, const uint16_t i,
+                      const uint16_t ui_sample) {
+#if AUDIO_SAMPLE_BYTES == 2
+  pui_buffer[2 * i] = ui_sample & 0xFF;
+  pui_buffer[2 * i + 1] = ui_sample >> 8;
+#else
+  pui_buffer[i] = ui_sample >> 8;
+#endif
+}
+
+typedef struct {
+  /* samples played */
+  uint32_t ui_samples;
+  /* samples that found the buffer empty */
+  uint16_t ui_underruns;
+  /* halves filled, and the fewest samples left to play when one was */
+  uint16_t ui_fills;
+  uint16_t ui_headroom_min;
+} SAudioStats;
+
+/*
+  claims timer 1 (see timer_claim), fills both halves and starts
+  playing at ui_rate samples per second. false if timer 1 is in use,
+  the stream is empty or (with pwm) the rate is above AUDIO_PWM_HZ.
+*/
+bool audio_start(const uint16_t ui_rate, const FAudioFill f_fill,
+                 void* const p_arg);
+
+/*
+  refills a half that has been played, call from the main loop at
+  least once per half (5.8ms at 44.1kHz, 2.9ms with 16 bit samples).
+  returns false once the end of the stream has been played.
+*/
+bool audio_poll(void);
+
+/* stops the timer and releases it */
+void audio_stop(void);
+
+void audio_stats(SAudioStats* const p_stats);
+
+#endif
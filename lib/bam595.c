@@ -0,0 +1,211 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bam595.h"
+#include "trace.h"
+#include "timer.h"
+
+/*
+  timer 2 counts and clock select for a plane of 2^b units, with the
+  smallest prescaler (8, 32, 64, 128 or 256) that fits 256 counts.
+*/
+#define _BAM595_COUNTS(b, div)                                  \
+  ((uint32_t)(BAM595_UNIT_US << (b)) * (F_CPU / 1000000) / (div))
+#define _BAM595_DIV(b)                                          \
+  (_BAM595_COUNTS(b, 8) <= 256 ? 8                              \
+   : _BAM595_COUNTS(b, 32) <= 256 ? 32                          \
+   : _BAM595_COUNTS(b, 64) <= 256 ? 64                          \
+   : _BAM595_COUNTS(b, 128) <= 256 ? 128 : 256)
+#define _BAM595_CS(b)                                           \
+  (_BAM595_DIV(b) == 8 ? _BV(CS21)                              \
+   : _BAM595_DIV(b) == 32 ? _BV(CS21) | _BV(CS20)               \
+   : _BAM595_DIV(b) == 64 ? _BV(CS22)                           \
+   : _BAM595_DIV(b) == 128 ? _BV(CS22) | _BV(CS20)              \
+   : _BV(CS22) | _BV(CS21))
+#define _BAM595_PLANE(b)                                        \
+  { _BAM595_CS(b), _BAM595_COUNTS(b, _BAM595_DIV(b)) - 1 }
+
+typedef struct {
+  uint8_t ui_tccr2b;
+  uint8_t ui_ocr2a;
+} SBam595Plane;
+
+static const SBam595Plane ps_bam595_planes[8] = {
+  _BAM595_PLANE(0), _BAM595_PLANE(1), _BAM595_PLANE(2), _BAM595_PLANE(3),
+  _BAM595_PLANE(4), _BAM595_PLANE(5), _BAM595_PLANE(6), _BAM595_PLANE(7)
+};
+
+/* levels of the main program */
+static uint8_t pui_bam595_levels[BAM595_OUTPUTS];
+
+/* bit planes in the order they are shifted out (the last chip first),
+   one buffer is shown and the other written by bam595_commit */
+static uint8_t pui_bam595_bits[2][8][BAM595_CHIPS];
+
+/* written by the isrs */
+static uint8_t (*volatile p_bam595_shown)[BAM595_CHIPS];
+static uint8_t (*volatile p_bam595_next)[BAM595_CHIPS];
+static volatile uint8_t ui_bam595_plane;
+/* next byte to shift out and the bytes not yet shifted out */
+static const uint8_t* volatile pui_bam595_shift;
+static volatile uint8_t ui_bam595_shift_left;
+static SBam595Stats s_bam595_stats;
+
+/* the latch (RCLK) is SS, portb pin 2 */
+#define BAM595_LATCH_LOW() (PORTB &= ~_BV(PORTB2))
+#define BAM595_LATCH_HIGH() (PORTB |= _BV(PORTB2))
+
+bool bam595_init(void) {
+  uint8_t i;
+
+  if (!timer_claim(2, TIMER_OWNER_BAM)) {
+    return false;
+  }
+
+  for (i = 0; i < BAM595_OUTPUTS; i++) {
+    pui_bam595_levels[i] = 0;
+  }
+  bam595_commit();
+  p_bam595_shown = p_bam595_next;
+
+  /* MOSI, SCK and SS output, spi master at fck/2 with its interrupt */
+  PORTB |= _BV(PORTB2);
+  DDRB |= _BV(DDB2) | _BV(DDB3) | _BV(DDB5);
+  SPCR = _BV(SPIE) | _BV(SPE) | _BV(MSTR);
+  SPSR |= _BV(SPI2X);
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    s_bam595_stats.ui_frames = 0;
+    s_bam595_stats.ui_overruns = 0;
+    ui_bam595_shift_left = 0;
+    /* the first interrupt starts the last plane, so the next frame
+       begins right after it */
+    ui_bam595_plane = 6;
+    /* timer 2 in ctc mode, counting to OCR2A */
+    TCCR2A = _BV(WGM21);
+    TCNT2 = 0;
+    OCR2A = ps_bam595_planes[0].ui_ocr2a;
+    TIFR2 = _BV(OCF2A);
+    TIMSK2 = _BV(OCIE2A);
+    TCCR2B = ps_bam595_planes[0].ui_tccr2b;
+  }
+  return true;
+}
+
+void bam595_stop(void) {
+  TIMSK2 = 0;
+  TCCR2B = 0;
+  SPCR &= ~_BV(SPIE);
+  timer_release(2, TIMER_OWNER_BAM);
+}
+
+void bam595_set(const uint8_t ui_output, const uint8_t ui_level) {
+  pui_bam595_levels[ui_output] = ui_level;
+}
+
+uint8_t bam595_get(const uint8_t ui_output) {
+  return pui_bam595_levels[ui_output];
+}
+
+bool bam595_commit(void) {
+  uint8_t (*p_bits)[BAM595_CHIPS];
+  uint8_t ui_plane;
+  uint8_t ui_chip;
+  uint8_t ui_bit;
+  uint8_t ui_byte;
+  uint8_t ui_level;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    p_bits = p_bam595_next;
+  }
+  if (p_bits != p_bam595_shown) {
+    return false;
+  }
+  p_bits = pui_bam595_bits[p_bits == pui_bam595_bits[0] ? 1 : 0];
+
+  /* transpose the levels of each chip into its byte of each plane,
+     output 0 is the q0 of the chip nearest to the avr, whose byte is
+     shifted out last */
+  for (ui_chip = 0; ui_chip < BAM595_CHIPS; ui_chip++) {
+    for (ui_plane = 0; ui_plane < 8; ui_plane++) {
+      ui_byte = 0;
+      for (ui_bit = 0; ui_bit < 8; ui_bit++) {
+        ui_level = pui_bam595_levels[ui_chip * 8 + ui_bit];
+        if (ui_level & _BV(ui_plane)) {
+          ui_byte |= _BV(ui_bit);
+        }
+      }
+      p_bits[ui_plane][BAM595_CHIPS - 1 - ui_chip] = ui_byte;
+    }
+  }
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    p_bam595_next = p_bits;
+  }
+  return true;
+}
+
+void bam595_stats(SBam595Stats* const p_stats) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    *p_stats = s_bam595_stats;
+  }
+}
+
+/*
+  start of a plane: latch it and time it, then start shifting out the
+  plane after it. both isrs mark TRACE_APP (they never run at once),
+  so with TRACE_GPIO its pin is high for the load of the refresh
+*/
+ISR(TIMER2_COMPA_vect) {
+  uint8_t ui_plane;
+  TRACE_ENTER(TRACE_APP);
+
+  if (ui_bam595_shift_left != 0) {
+    /* the previous plane is still being shifted out, latching now
+       would show half of it */
+    s_bam595_stats.ui_overruns++;
+  } else {
+    BAM595_LATCH_HIGH();
+  }
+
+  ui_plane = ui_bam595_plane + 1;
+  if (ui_plane == 8) {
+    ui_plane = 0;
+    s_bam595_stats.ui_frames++;
+  }
+  ui_bam595_plane = ui_plane;
+
+  /* the counter was cleared by the match, a new prescaler starts
+     counting from its reset */
+  OCR2A = ps_bam595_planes[ui_plane].ui_ocr2a;
+  TCCR2B = ps_bam595_planes[ui_plane].ui_tccr2b;
+  GTCCR = _BV(PSRASY);
+
+  /* next plane, a new frame takes the committed buffer */
+  if (ui_plane == 7) {
+    p_bam595_shown = p_bam595_next;
+    ui_plane = 0;
+  } else {
+    ui_plane++;
+  }
+  if (ui_bam595_shift_left == 0) {
+    BAM595_LATCH_LOW();
+    pui_bam595_shift = p_bam595_shown[ui_plane];
+    ui_bam595_shift_left = BAM595_CHIPS;
+    SPDR = *pui_bam595_shift++;
+  }
+
+  TRACE_EXIT(TRACE_APP);
+}
+
+ISR(SPI_STC_vect) {
+  TRACE_ENTER(TRACE_APP);
+  /* at 0 the chain is shifted out, see TIMER2_COMPA_vect */
+  if (--ui_bam595_shift_left != 0) {
+    SPDR = *pui_bam595_shift++;
+  }
+  TRACE_EXIT(TRACE_APP);
+}
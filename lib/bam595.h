@@ -0,0 +1,80 @@
+#ifndef _BAM595_H
+#define _BAM595_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+  Brightness of each output of a chain of BAM595_CHIPS 74HC595 shift
+  registers, by bit angle modulation. A frame shows the 8 bit planes
+  of the levels in turn, plane b for 2^b units of BAM595_UNIT_US, so
+  an output is on for its level in units out of 255 (8us units: 2ms
+  frames, 490Hz).
+
+  Timer 2 (CTC mode, its prescaler and compare value per plane from a
+  table computed at compile time) interrupts at the start of each
+  plane: it latches the plane shifted in during the previous one
+  (RCLK on SS, arduino pin 10, rising edge) and starts shifting out
+  the next plane, which the spi interrupt continues byte by byte. The
+  shortest plane must be longer than shifting the chain, which costs
+  about 3us per chip.
+
+  The levels are kept by the main program, bam595_commit turns them
+  into bit planes in a second buffer that the timer interrupt swaps in
+  at the start of the next frame, so a frame never mixes old and new
+  levels.
+
+    bam595_init();
+    bam595_set(0, 255);
+    bam595_set(1, 16);
+    bam595_commit();
+
+  Uses timer 2 (not together with pwm) and owns the spi bus while
+  running.
+*/
+
+#if !defined(BAM595_CHIPS)
+  #define BAM595_CHIPS 1
+#endif
+#if !defined(BAM595_UNIT_US)
+  #define BAM595_UNIT_US 8
+#endif
+
+#define BAM595_OUTPUTS (BAM595_CHIPS * 8)
+
+#if BAM595_UNIT_US < BAM595_CHIPS * 3 + 2
+  #error "BAM595_UNIT_US is shorter than shifting out the chain"
+#endif
+#if BAM595_UNIT_US > 32
+  #error "BAM595_UNIT_US is too long for timer 2"
+#endif
+
+typedef struct {
+  /* frames shown */
+  uint16_t ui_frames;
+  /* planes that started before the previous one was shifted out */
+  uint16_t ui_overruns;
+} SBam595Stats;
+
+/* starts spi (master, 8MHz), timer 2 and the refresh with all
+   outputs off. false if timer 2 is used by another module (see
+   timer_claim) */
+bool bam595_init(void);
+/* stops the refresh, the outputs keep the last plane */
+void bam595_stop(void);
+
+/* the level of output ui_output (0 is the first output of the chip
+   nearest to the avr), shown by the next bam595_commit */
+void bam595_set(const uint8_t ui_output, const uint8_t ui_level);
+uint8_t bam595_get(const uint8_t ui_output);
+
+/*
+  shows the levels from the next frame on, returns false (and does
+  nothing) if the previous commit is not yet shown, at most a frame
+  (255 units) later.
+*/
+bool bam595_commit(void);
+
+void bam595_stats(SBam595Stats* const p_stats);
+
+#endif
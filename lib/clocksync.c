@@ -0,0 +1,340 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <util/crc16.h>
+
+#include "clocksync.h"
+#include "telemetry.h"
+#include "timer.h"
+#include "usart.h"
+
+#if !defined USART_TIMESTAMP
+  #error "clocksync requires USART_TIMESTAMP"
+#endif
+
+/* the drift estimate moves 1/(2^CLOCKSYNC_DRIFT_SHIFT) of the way to
+   each new measurement */
+#if !defined(CLOCKSYNC_DRIFT_SHIFT)
+  #define CLOCKSYNC_DRIFT_SHIFT 2
+#endif
+
+#define CLOCKSYNC_SYNC       1
+#define CLOCKSYNC_FOLLOW_UP  2
+#define CLOCKSYNC_DELAY_REQ  3
+#define CLOCKSYNC_DELAY_RESP 4
+
+typedef struct __attribute__((packed)) {
+  uint8_t ui_type;
+  /* node of the exchange, the one the SYNC is addressed to */
+  uint8_t ui_node;
+  uint8_t ui_seq;
+  uint32_t ui_micros;
+} SClockSync_Message;
+
+/* encoded frame (without delimiter), i.e. channel, message and crc
+   plus the cobs code byte */
+#define CLOCKSYNC_FRAME_SIZE (sizeof(SClockSync_Message) + 4)
+
+static uint8_t clocksync_node;
+static uint8_t clocksync_seq = 0;
+
+/* exchange in progress (node), the type of the last message handled */
+static uint8_t clocksync_state = 0;
+static uint32_t clocksync_t1;
+static uint32_t clocksync_t2;
+static uint32_t clocksync_t3;
+
+/* received frame */
+static uint8_t pch_clocksync_frame[CLOCKSYNC_FRAME_SIZE];
+static uint8_t clocksync_frame_length = 0;
+static uint8_t clocksync_rx_stamps;
+
+/* model of the master clock, master time ref_global at the local time
+   ref_local and the drift since */
+static uint8_t clocksync_samples = 0;
+static uint32_t clocksync_ref_local = 0;
+static uint32_t clocksync_ref_global = 0;
+
+static SClockSyncStats s_clocksync_stats;
+
+/*
+  master time at the local time ui_local
+*/
+static
+uint32_t clocksync_global(const uint32_t ui_local) {
+  const int32_t i_elapsed = (int32_t)(ui_local - clocksync_ref_local);
+  return clocksync_ref_global + i_elapsed
+    + (int32_t)(((int64_t)i_elapsed * s_clocksync_stats.i_drift) >> 24);
+}
+
+/*
+  sends a message and waits until its delimiter has been passed to the
+  transmitter, returns the time that happened. on the bus the DELAY_REQ
+  is sent to the master, the others to the node of the exchange.
+*/
+static
+uint32_t clocksync_send(const uint8_t ui_type,
+                        const uint8_t ui_node,
+                        const uint8_t ui_seq,
+                        const uint32_t ui_micros) {
+  SClockSync_Message s_message = { ui_type, ui_node, ui_seq, ui_micros };
+  uint32_t ui_stamp;
+  uint8_t ui_stamps;
+#if defined USART_BUS
+  uint8_t pch_frame[TELEMETRY_FRAME_SIZE(sizeof(SClockSync_Message))];
+#endif
+
+  /* nothing else may be queued, so the next stamp is this frame's */
+  usart_flush();
+  ui_stamps = usart_tx_stamp(&ui_stamp);
+
+#if defined USART_BUS
+  telemetry_encode_bytes(CLOCKSYNC_CHANNEL, &s_message, sizeof(s_message),
+                         pch_frame);
+  usart_bus_send(ui_type == CLOCKSYNC_DELAY_REQ ? CLOCKSYNC_MASTER : ui_node,
+                 pch_frame,
+                 sizeof(pch_frame));
+#else
+  telemetry_send(CLOCKSYNC_CHANNEL, s_message);
+#endif
+
+  while (usart_tx_stamp(&ui_stamp) == ui_stamps) {}
+
+  return ui_stamp;
+}
+
+/*
+  node has all four times of the exchange
+*/
+static
+void clocksync_update(const uint32_t ui_t4) {
+  const int32_t i_forward = (int32_t)(clocksync_t2 - clocksync_t1);
+  const int32_t i_backward = (int32_t)(ui_t4 - clocksync_t3);
+  int32_t i_offset = (i_forward - i_backward) / 2;
+  uint32_t ui_master;
+  int32_t i_local;
+  int32_t i_drift;
+  uint32_t ui_error;
+
+  s_clocksync_stats.i_offset = i_offset;
+  s_clocksync_stats.ui_delay = (i_forward + i_backward) / 2;
+
+  /* master time at t2 */
+  ui_master = clocksync_t2 - i_offset;
+
+  if (clocksync_samples > 0) {
+    s_clocksync_stats.i_error
+      = (int32_t)(clocksync_global(clocksync_t2) - ui_master);
+    ui_error = s_clocksync_stats.i_error < 0
+      ? -s_clocksync_stats.i_error : s_clocksync_stats.i_error;
+    if (ui_error > s_clocksync_stats.ui_error_max) {
+      s_clocksync_stats.ui_error_max = ui_error;
+    }
+
+    /* rate of the master clock over the interval, relative to 1 */
+    i_local = (int32_t)(clocksync_t2 - clocksync_ref_local);
+    if (i_local > 0) {
+      i_drift = (int32_t)(((int64_t)((int32_t)(ui_master - clocksync_ref_global)
+                                     - i_local) * ((int64_t)1 << 24))
+                          / i_local);
+      if (clocksync_samples == 1) {
+        s_clocksync_stats.i_drift = i_drift;
+      } else {
+        s_clocksync_stats.i_drift
+          += (i_drift - s_clocksync_stats.i_drift)
+          / (1 << CLOCKSYNC_DRIFT_SHIFT);
+      }
+    }
+  }
+
+  clocksync_ref_local = clocksync_t2;
+  clocksync_ref_global = ui_master;
+  if (clocksync_samples < 2) {
+    clocksync_samples++;
+  }
+  s_clocksync_stats.ui_syncs++;
+}
+
+static
+void clocksync_handle(const SClockSync_Message* const p_message,
+                      const uint32_t ui_stamp,
+                      const bool b_stamped) {
+  if (clocksync_node == CLOCKSYNC_MASTER) {
+    /* master answers the delay requests of all nodes */
+    if (p_message->ui_type == CLOCKSYNC_DELAY_REQ) {
+      if (b_stamped) {
+        clocksync_send(CLOCKSYNC_DELAY_RESP,
+                       p_message->ui_node,
+                       p_message->ui_seq,
+                       ui_stamp);
+      } else {
+        s_clocksync_stats.ui_dropped++;
+      }
+    }
+    return;
+  }
+
+  /* only the node a round is addressed to answers, so the delay
+     requests of several nodes do not collide */
+  if (p_message->ui_node != clocksync_node) {
+    return;
+  }
+
+  switch (p_message->ui_type) {
+  case CLOCKSYNC_SYNC:
+    if (!b_stamped) {
+      clocksync_state = 0;
+      s_clocksync_stats.ui_dropped++;
+      return;
+    }
+    clocksync_seq = p_message->ui_seq;
+    clocksync_t2 = ui_stamp;
+    clocksync_state = CLOCKSYNC_SYNC;
+    break;
+  case CLOCKSYNC_FOLLOW_UP:
+    if (clocksync_state != CLOCKSYNC_SYNC ||
+        p_message->ui_seq != clocksync_seq) {
+      return;
+    }
+    clocksync_t1 = p_message->ui_micros;
+    clocksync_t3 = clocksync_send(CLOCKSYNC_DELAY_REQ,
+                                  clocksync_node,
+                                  clocksync_seq,
+                                  0);
+    clocksync_state = CLOCKSYNC_DELAY_REQ;
+    break;
+  case CLOCKSYNC_DELAY_RESP:
+    if (clocksync_state != CLOCKSYNC_DELAY_REQ ||
+        p_message->ui_seq != clocksync_seq) {
+      return;
+    }
+    clocksync_update(p_message->ui_micros);
+    clocksync_state = 0;
+    break;
+  default:
+    break;
+  }
+}
+
+/*
+  cobs decode the frame in place, returns the decoded length or 0 if
+  the frame is malformed
+*/
+static
+uint8_t clocksync_decode(uint8_t* const pch_frame, const uint8_t ui_length) {
+  uint8_t i = 0;
+  uint8_t o = 0;
+  uint8_t j;
+  uint8_t ui_code;
+
+  while (i < ui_length) {
+    ui_code = pch_frame[i];
+    if (ui_code == 0 || ui_code > ui_length - i) {
+      return 0;
+    }
+    for (j = 1; j < ui_code; j++) {
+      pch_frame[o++] = pch_frame[i + j];
+    }
+    i += ui_code;
+    if (ui_code != 0xFF && i < ui_length) {
+      pch_frame[o++] = 0x00;
+    }
+  }
+
+  return o;
+}
+
+void clocksync_init(const uint8_t ui_node) {
+  uint32_t ui_stamp;
+
+  clocksync_node = ui_node;
+  clocksync_state = 0;
+  clocksync_samples = 0;
+  clocksync_frame_length = 0;
+  clocksync_rx_stamps = usart_rx_stamp(&ui_stamp);
+  clocksync_stats_reset();
+}
+
+void clocksync_sync(const uint8_t ui_node) {
+  uint32_t ui_t1;
+
+  clocksync_seq++;
+  ui_t1 = clocksync_send(CLOCKSYNC_SYNC, ui_node, clocksync_seq, 0);
+  clocksync_send(CLOCKSYNC_FOLLOW_UP, ui_node, clocksync_seq, ui_t1);
+}
+
+void clocksync_poll(void) {
+  uint8_t data;
+  uint8_t ui_length;
+  uint8_t ui_stamps;
+  uint32_t ui_stamp;
+  uint16_t ui_crc;
+  uint8_t i;
+  bool b_stamped;
+  SClockSync_Message s_message;
+  uint8_t* const pch_message = (uint8_t*)&s_message;
+
+  while (usart_get_char(&data)) {
+    if (data != USART_STAMP_BYTE) {
+      if (clocksync_frame_length < sizeof(pch_clocksync_frame)) {
+        pch_clocksync_frame[clocksync_frame_length] = data;
+      }
+      if (clocksync_frame_length < 0xFF) {
+        clocksync_frame_length++;
+      }
+      continue;
+    }
+
+    /* the stamp belongs to this delimiter only if no other has been
+       received since, otherwise resynchronise the count */
+    clocksync_rx_stamps++;
+    ui_stamps = usart_rx_stamp(&ui_stamp);
+    b_stamped = ui_stamps == clocksync_rx_stamps;
+    clocksync_rx_stamps = ui_stamps;
+
+    ui_length = clocksync_frame_length;
+    clocksync_frame_length = 0;
+    if (ui_length != CLOCKSYNC_FRAME_SIZE ||
+        clocksync_decode(pch_clocksync_frame, ui_length)
+        != sizeof(SClockSync_Message) + 3 ||
+        pch_clocksync_frame[0] != CLOCKSYNC_CHANNEL) {
+      /* frame of another channel */
+      continue;
+    }
+
+    /* crc over the crc bytes leaves a remainder of 0 */
+    ui_crc = 0xFFFF;
+    for (i = 0; i < sizeof(SClockSync_Message) + 3; i++) {
+      ui_crc = _crc_ccitt_update(ui_crc, pch_clocksync_frame[i]);
+    }
+    if (ui_crc != 0) {
+      s_clocksync_stats.ui_dropped++;
+      continue;
+    }
+
+    for (i = 0; i < sizeof(SClockSync_Message); i++) {
+      pch_message[i] = pch_clocksync_frame[i + 1];
+    }
+    clocksync_handle(&s_message, ui_stamp, b_stamped);
+  }
+}
+
+bool clocksync_is_synced(void) {
+  return clocksync_node == CLOCKSYNC_MASTER || clocksync_samples >= 2;
+}
+
+uint32_t timer_global_micros(void) {
+  if (clocksync_node == CLOCKSYNC_MASTER) {
+    return timer_micros();
+  }
+  return clocksync_global(timer_micros());
+}
+
+void clocksync_stats(SClockSyncStats* const p_stats) {
+  *p_stats = s_clocksync_stats;
+}
+
+void clocksync_stats_reset(void) {
+  s_clocksync_stats.ui_syncs = 0;
+  s_clocksync_stats.ui_dropped = 0;
+  s_clocksync_stats.ui_error_max = 0;
+}
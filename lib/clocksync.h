@@ -0,0 +1,94 @@
+#ifndef _CLOCKSYNC_H
+#define _CLOCKSYNC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+  Clock synchronisation of nodes over the usart, a two step exchange
+  as in PTP. One node is the master, the others discipline their
+  timer_micros to it:
+
+    master                      node
+    SYNC(seq)          t1 -> t2
+    FOLLOW_UP(seq, t1)    ->
+                       t4 <- t3 DELAY_REQ(seq)
+    DELAY_RESP(seq, t4)   ->
+
+  The messages are telemetry frames (see telemetry.h) on
+  CLOCKSYNC_CHANNEL, t1 to t4 are stamped by the usart isrs when the
+  frame delimiter is sent or received (requires USART_TIMESTAMP), so
+  they do not include the time spent formatting or queueing the
+  frames. The isr latency to the stamp is the same for both
+  directions, so cancels out of the offset:
+
+    offset = ((t2 - t1) - (t4 - t3)) / 2   (node - master)
+    delay  = ((t2 - t1) + (t4 - t3)) / 2
+
+  The drift is estimated from the change of the offset between
+  exchanges (low pass filtered), and timer_global_micros extrapolates
+  from the last exchange with it.
+
+  Each exchange is addressed to one node (SYNC and FOLLOW_UP carry its
+  number), only that node sends a DELAY_REQ, so the requests of
+  several nodes on one line do not collide. The master syncs the nodes
+  in turn:
+
+    clocksync_sync(ui_next);
+    ui_next = ui_next == NODES ? 1 : ui_next + 1;
+
+  With USART_BUS the messages are sent with usart_bus_send, the node
+  number is the bus address of the node (usart_bus_init), and the
+  master is address CLOCKSYNC_MASTER.
+
+  clocksync owns the receive side of the usart: clocksync_poll reads
+  all input and discards what is not a clock sync frame, so no other
+  input can be received on the port. Other frames (e.g. reports) can
+  still be sent between the exchanges.
+*/
+
+/* telemetry channel of the clock sync messages */
+#if !defined(CLOCKSYNC_CHANNEL)
+  #define CLOCKSYNC_CHANNEL 0x7F
+#endif
+
+typedef struct {
+  /* completed exchanges */
+  uint16_t ui_syncs;
+  /* exchanges abandoned due to a bad frame or a missing stamp */
+  uint16_t ui_dropped;
+  /* last measured offset and path delay in microseconds */
+  int32_t i_offset;
+  uint32_t ui_delay;
+  /* drift of the master relative to this node, in units of 2^-24
+     (i.e. ppm = i_drift / 16.777) */
+  int32_t i_drift;
+  /* difference of timer_global_micros to the measured master time at
+     the last exchange, and the largest (absolute) since the reset */
+  int32_t i_error;
+  uint32_t ui_error_max;
+} SClockSyncStats;
+
+/* node 0 is the master (the time source), the other nodes need
+   distinct numbers */
+#define CLOCKSYNC_MASTER 0
+void clocksync_init(const uint8_t ui_node);
+
+/* master only, starts an exchange with ui_node by sending a SYNC
+   (e.g. each node once a second) */
+void clocksync_sync(const uint8_t ui_node);
+
+/* process the received frames, needs to be called frequently */
+void clocksync_poll(void);
+
+/* true once the node has completed two exchanges (offset and drift),
+   always true on the master */
+bool clocksync_is_synced(void);
+
+/* microseconds of the master clock, timer_micros on the master */
+uint32_t timer_global_micros(void);
+
+void clocksync_stats(SClockSyncStats* const p_stats);
+void clocksync_stats_reset(void);
+
+#endif
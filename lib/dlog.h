@@ -0,0 +1,124 @@
+#ifndef _DLOG_H
+#define _DLOG_H
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+#include "usart.h"
+
+/*
+  Deferred logging, nothing is formatted on the device. Each call
+  writes a small record into the usart send buffer:
+
+    DLOG_SYNC, id (2 bytes), sizes (1 byte), arguments
+
+  where id is the program memory address of the format string (so is
+  unique per call site), sizes holds 2 bits per argument (1, 2 or 4
+  bytes, least significant bits first) and the arguments are copied
+  raw (little endian) after the usual argument promotions. The format
+  strings are only stored in flash, tools/dlog.py reads them from the
+  elf file and formats the records on the host. Bytes that are not a
+  record (e.g. text from usart_printf) are passed through by the
+  host tool.
+
+  Usage is as printf_P, but without PSTR, with up to 4 arguments:
+
+    dlog("Cluster %lX has value %lX\n", ui_cluster, ui_value);
+    dlog0("End of chain\n");
+
+  A call costs the copy of the record onto the stack and into the send
+  buffer (a few bytes), instead of formatting the text. Strings passed
+  with %s are sent as the ram address only.
+*/
+
+/* marks the start of a record, never used in text */
+#define DLOG_SYNC 0xFF
+
+#define _DLOG_CAT(a, b) a ## b
+#define _DLOG_CALL(n) _DLOG_CAT(dlog, n)
+#define _DLOG_SELECT(a, b, c, d, n, ...) n
+#define _DLOG_COUNT(...) _DLOG_SELECT(__VA_ARGS__, 4, 3, 2, 1, 0)
+
+/* type of the argument after promotion, and its size code */
+#define _DLOG_TYPE(x) __typeof__((x) + 0)
+#define _DLOG_SIZE(x)                                   \
+  (sizeof((x) + 0) == 1 ? 1 : sizeof((x) + 0) == 2 ? 2 : 3)
+
+#define _DLOG_ID(fmt) ((uint16_t)(uintptr_t)PSTR(fmt))
+
+#define _DLOG_SEND(s)                                           \
+  usart_write_bytes((const uint8_t*)&(s), sizeof(s))
+
+#define dlog(fmt, ...) _DLOG_CALL(_DLOG_COUNT(__VA_ARGS__))(fmt, __VA_ARGS__)
+
+#define dlog0(fmt)                                              \
+  do {                                                          \
+    struct __attribute__((packed)) {                            \
+      uint8_t ui_sync;                                          \
+      uint16_t ui_id;                                           \
+      uint8_t ui_sizes;                                         \
+    } s_dlog = { DLOG_SYNC, _DLOG_ID(fmt), 0 };                 \
+    _DLOG_SEND(s_dlog);                                         \
+  } while (0)
+
+#define dlog1(fmt, a)                                           \
+  do {                                                          \
+    struct __attribute__((packed)) {                            \
+      uint8_t ui_sync;                                          \
+      uint16_t ui_id;                                           \
+      uint8_t ui_sizes;                                         \
+      _DLOG_TYPE(a) a0;                                         \
+    } s_dlog = { DLOG_SYNC, _DLOG_ID(fmt),                      \
+                 _DLOG_SIZE(a),                                 \
+                 (a) };                                         \
+    _DLOG_SEND(s_dlog);                                         \
+  } while (0)
+
+#define dlog2(fmt, a, b)                                        \
+  do {                                                          \
+    struct __attribute__((packed)) {                            \
+      uint8_t ui_sync;                                          \
+      uint16_t ui_id;                                           \
+      uint8_t ui_sizes;                                         \
+      _DLOG_TYPE(a) a0;                                         \
+      _DLOG_TYPE(b) a1;                                         \
+    } s_dlog = { DLOG_SYNC, _DLOG_ID(fmt),                      \
+                 _DLOG_SIZE(a) | _DLOG_SIZE(b) << 2,            \
+                 (a), (b) };                                    \
+    _DLOG_SEND(s_dlog);                                         \
+  } while (0)
+
+#define dlog3(fmt, a, b, c)                                     \
+  do {                                                          \
+    struct __attribute__((packed)) {                            \
+      uint8_t ui_sync;                                          \
+      uint16_t ui_id;                                           \
+      uint8_t ui_sizes;                                         \
+      _DLOG_TYPE(a) a0;                                         \
+      _DLOG_TYPE(b) a1;                                         \
+      _DLOG_TYPE(c) a2;                                         \
+    } s_dlog = { DLOG_SYNC, _DLOG_ID(fmt),                      \
+                 _DLOG_SIZE(a) | _DLOG_SIZE(b) << 2 |           \
+                 _DLOG_SIZE(c) << 4,                            \
+                 (a), (b), (c) };                               \
+    _DLOG_SEND(s_dlog);                                         \
+  } while (0)
+
+#define dlog4(fmt, a, b, c, d)                                  \
+  do {                                                          \
+    struct __attribute__((packed)) {                            \
+      uint8_t ui_sync;                                          \
+      uint16_t ui_id;                                           \
+      uint8_t ui_sizes;                                         \
+      _DLOG_TYPE(a) a0;                                         \
+      _DLOG_TYPE(b) a1;                                         \
+      _DLOG_TYPE(c) a2;                                         \
+      _DLOG_TYPE(d) a3;                                         \
+    } s_dlog = { DLOG_SYNC, _DLOG_ID(fmt),                      \
+                 _DLOG_SIZE(a) | _DLOG_SIZE(b) << 2 |           \
+                 _DLOG_SIZE(c) << 4 | _DLOG_SIZE(d) << 6,       \
+                 (a), (b), (c), (d) };                          \
+    _DLOG_SEND(s_dlog);                                         \
+  } while (0)
+
+#endif
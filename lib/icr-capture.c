@@ -0,0 +1,199 @@
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "icr-capture.h"
+#include "ring.h"
+#include "trace.h"
+#include "timer.h"
+#if defined ICR_CAPTURE_EVENT
+  #include "sched.h"
+#endif
+
+RING_DEFINE(icr_capture_ring, SIcrEdge, ICR_CAPTURE_RING_SIZE)
+
+static EIcrCaptureMode e_icr_capture_mode = ICR_CAPTURE_EDGES;
+
+/* written by the isrs */
+static icr_capture_ring_t s_icr_capture_ring;
+static volatile uint16_t ui_icr_capture_overflows;
+static volatile uint16_t ui_icr_capture_overruns;
+/* frequency mode, rising edges since the last icr_capture_frequency
+   and the first and last of them */
+static volatile uint32_t ui_icr_capture_edges;
+static volatile uint32_t ui_icr_capture_first;
+static volatile uint32_t ui_icr_capture_last;
+
+/* main program, last rising edge for icr_capture_pulse */
+static uint32_t ui_icr_capture_rising;
+static bool b_icr_capture_rising;
+static bool b_icr_capture_high;
+
+/*
+  extends a 16 bit value of timer 1 with the overflow count. call with
+  interrupts disabled, an overflow that is pending (not yet counted by
+  the isr) is included if the value is from after it.
+ */
+static inline
+uint32_t icr_capture_extend(const uint16_t ui_ticks) {
+  uint16_t ui_high = ui_icr_capture_overflows;
+  if ((TIFR1 & _BV(TOV1)) && ui_ticks < 0x8000) {
+    ui_high++;
+  }
+  return (uint32_t)ui_high << 16 | ui_ticks;
+}
+
+bool icr_capture_start(const EIcrCaptureMode e_mode) {
+  if (!timer_claim(1, TIMER_OWNER_ICR)) {
+    return false;
+  }
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    e_icr_capture_mode = e_mode;
+    icr_capture_ring_init(&s_icr_capture_ring);
+    ui_icr_capture_overflows = 0;
+    ui_icr_capture_overruns = 0;
+    ui_icr_capture_edges = 0;
+    b_icr_capture_rising = false;
+    b_icr_capture_high = false;
+
+    /* timer1 in normal mode, counts 0 to 0xFFFF */
+    TCCR1A = 0;
+    TCNT1 = 0;
+    /* rising edge with noise filter, start timer 1 with prescaler of
+       8 */
+    TCCR1B = _BV(ICES1) | _BV(ICNC1) | _BV(CS11);
+    /* clear stale flags, unmask icr and overflow */
+    TIFR1 = _BV(ICF1) | _BV(TOV1);
+    TIMSK1 = _BV(ICIE1) | _BV(TOIE1);
+  }
+  return true;
+}
+
+void icr_capture_stop(void) {
+  /* disable timer1 and ICR settings */
+  TCCR1B = 0;
+  /* mask all timer1 interrupts */
+  TIMSK1 = 0;
+  timer_release(1, TIMER_OWNER_ICR);
+}
+
+uint32_t icr_capture_now(void) {
+  uint32_t ui_now;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    ui_now = icr_capture_extend(TCNT1);
+  }
+  return ui_now;
+}
+
+bool icr_capture_edge(SIcrEdge* const p_edge) {
+  return icr_capture_ring_pop(&s_icr_capture_ring, p_edge);
+}
+
+bool icr_capture_pulse(SIcrPulse* const p_pulse) {
+  SIcrEdge s_edge;
+
+  while (icr_capture_ring_pop(&s_icr_capture_ring, &s_edge)) {
+    if (!s_edge.b_rising) {
+      /* a falling edge completes the pulse (if its rising edge was
+         seen) */
+      if (b_icr_capture_high) {
+        b_icr_capture_high = false;
+        p_pulse->ui_width = s_edge.ui_stamp - ui_icr_capture_rising;
+        return true;
+      }
+      continue;
+    }
+
+    p_pulse->ui_period
+      = b_icr_capture_rising ? s_edge.ui_stamp - ui_icr_capture_rising : 0;
+    ui_icr_capture_rising = s_edge.ui_stamp;
+    b_icr_capture_rising = true;
+
+    if (e_icr_capture_mode == ICR_CAPTURE_PERIOD) {
+      p_pulse->ui_width = 0;
+      if (p_pulse->ui_period != 0) {
+        return true;
+      }
+    } else {
+      b_icr_capture_high = true;
+    }
+  }
+
+  return false;
+}
+
+bool icr_capture_frequency(uint32_t* const p_millihertz) {
+  uint32_t ui_edges;
+  uint32_t ui_ticks;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    ui_edges = ui_icr_capture_edges;
+    ui_ticks = ui_icr_capture_last - ui_icr_capture_first;
+    /* the last edge starts the next gate */
+    if (ui_edges > 0) {
+      ui_icr_capture_first = ui_icr_capture_last;
+      ui_icr_capture_edges = 1;
+    }
+  }
+
+  if (ui_edges < 2 || ui_ticks == 0) {
+    return false;
+  }
+
+  /* (edges - 1) periods in ui_ticks */
+  *p_millihertz = (uint64_t)(ui_edges - 1) * (F_CPU / 8) * 1000 / ui_ticks;
+  return true;
+}
+
+uint16_t icr_capture_overruns(void) {
+  uint16_t ui_overruns;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    ui_overruns = ui_icr_capture_overruns;
+  }
+  return ui_overruns;
+}
+
+ISR(TIMER1_OVF_vect) {
+  ui_icr_capture_overflows++;
+}
+
+ISR(TIMER1_CAPT_vect) {
+  const uint16_t ui_icr = ICR1;
+  const uint8_t ui_tccr1b = TCCR1B;
+  SIcrEdge s_edge;
+
+  /* the counter has moved on from the captured value, one count is 8
+     cycles */
+  TRACE_ENTER_LATENCY(TRACE_ICR, TCNT1 - ui_icr);
+
+  s_edge.ui_stamp = icr_capture_extend(ui_icr);
+  s_edge.b_rising = ui_tccr1b & _BV(ICES1);
+
+  switch (e_icr_capture_mode) {
+  case ICR_CAPTURE_FREQUENCY:
+    if (ui_icr_capture_edges == 0) {
+      ui_icr_capture_first = s_edge.ui_stamp;
+    }
+    ui_icr_capture_last = s_edge.ui_stamp;
+    ui_icr_capture_edges++;
+    break;
+  case ICR_CAPTURE_EDGES:
+    /* look for the other edge, changing the edge can set the flag so
+       it is cleared */
+    TCCR1B = ui_tccr1b ^ _BV(ICES1);
+    TIFR1 = _BV(ICF1);
+    /* fall through */
+  default:
+    if (!icr_capture_ring_push(&s_icr_capture_ring, s_edge)) {
+      ui_icr_capture_overruns++;
+    }
+#if defined ICR_CAPTURE_EVENT
+    sched_post(ICR_CAPTURE_EVENT, 0);
+#endif
+    break;
+  }
+
+  TRACE_EXIT(TRACE_ICR);
+}
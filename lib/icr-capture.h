@@ -0,0 +1,95 @@
+#ifndef _ICR_CAPTURE_H
+#define _ICR_CAPTURE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+  Input capture on ICP1 (portb pin0, arduino pin 8) with timer 1
+  running continuously at F_CPU/8 (0.5us per tick at 16MHz). The
+  overflow interrupt extends the 16 bit capture to a 32 bit timestamp
+  (wrapping every 35.8 minutes), so pulses and periods of any length
+  are measured without re-arming, and there is no timeout error as in
+  icr-pulse (the two can not be linked together, both use the timer 1
+  interrupts).
+
+  ICR_CAPTURE_EDGES: both edges, the isr flips the edge after each
+    capture. icr_capture_pulse returns the width (high time) and the
+    period of each pulse.
+  ICR_CAPTURE_PERIOD: rising edges only, icr_capture_pulse returns the
+    periods (width is 0). For signals with edges too close together
+    for the edge to be flipped in time.
+  ICR_CAPTURE_FREQUENCY: rising edges are counted in the isr and not
+    queued, icr_capture_frequency returns the average frequency since
+    the previous call (a gate of any length). For fast signals (tens
+    of kHz) and tachometers.
+
+  Edges are queued in a ring buffer by the isr, when it is full the
+  edge is lost and counted (icr_capture_overruns). When
+  ICR_CAPTURE_EVENT is defined (an event id of sched.h), each queued
+  edge is also posted as an event (with data 0), so the edges can be
+  taken from an event handler instead of a polling task.
+*/
+
+#define ICR_CAPTURE_TICKS_PER_US (F_CPU / 8 / 1000000)
+
+#if !defined(ICR_CAPTURE_RING_SIZE)
+  #define ICR_CAPTURE_RING_SIZE 32
+#endif
+
+typedef enum {
+  ICR_CAPTURE_EDGES,
+  ICR_CAPTURE_PERIOD,
+  ICR_CAPTURE_FREQUENCY
+} EIcrCaptureMode;
+
+typedef struct {
+  /* timer 1 ticks, extended to 32 bits */
+  uint32_t ui_stamp;
+  bool b_rising;
+} SIcrEdge;
+
+typedef struct {
+  /* ticks from the rising to the falling edge, 0 in period mode */
+  uint32_t ui_width;
+  /* ticks from the previous rising edge, 0 for the first pulse */
+  uint32_t ui_period;
+} SIcrPulse;
+
+/* claims and starts timer 1 and the capture, on the rising edge
+   first. false if timer 1 is used by another module (timer_claim) */
+bool icr_capture_start(const EIcrCaptureMode e_mode);
+void icr_capture_stop(void);
+
+/* the current time on the capture timebase */
+uint32_t icr_capture_now(void);
+
+/* next queued edge, false if there is none */
+bool icr_capture_edge(SIcrEdge* const p_edge);
+
+/*
+  consumes the queued edges up to the end of the next pulse (the
+  falling edge, or the next rising edge in period mode), false if no
+  pulse is complete.
+*/
+bool icr_capture_pulse(SIcrPulse* const p_pulse);
+
+/*
+  frequency in millihertz over the rising edges since the previous
+  call, false if there were fewer than two. uses 64 bit arithmetic, so
+  is meant to be called at a low rate (e.g. once a second).
+*/
+bool icr_capture_frequency(uint32_t* const p_millihertz);
+
+/* revolutions per minute for a frequency, with ui_pulses per
+   revolution */
+static inline
+uint32_t icr_capture_rpm(const uint32_t ui_millihertz,
+                         const uint8_t ui_pulses) {
+  return ui_millihertz * 3 / 50 / ui_pulses;
+}
+
+/* edges lost as the ring buffer was full */
+uint16_t icr_capture_overruns(void);
+
+#endif
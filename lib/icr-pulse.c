@@ -1,6 +1,14 @@
 #include <avr/interrupt.h>
 #include <stdbool.h>
 
+#include "icr-pulse.h"
+#include "prof.h"
+#include "trace.h"
+#include "timer.h"
+#if defined ICR_PULSE_EVENT
+  #include "sched.h"
+#endif
+
 volatile bool icr_pulse_done = false;
 volatile bool icr_pulse_error = false;
 volatile uint16_t icr_pulse_value = 0;
@@ -20,6 +28,14 @@ void icr_pulse_enable(void) {
   /* initilise the state tracking variables */
   icr_pulse_error = false;
   icr_pulse_done = false;
+  /* timer 1 is used by another module (e.g. pwm on OC1A/OC1B) */
+  if (!timer_claim(1, TIMER_OWNER_ICR)) {
+    icr_pulse_error = true;
+#if defined ICR_PULSE_EVENT
+    sched_post(ICR_PULSE_EVENT, ICR_PULSE_ERROR);
+#endif
+    return;
+  }
   /* configure icr on rising edge with noise filter */
   TCCR1B = _BV(ICES1) | _BV(ICNC1);
   /* unmask icr */
@@ -36,6 +52,7 @@ void icr_pulse_disable(void) {
   TCCR1B = 0;
   /* mask all timer1 interrupts */
   TIMSK1 = 0;
+  timer_release(1, TIMER_OWNER_ICR);
 }
 
 ISR(TIMER1_OVF_vect) {
@@ -45,9 +62,17 @@ ISR(TIMER1_OVF_vect) {
   TIMSK1 = 0;
   /* mark error status */
   icr_pulse_error = true;
+#if defined ICR_PULSE_EVENT
+  sched_post(ICR_PULSE_EVENT, ICR_PULSE_ERROR);
+#endif
 }
 
 ISR(TIMER1_CAPT_vect) {
+  PROF_BEGIN(PROF_ICR_ISR);
+  /* once timer 1 runs (after the rising edge) the counter has moved
+     on from the captured value, one count is 8 cycles */
+  TRACE_ENTER_LATENCY(TRACE_ICR,
+                      (TCCR1B & _BV(CS11)) ? TCNT1 - ICR1 : 0);
   if (TCCR1B & _BV(ICES1)) {
     /* looking for up edge */
 
@@ -68,5 +93,10 @@ ISR(TIMER1_CAPT_vect) {
     icr_pulse_done = true;
     /* divide ICR1 by 2 to convert into microseconds */
     icr_pulse_value = ICR1 / (F_CPU/1000000/8);
+#if defined ICR_PULSE_EVENT
+    sched_post(ICR_PULSE_EVENT, icr_pulse_value);
+#endif
   }
+  PROF_END(PROF_ICR_ISR);
+  TRACE_EXIT(TRACE_ICR);
 }
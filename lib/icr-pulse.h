@@ -1,11 +1,24 @@
 #ifndef _ICR_PULSE_H
 #define _ICR_PULSE_H
 
+#include <stdint.h>
+#include <stdbool.h>
+
 /* these are set by ISR */
 extern volatile bool icr_pulse_done;
 extern volatile bool icr_pulse_error;
 extern volatile uint16_t icr_pulse_value;
 
+/*
+  when ICR_PULSE_EVENT is defined (an event id of sched.h), each
+  measurement is also posted as an event with the value, or with
+  ICR_PULSE_ERROR if the pulse did not end before the timer
+  overflowed.
+*/
+#define ICR_PULSE_ERROR 0xFFFF
+
+/* claims timer 1 (see timer_claim), if it is used by another module
+   the measurement ends at once with an error */
 void icr_pulse_enable(void);
 void icr_pulse_disable(void);
 
@@ -0,0 +1,322 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include "playlist.h"
+#include "audio.h"
+#include "timer.h"
+
+/* results of reading the list */
+#define PLAYLIST_LIST_DATA 0
+#define PLAYLIST_LIST_END 1
+/* the step has read a sector, the list goes on in the next one */
+#define PLAYLIST_LIST_WAIT 2
+
+/*
+  the next ui_size bytes of the list in the sector buffer of the card
+  (in *pp_data). entries of a directory (32 bytes) and characters of a
+  list file never cross a sector. a step reads one sector at most, the
+  reading of the current track in between overwrites the buffer.
+*/
+static
+uint8_t playlist_list_read(SPlaylist* const p_playlist,
+                           const uint8_t ui_size,
+                           const uint8_t** pp_data) {
+  SSDFATCard* const p_sdfatcard = p_playlist->p_sdfatcard;
+  uint32_t ui_sector;
+
+  if (!p_playlist->b_directory && p_playlist->ui_left == 0) {
+    return PLAYLIST_LIST_END;
+  }
+
+  if (p_playlist->ui_offset >= 512) {
+    if (p_playlist->ui_sector + 1 >= p_sdfatcard->ui_sectors_per_cluster) {
+      if (p_playlist->b_read) {
+        return PLAYLIST_LIST_WAIT;
+      }
+      p_playlist->b_read = true;
+      p_playlist->ui_sector = 0;
+      p_playlist->ui_cluster
+        = fat32_cluster_lookup(p_sdfatcard, p_playlist->ui_cluster);
+    } else {
+      p_playlist->ui_sector++;
+    }
+    p_playlist->ui_offset = 0;
+  }
+  /* end of chain (or a broken fat) */
+  if (p_playlist->ui_cluster < 2 || p_playlist->ui_cluster >= 0x0FFFFFF8) {
+    return PLAYLIST_LIST_END;
+  }
+
+  /* the buffer is only read again if it holds another sector */
+  ui_sector = fat32_cluster_sector(p_sdfatcard,
+                                   p_playlist->ui_cluster,
+                                   p_playlist->ui_sector);
+  if (ui_sector != p_sdfatcard->p_sdcard->ui_sector) {
+    if (p_playlist->b_read) {
+      return PLAYLIST_LIST_WAIT;
+    }
+    p_playlist->b_read = true;
+    if (sdcard_sector_read(p_sdfatcard->p_sdcard, ui_sector) != 0) {
+      return PLAYLIST_LIST_END;
+    }
+  }
+
+  if (!p_playlist->b_directory) {
+    p_playlist->ui_left--;
+  }
+  *pp_data = p_sdfatcard->p_sdcard->pch_sector + p_playlist->ui_offset;
+  p_playlist->ui_offset += ui_size;
+  return PLAYLIST_LIST_DATA;
+}
+
+/* the next .WAV file of a directory, its first cluster and size in
+   the playlist */
+static
+uint8_t playlist_next_entry(SPlaylist* const p_playlist) {
+  const uint8_t* p_entry;
+  uint8_t r;
+
+  while ((r = playlist_list_read(p_playlist, 32, &p_entry))
+         == PLAYLIST_LIST_DATA) {
+    /* end of the directory */
+    if (p_entry[0] == 0x00) {
+      p_playlist->ui_cluster = 0;
+      return PLAYLIST_LIST_END;
+    }
+    /* deleted, long file name, volume label or directory */
+    if (p_entry[0] == 0xE5 || p_entry[0x0B] & 0x18) {
+      continue;
+    }
+    if (memcmp(p_entry + 8, "WAV", 3) == 0) {
+      p_playlist->ui_next_cluster = (uint32_t)p_entry[0x1A]
+        | (uint32_t)p_entry[0x1B] << 8
+        | (uint32_t)p_entry[0x14] << 16
+        | (uint32_t)p_entry[0x15] << 24;
+      p_playlist->ui_next_size = (uint32_t)p_entry[0x1C]
+        | (uint32_t)p_entry[0x1D] << 8
+        | (uint32_t)p_entry[0x1E] << 16
+        | (uint32_t)p_entry[0x1F] << 24;
+      return PLAYLIST_LIST_DATA;
+    }
+  }
+  return r;
+}
+
+/* the next path of a list file in pch_path, continued over the steps */
+static
+uint8_t playlist_next_path(SPlaylist* const p_playlist) {
+  const uint8_t* p_char;
+  uint8_t ui_length = p_playlist->ui_path_length;
+  uint8_t r;
+
+  while (1) {
+    r = playlist_list_read(p_playlist, 1, &p_char);
+    if (r == PLAYLIST_LIST_DATA && *p_char != '\n') {
+      /* longer paths are cut, and not found */
+      if (*p_char != '\r' && ui_length < PLAYLIST_PATH_MAX - 1) {
+        p_playlist->pch_path[ui_length++] = *p_char;
+      }
+      continue;
+    }
+    if (r == PLAYLIST_LIST_WAIT) {
+      break;
+    }
+    if (ui_length == 0 || p_playlist->pch_path[0] == '#') {
+      ui_length = 0;
+      if (r == PLAYLIST_LIST_END) {
+        break;
+      }
+      continue;
+    }
+    /* a line, or the last one without a line end */
+    p_playlist->pch_path[ui_length] = '\0';
+    p_playlist->ui_path_length = 0;
+    return PLAYLIST_LIST_DATA;
+  }
+  p_playlist->ui_path_length = ui_length;
+  return r;
+}
+
+/*
+  one step of the preparation of the next track in the other file,
+  which ends with it ready or at the end of the list
+*/
+static
+void playlist_step(SPlaylist* const p_playlist) {
+  const uint16_t ui_start = timer_stamp();
+  const uint8_t ui_next = p_playlist->ui_current ^ 1;
+  SSDFAT_File* const p_sdfile = &(p_playlist->ps_files[ui_next]);
+  SWav* const p_wav = &(p_playlist->ps_wavs[ui_next]);
+  uint16_t ui_elapsed;
+  uint8_t r;
+
+  p_playlist->b_read = false;
+
+  switch (p_playlist->e_step) {
+  case PLAYLIST_STEP_LIST:
+    r = p_playlist->b_directory
+      ? playlist_next_entry(p_playlist)
+      : playlist_next_path(p_playlist);
+    if (r == PLAYLIST_LIST_END) {
+      p_playlist->e_next = PLAYLIST_NEXT_END;
+    } else if (r == PLAYLIST_LIST_DATA) {
+      p_playlist->e_step = p_playlist->b_directory
+        ? PLAYLIST_STEP_FAT : PLAYLIST_STEP_LOCATE;
+    }
+    break;
+
+  case PLAYLIST_STEP_LOCATE:
+    /* the directory scan overwrites the sector buffer, the list
+       sector is read again for the next path */
+    if (fat32_file_locate(p_playlist->p_sdfatcard, p_playlist->pch_path,
+                          &(p_playlist->ui_next_cluster),
+                          &(p_playlist->ui_next_size)) == 0) {
+      p_playlist->e_step = PLAYLIST_STEP_FAT;
+    } else {
+      p_playlist->s_stats.ui_skipped++;
+      p_playlist->e_step = PLAYLIST_STEP_LIST;
+    }
+    break;
+
+  case PLAYLIST_STEP_FAT:
+    p_playlist->ui_next_fat = fat32_cluster_lookup(p_playlist->p_sdfatcard,
+                                                   p_playlist->ui_next_cluster);
+    p_playlist->e_step = PLAYLIST_STEP_OPEN;
+    break;
+
+  default:
+    p_playlist->e_step = PLAYLIST_STEP_LIST;
+    if (fat32_file_open_cluster_next(p_playlist->p_sdfatcard, p_sdfile,
+                                     p_playlist->ui_next_cluster,
+                                     p_playlist->ui_next_fat,
+                                     p_playlist->ui_next_size) != 0) {
+      p_playlist->s_stats.ui_skipped++;
+      break;
+    }
+    /* the read is closed on an error */
+    if (wav_open(p_wav, p_sdfile) != 0) {
+      p_playlist->s_stats.ui_skipped++;
+      break;
+    }
+    fat32_file_pause(p_sdfile);
+    if (p_playlist->ui_rate == 0) {
+      p_playlist->ui_rate = p_wav->ui_rate;
+    } else if (p_wav->ui_rate != p_playlist->ui_rate) {
+      p_playlist->s_stats.ui_skipped++;
+      break;
+    }
+    p_playlist->e_next = PLAYLIST_NEXT_READY;
+    break;
+  }
+
+  ui_elapsed = timer_stamp() - ui_start;
+  if (ui_elapsed > p_playlist->s_stats.ui_prepare_max) {
+    p_playlist->s_stats.ui_prepare_max = ui_elapsed;
+  }
+}
+
+/* prepares the next track in one go, or marks the end */
+static
+void playlist_prepare(SPlaylist* const p_playlist) {
+  while (p_playlist->e_next == PLAYLIST_NEXT_NONE) {
+    playlist_step(p_playlist);
+  }
+}
+
+/* switches to the next track, false at the end of the list */
+static
+bool playlist_switch(SPlaylist* const p_playlist) {
+  uint16_t ui_start;
+  uint16_t ui_elapsed;
+  uint8_t r;
+
+  while (1) {
+    if (p_playlist->e_next == PLAYLIST_NEXT_NONE) {
+      playlist_prepare(p_playlist);
+      if (p_playlist->e_next == PLAYLIST_NEXT_READY) {
+        p_playlist->s_stats.ui_late++;
+      }
+    }
+    if (p_playlist->e_next != PLAYLIST_NEXT_READY) {
+      return false;
+    }
+
+    ui_start = timer_stamp();
+    p_playlist->ui_current ^= 1;
+    p_playlist->e_next = PLAYLIST_NEXT_NONE;
+    r = fat32_file_resume(&(p_playlist->ps_files[p_playlist->ui_current]));
+    ui_elapsed = timer_stamp() - ui_start;
+    if (ui_elapsed > p_playlist->s_stats.ui_switch_max) {
+      p_playlist->s_stats.ui_switch_max = ui_elapsed;
+    }
+    if (r == 0) {
+      p_playlist->s_stats.ui_tracks++;
+      return true;
+    }
+    p_playlist->s_stats.ui_skipped++;
+  }
+}
+
+uint8_t playlist_open(SPlaylist* const p_playlist,
+                      SSDFATCard* const p_sdfatcard,
+                      const char* pch_path) {
+  uint8_t r;
+  uint32_t ui_size;
+
+  memset(p_playlist, 0, sizeof(SPlaylist));
+  p_playlist->p_sdfatcard = p_sdfatcard;
+  p_playlist->b_directory = pch_path[strlen(pch_path) - 1] == '/';
+
+  r = fat32_file_locate(p_sdfatcard, pch_path,
+                        &(p_playlist->ui_cluster), &ui_size);
+  if (r != 0) {
+    return r;
+  }
+  p_playlist->ui_left = ui_size;
+
+  /* the first track is prepared as the next one */
+  p_playlist->ui_current = 1;
+  p_playlist->e_next = PLAYLIST_NEXT_NONE;
+  playlist_prepare(p_playlist);
+  if (!playlist_switch(p_playlist)) {
+    return PLAYLIST_ERROR_EMPTY;
+  }
+  return 0;
+}
+
+void playlist_poll(SPlaylist* const p_playlist) {
+  SSDFAT_File* const p_sdfile
+    = &(p_playlist->ps_files[p_playlist->ui_current]);
+
+  if (p_playlist->e_next != PLAYLIST_NEXT_NONE) {
+    return;
+  }
+  /* the card reads one file at a time */
+  fat32_file_pause(p_sdfile);
+  playlist_step(p_playlist);
+  if (fat32_file_resume(p_sdfile) != 0) {
+    /* end the track, the next one follows */
+    p_sdfile->ui_file_size = p_sdfile->ui_position;
+  }
+}
+
+uint16_t playlist_fill(void* p_arg, uint8_t* pui_buffer,
+                       const uint16_t ui_size) {
+  SPlaylist* const p_playlist = p_arg;
+  uint16_t ui_count = 0;
+
+  while (1) {
+    ui_count += wav_fill(&(p_playlist->ps_wavs[p_playlist->ui_current]),
+                         pui_buffer + ui_count * AUDIO_SAMPLE_BYTES,
+                         ui_size - ui_count);
+    /* the track has ended part way, the rest from the next one */
+    if (ui_count == ui_size || !playlist_switch(p_playlist)) {
+      return ui_count;
+    }
+  }
+}
+
+void playlist_stats(const SPlaylist* const p_playlist,
+                    SPlaylistStats* const p_stats) {
+  *p_stats = p_playlist->s_stats;
+}
@@ -0,0 +1,149 @@
+#ifndef _PLAYLIST_H
+#define _PLAYLIST_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdcard-fat.h"
+#include "wav.h"
+
+/*
+  Gapless playback of a list of WAV files (see wav.h) with the audio
+  player. The list is either a directory (a path ending in '/', its
+  .WAV files in directory order) or a text file with a path on each
+  line (empty lines and lines starting with '#' are ignored).
+
+  The next track is prepared while the current one plays, in steps of
+  one playlist_poll each: the list is read up to the next track (a
+  step per list sector, or per fat lookup at a cluster boundary), its
+  path is resolved (the directory scan of fat32_file_locate, a list
+  file only, whose reads are the sectors of the directories on the
+  path), its first fat lookup done, and its header read, then its
+  sector read is paused. The card reads one file at a time, so
+  playlist_poll pauses the current track around each step (see
+  fat32_file_pause), which reads its sector twice. A step is so at
+  most one sector read and the re-read of the current sector, except
+  for the path of a list file.
+
+  playlist_fill (a FAudioFill) reads the current track and, when it
+  ends part way into a buffer half, resumes the prepared track and
+  fills the rest of the half from it, so there is no gap and no
+  silence between the tracks. The switch costs a read command and
+  skipping the header, the preparation happens away from it.
+
+    playlist_open(&s_playlist, &g_sdfatcard, "/music/");
+    audio_start(s_playlist.ui_rate, playlist_fill, &s_playlist);
+    while (audio_poll()) {
+      playlist_poll(&s_playlist);
+    }
+
+  All tracks are played at the rate of the first one, a track with
+  another rate is skipped. The times in the stats are measured with
+  timer_stamp (64 cycle units), so timer_init must have been called.
+*/
+
+/* longest path in a list file, with the terminating 0 */
+#if !defined(PLAYLIST_PATH_MAX)
+  #define PLAYLIST_PATH_MAX 64
+#endif
+
+/* errors of playlist_open, or the error of fat32_file_locate */
+/* no track in the list could be played */
+#define PLAYLIST_ERROR_EMPTY 0x01
+
+typedef enum {
+  PLAYLIST_NEXT_NONE,
+  /* prepared, its read paused */
+  PLAYLIST_NEXT_READY,
+  /* the end of the list */
+  PLAYLIST_NEXT_END
+} EPlaylistNext;
+
+/* the steps of a preparation */
+typedef enum {
+  /* reading the list up to the next track */
+  PLAYLIST_STEP_LIST,
+  /* resolving the path read from a list file */
+  PLAYLIST_STEP_LOCATE,
+  /* the fat entry of its first cluster */
+  PLAYLIST_STEP_FAT,
+  /* opening it and reading its header */
+  PLAYLIST_STEP_OPEN
+} EPlaylistStep;
+
+typedef struct {
+  /* tracks started */
+  uint16_t ui_tracks;
+  /* tracks not played, not found, not a supported wav file or at
+     another rate */
+  uint16_t ui_skipped;
+  /* switches that found the next track not yet prepared (prepared
+     in the fill, a gap if it took longer than the headroom) */
+  uint16_t ui_late;
+  /* longest preparation step (a playlist_poll) and switch, in units
+     of 64 cycles */
+  uint16_t ui_prepare_max;
+  uint16_t ui_switch_max;
+} SPlaylistStats;
+
+typedef struct {
+  SSDFATCard* p_sdfatcard;
+
+  /* the list, the sector and offset of the next entry (or character)
+     to read, and the characters left in a list file */
+  bool b_directory;
+  uint32_t ui_cluster;
+  uint8_t ui_sector;
+  uint16_t ui_offset;
+  uint32_t ui_left;
+
+  /* the current track and the next one */
+  SSDFAT_File ps_files[2];
+  SWav ps_wavs[2];
+  uint8_t ui_current;
+  uint8_t e_next;
+
+  /* the preparation of the next track, its step, whether the step
+     has read a sector, and the track as far as it is known */
+  uint8_t e_step;
+  bool b_read;
+  uint32_t ui_next_cluster;
+  uint32_t ui_next_fat;
+  uint32_t ui_next_size;
+
+  /* sample rate of the first track */
+  uint16_t ui_rate;
+
+  /* the path read from a list file, and its length so far */
+  char pch_path[PLAYLIST_PATH_MAX];
+  uint8_t ui_path_length;
+
+  SPlaylistStats s_stats;
+} SPlaylist;
+
+/*
+  opens the list (a directory or a list file, see above) and prepares
+  the first track, which then starts playing with audio_start.
+  returns 0, PLAYLIST_ERROR_EMPTY or the error of fat32_file_locate
+  for the list.
+*/
+uint8_t playlist_open(SPlaylist* const p_playlist,
+                      SSDFATCard* const p_sdfatcard,
+                      const char* pch_path);
+
+/*
+  does the next step of the preparation of the next track if it is
+  not yet prepared, call from the main loop after audio_poll, so that
+  a full buffer half is left to play while it takes.
+*/
+void playlist_poll(SPlaylist* const p_playlist);
+
+/* fills from the current track, then from the next one (a FAudioFill,
+   p_arg is the SPlaylist) */
+uint16_t playlist_fill(void* p_arg, uint8_t* pui_buffer,
+                       const uint16_t ui_size);
+
+void playlist_stats(const SPlaylist* const p_playlist,
+                    SPlaylistStats* const p_stats);
+
+#endif
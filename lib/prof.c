@@ -0,0 +1,106 @@
+#include <stdint.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+
+#include "prof.h"
+#include "timer.h"
+#include "usart_fmt.h"
+
+/* written by the regions (some in isrs), read by prof_dump */
+static volatile SProfRegion s_prof_regions[PROF_REGIONS];
+/* timer_millis of the last reset */
+static uint32_t ui_prof_start;
+
+static const char pch_prof_sd_read[] PROGMEM = "sd_read";
+static const char pch_prof_sd_write[] PROGMEM = "sd_write";
+static const char pch_prof_sd_wait[] PROGMEM = "sd_wait";
+static const char pch_prof_fat_lookup[] PROGMEM = "fat_lookup";
+static const char pch_prof_usart_printf[] PROGMEM = "usart_printf";
+static const char pch_prof_usart_rx_isr[] PROGMEM = "usart_rx_isr";
+static const char pch_prof_usart_udre_isr[] PROGMEM = "usart_udre_isr";
+static const char pch_prof_icr_isr[] PROGMEM = "icr_isr";
+static const char pch_prof_audio_fill[] PROGMEM = "audio_fill";
+static const char pch_prof_app_0[] PROGMEM = "app_0";
+static const char pch_prof_app_1[] PROGMEM = "app_1";
+static const char pch_prof_app_2[] PROGMEM = "app_2";
+static const char pch_prof_app_3[] PROGMEM = "app_3";
+
+/* names in the order of EProfRegion */
+static const char* const pch_prof_names[PROF_REGIONS] PROGMEM = {
+  pch_prof_sd_read,
+  pch_prof_sd_write,
+  pch_prof_sd_wait,
+  pch_prof_fat_lookup,
+  pch_prof_usart_printf,
+  pch_prof_usart_rx_isr,
+  pch_prof_usart_udre_isr,
+  pch_prof_icr_isr,
+  pch_prof_audio_fill,
+  pch_prof_app_0,
+  pch_prof_app_1,
+  pch_prof_app_2,
+  pch_prof_app_3
+};
+
+void prof_record(const EProfRegion e_region, const uint16_t ui_elapsed) {
+  volatile SProfRegion* const p_region = &(s_prof_regions[e_region]);
+
+  /* only one context records a region, and the dump masks interrupts
+     to read and reset it, so no masking is needed here */
+  if (p_region->ui_count == 0 || ui_elapsed < p_region->ui_min) {
+    p_region->ui_min = ui_elapsed;
+  }
+  if (ui_elapsed > p_region->ui_max) {
+    p_region->ui_max = ui_elapsed;
+  }
+  p_region->ui_total += ui_elapsed;
+  p_region->ui_count++;
+}
+
+void prof_region(const EProfRegion e_region, SProfRegion* const p_region) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    p_region->ui_count = s_prof_regions[e_region].ui_count;
+    p_region->ui_total = s_prof_regions[e_region].ui_total;
+    p_region->ui_min = s_prof_regions[e_region].ui_min;
+    p_region->ui_max = s_prof_regions[e_region].ui_max;
+  }
+}
+
+void prof_reset(void) {
+  uint8_t i;
+
+  for (i = 0; i < PROF_REGIONS; i++) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      s_prof_regions[i].ui_count = 0;
+      s_prof_regions[i].ui_total = 0;
+      s_prof_regions[i].ui_min = 0;
+      s_prof_regions[i].ui_max = 0;
+    }
+  }
+  ui_prof_start = timer_millis();
+}
+
+void prof_dump(void) {
+  SProfRegion s_region;
+  uint8_t i;
+
+  usart_fmt_P(PSTR("prof %lu %u\n"),
+              timer_millis() - ui_prof_start,
+              TIMER_CYCLES_PER_STAMP);
+  for (i = 0; i < PROF_REGIONS; i++) {
+    prof_region(i, &s_region);
+    if (s_region.ui_count == 0) {
+      continue;
+    }
+    usart_fmt_P(PSTR("prof %S %u %lu %u %u\n"),
+                (const char*)(uintptr_t)pgm_read_word(&(pch_prof_names[i])),
+                s_region.ui_count,
+                s_region.ui_total,
+                s_region.ui_min,
+                s_region.ui_max);
+  }
+  usart_fmt_P(PSTR("prof end\n"));
+
+  prof_reset();
+}
@@ -0,0 +1,86 @@
+#ifndef _PROF_H
+#define _PROF_H
+
+#include <stdint.h>
+
+/*
+  Profiling of code regions, built with -DPROF. Without it the macros
+  are empty and nothing is added to the code.
+
+    PROF_BEGIN(PROF_FAT_LOOKUP);
+    ...
+    PROF_END(PROF_FAT_LOOKUP);
+
+  BEGIN takes a timer_stamp into a local variable, END adds the
+  elapsed time to the count, total, min and max of the region in a
+  static table. Both must be in the same block, a return between them
+  leaves the region unrecorded (used for the error paths). The time is
+  in units of 64 cycles (one timer 0 increment), so min and max of
+  short regions are only accurate to 64 cycles, the average over many
+  runs is better as the start is not synchronised to the timer. BEGIN
+  and END (two stamps and a call) add to the time of the regions that
+  enclose them. A region is limited to 262ms.
+
+  A region must only be used from one context (the main program or
+  one isr). prof_dump writes the table as text and resets it,
+  tools/prof.py turns the dumps into a report:
+
+    prof <interval ms> <cycles per unit>
+    prof <region> <count> <total> <min> <max>
+    ...
+    prof end
+*/
+
+typedef enum {
+  /* sdcard.c */
+  PROF_SD_READ,
+  PROF_SD_WRITE,
+  PROF_SD_WAIT,
+  /* sdcard-fat.c */
+  PROF_FAT_LOOKUP,
+  /* usart.c */
+  PROF_USART_PRINTF,
+  PROF_USART_RX_ISR,
+  PROF_USART_UDRE_ISR,
+  /* icr-pulse.c */
+  PROF_ICR_ISR,
+  /* audio.c */
+  PROF_AUDIO_FILL,
+  /* free for the application */
+  PROF_APP_0,
+  PROF_APP_1,
+  PROF_APP_2,
+  PROF_APP_3,
+  PROF_REGIONS
+} EProfRegion;
+
+#if defined PROF
+#include "timer.h"
+
+typedef struct {
+  uint16_t ui_count;
+  uint32_t ui_total;
+  uint16_t ui_min;
+  uint16_t ui_max;
+} SProfRegion;
+
+void prof_record(const EProfRegion e_region, const uint16_t ui_elapsed);
+
+#define PROF_BEGIN(region)                                      \
+  const uint16_t _prof_start_##region = timer_stamp()
+#define PROF_END(region)                                        \
+  prof_record((region), timer_stamp() - _prof_start_##region)
+
+/* copy of a region, read with interrupts disabled */
+void prof_region(const EProfRegion e_region, SProfRegion* const p_region);
+
+void prof_reset(void);
+
+/* writes the table with usart_fmt and resets it */
+void prof_dump(void);
+#else
+#define PROF_BEGIN(region) do {} while (0)
+#define PROF_END(region) do {} while (0)
+#endif
+
+#endif
@@ -1,12 +1,251 @@
 
 #include <avr/interrupt.h>
+#include <util/atomic.h>
+
+#include "pwm.h"
+#include "timer.h"
+
+typedef struct {
+  uint8_t ui_timer;
+  /* the COMnx1 bit in TCCRnA, non inverting */
+  uint8_t ui_com;
+  volatile uint8_t* p_ddr;
+  uint8_t ui_pin;
+} SPwmPin;
+
+static const SPwmPin ps_pwm_pins[PWM_CHANNELS] = {
+  { 0, _BV(COM0A1), &DDRD, _BV(DDD6) },
+  { 0, _BV(COM0B1), &DDRD, _BV(DDD5) },
+  { 1, _BV(COM1A1), &DDRB, _BV(DDB1) },
+  { 1, _BV(COM1B1), &DDRB, _BV(DDB2) },
+  { 2, _BV(COM2A1), &DDRB, _BV(DDB3) },
+  { 2, _BV(COM2B1), &DDRD, _BV(DDD3) }
+};
+
+typedef struct {
+  /* channels started, 0 if the timer is not running pwm */
+  uint8_t ui_channels;
+  uint8_t e_mode;
+  uint8_t ui_cs;
+} SPwmTimer;
+
+static SPwmTimer ps_pwm_timers[TIMERS];
+
+static
+volatile uint8_t* pwm_tccra(const uint8_t ui_timer) {
+  switch (ui_timer) {
+  case 0:
+    return &TCCR0A;
+  case 1:
+    return &TCCR1A;
+  default:
+    return &TCCR2A;
+  }
+}
+
+static
+void pwm_timer_start(const uint8_t ui_timer, const EPwmMode e_mode,
+                     const uint8_t ui_cs, const uint16_t ui_top) {
+  switch (ui_timer) {
+  case 0:
+    OCR0A = 0;
+    OCR0B = 0;
+    /* mode 3 (fast) or 1 (phase correct), counting to 0xFF */
+    TCCR0A = e_mode == PWM_FAST ? _BV(WGM01) | _BV(WGM00) : _BV(WGM00);
+    TCCR0B = ui_cs;
+    break;
+  case 1:
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      OCR1A = 0;
+      OCR1B = 0;
+      ICR1 = ui_top;
+      TCNT1 = 0;
+    }
+    /* mode 14 (fast) or 8 (phase and frequency correct), counting to
+       ICR1 */
+    TCCR1A = e_mode == PWM_FAST ? _BV(WGM11) : 0;
+    TCCR1B = (e_mode == PWM_FAST ? _BV(WGM13) | _BV(WGM12) : _BV(WGM13))
+      | ui_cs;
+    break;
+  default:
+    OCR2A = 0;
+    OCR2B = 0;
+    TCCR2A = e_mode == PWM_FAST ? _BV(WGM21) | _BV(WGM20) : _BV(WGM20);
+    TCCR2B = ui_cs;
+    break;
+  }
+}
+
+/*
+  OC0B on the tick of timer.c: fast pwm mode 7 counts to OCR0A, its
+  compare match A and the clear after it are those of the ctc mode,
+  so the tick keeps its timing. only OC0B, OCR0A is the TOP.
+*/
+static
+uint8_t pwm_start_tick(const EPwmChannel e_channel, const EPwmMode e_mode) {
+#if defined TIMER_TICKLESS
+  (void)e_channel;
+  (void)e_mode;
+  /* the free running counter has no TOP to share */
+  return PWM_ERROR_CLAIMED;
+#else
+  if (e_channel != PWM_OC0B) {
+    return PWM_ERROR_CLAIMED;
+  }
+  if (e_mode != PWM_FAST) {
+    return PWM_ERROR_CONFIG;
+  }
+
+  if (ps_pwm_timers[0].ui_channels == 0) {
+    ps_pwm_timers[0].ui_channels = _BV(COM0B1);
+    ps_pwm_timers[0].e_mode = PWM_FAST;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      OCR0B = 0;
+      /* the two registers are written one after the other, away from
+         the match so no count passes it in mode 3 (TOP 0xFF) */
+      while (TCNT0 >= TIMER_COUNTS_PER_TICK - 2) {}
+      TCCR0A = _BV(COM0B1) | _BV(WGM01) | _BV(WGM00);
+      TCCR0B |= _BV(WGM02);
+    }
+    DDRD |= _BV(DDD5);
+  }
+  return 0;
+#endif
+}
+
+#if !defined TIMER_TICKLESS
+/* back to the ctc mode of timer_init */
+static
+void pwm_stop_tick(void) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    while (TCNT0 >= TIMER_COUNTS_PER_TICK - 2) {}
+    TCCR0B &= ~_BV(WGM02);
+    TCCR0A = _BV(WGM01);
+  }
+}
+#endif
+
+uint8_t pwm_start(const EPwmChannel e_channel, const EPwmMode e_mode,
+                  const uint8_t ui_cs, const uint16_t ui_top) {
+  const SPwmPin* const p_pin = &ps_pwm_pins[e_channel];
+  SPwmTimer* const p_timer = &ps_pwm_timers[p_pin->ui_timer];
+
+  if (p_pin->ui_timer == 0 && timer_owner(0) == TIMER_OWNER_TICK) {
+    return pwm_start_tick(e_channel, e_mode);
+  }
+
+  if (!timer_claim(p_pin->ui_timer, TIMER_OWNER_PWM)) {
+    return PWM_ERROR_CLAIMED;
+  }
+
+  if (p_timer->ui_channels == 0) {
+    p_timer->e_mode = e_mode;
+    p_timer->ui_cs = ui_cs;
+    pwm_timer_start(p_pin->ui_timer, e_mode, ui_cs, ui_top);
+  } else if (p_timer->e_mode != e_mode || p_timer->ui_cs != ui_cs
+             || (p_pin->ui_timer == 1 && ICR1 != ui_top)) {
+    return PWM_ERROR_CONFIG;
+  }
+
+  if (!(p_timer->ui_channels & p_pin->ui_com)) {
+    p_timer->ui_channels |= p_pin->ui_com;
+    pwm_set(e_channel, 0);
+    *p_pin->p_ddr |= p_pin->ui_pin;
+    *pwm_tccra(p_pin->ui_timer) |= p_pin->ui_com;
+  }
+  return 0;
+}
+
+void pwm_stop(const EPwmChannel e_channel) {
+  const SPwmPin* const p_pin = &ps_pwm_pins[e_channel];
+  SPwmTimer* const p_timer = &ps_pwm_timers[p_pin->ui_timer];
+
+  if (!(p_timer->ui_channels & p_pin->ui_com)) {
+    return;
+  }
+  /* the pin keeps its port value */
+  *pwm_tccra(p_pin->ui_timer) &= ~p_pin->ui_com;
+  p_timer->ui_channels &= ~p_pin->ui_com;
+
+  if (p_timer->ui_channels == 0) {
+#if !defined TIMER_TICKLESS
+    if (p_pin->ui_timer == 0 && timer_owner(0) == TIMER_OWNER_TICK) {
+      pwm_stop_tick();
+      return;
+    }
+#endif
+    switch (p_pin->ui_timer) {
+    case 0:
+      TCCR0B = 0;
+      break;
+    case 1:
+      TCCR1B = 0;
+      break;
+    default:
+      TCCR2B = 0;
+      break;
+    }
+    timer_release(p_pin->ui_timer, TIMER_OWNER_PWM);
+  }
+}
+
+void pwm_set(const EPwmChannel e_channel, const uint16_t ui_value) {
+  switch (e_channel) {
+  case PWM_OC0A:
+    OCR0A = ui_value;
+    break;
+  case PWM_OC0B:
+    OCR0B = ui_value;
+    break;
+  case PWM_OC1A:
+    /* the 16 bit write goes through the TEMP register shared with
+       the isrs */
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      OCR1A = ui_value;
+    }
+    break;
+  case PWM_OC1B:
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      OCR1B = ui_value;
+    }
+    break;
+  case PWM_OC2A:
+    OCR2A = ui_value;
+    break;
+  default:
+    OCR2B = ui_value;
+    break;
+  }
+}
+
+uint16_t pwm_top(const EPwmChannel e_channel) {
+  uint16_t ui_top = 0xFF;
+  if (ps_pwm_pins[e_channel].ui_timer == 0
+      && timer_owner(0) == TIMER_OWNER_TICK) {
+    ui_top = OCR0A;
+  } else if (ps_pwm_pins[e_channel].ui_timer == 1) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      ui_top = ICR1;
+    }
+  }
+  return ui_top;
+}
+
+void pwm_set_top(const uint16_t ui_top) {
+  /* TOV1 is set at TOP (fast) or BOTTOM (phase and frequency
+     correct), either way the counter has just started a period. a
+     stopped timer never sets it and an overflow isr clears it */
+  if ((TCCR1B & (_BV(CS12) | _BV(CS11) | _BV(CS10))) != 0
+      && !(TIMSK1 & _BV(TOIE1))) {
+    TIFR1 = _BV(TOV1);
+    while (!(TIFR1 & _BV(TOV1))) {}
+  }
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    ICR1 = ui_top;
+  }
+}
 
 void pwm_init(void) {
-  /* PORTD pin 3 is OC2B */
-  /* set pin as output */
-  DDRD |= _BV(DDD3);
-  /* enable the fast pwm control of the pin (non-inverting) */
-  TCCR2A |= _BV(COM2B1) | _BV(WGM21) | _BV(WGM20);
-  /* start timer 2 with prescaler of 32 */
-  TCCR2B |= _BV(CS21) | _BV(CS20);  
+  /* PORTD pin 3 is OC2B, fast pwm with a prescaler of 32 */
+  pwm_start(PWM_OC2B, PWM_FAST, _BV(CS21) | _BV(CS20), 0xFF);
 }
@@ -2,7 +2,128 @@
 #define _PWM_H
 
 #include <stdint.h>
+#include <avr/io.h>
 
+/*
+  Hardware pwm on the six output compare pins:
+
+    OC0A portd pin6 (6)    OC1A portb pin1 (9)    OC2A portb pin3 (11)
+    OC0B portd pin5 (5)    OC1B portb pin2 (10)   OC2B portd pin3 (3)
+
+  The two channels of a timer share its mode and frequency. Timers 0
+  and 2 count to 255, so only the prescaler sets the frequency, timer
+  1 counts to ICR1 so any frequency can be had, with a resolution of
+  TOP + 1 steps. PWM_FAST counts up, PWM_PHASE_CORRECT up and down
+  (half the frequency, the pulses stay centered, for timer 1 the phase
+  and frequency correct mode). The prescaler and TOP for a frequency
+  (the highest one not above it for timers 0 and 2) are computed at
+  compile time:
+
+    pwm_start(PWM_OC1A, PWM_TIMER1(20000, PWM_FAST));
+    pwm_set(PWM_OC1A, pwm_top(PWM_OC1A) / 4);
+
+  The compare registers are double buffered by the hardware in the
+  pwm modes, a new value takes effect at the end of a period so no
+  pulse is cut short or doubled.
+
+  A timer is claimed (timer_claim of timer.h) by the first channel
+  started on it, so a timer used by timer.c (0) or by icr-pulse or
+  icr-capture (1) is not reconfigured.
+
+  While timer.c has timer 0 for its millisecond tick, OC0B can still
+  run pwm on the tick (PWM_TIMER0_TICK): timer 0 changes from ctc to
+  fast pwm counting to OCR0A (249), which keeps the tick, so the pwm
+  is 1kHz with 250 steps. OC0A is the TOP of the tick and stays
+  unavailable, as are both channels with TIMER_TICKLESS. Not together
+  with ranger, which triggers on OC0B.
+*/
+
+typedef enum {
+  PWM_OC0A,
+  PWM_OC0B,
+  PWM_OC1A,
+  PWM_OC1B,
+  PWM_OC2A,
+  PWM_OC2B,
+  PWM_CHANNELS
+} EPwmChannel;
+
+typedef enum {
+  PWM_FAST,
+  PWM_PHASE_CORRECT
+} EPwmMode;
+
+/* the timer is claimed by another module */
+#define PWM_ERROR_CLAIMED 0x01
+/* the other channel of the timer runs with another mode or
+   frequency */
+#define PWM_ERROR_CONFIG 0x02
+
+/* 8 bit timers, frequency of a prescaler */
+#define _PWM_HZ8(div, mode)                                     \
+  (F_CPU / (div) / ((mode) == PWM_FAST ? 256UL : 510UL))
+#define _PWM_TIMER0_CS(hz, mode)                                \
+  (_PWM_HZ8(1, mode) <= (hz) ? 1                                \
+   : _PWM_HZ8(8, mode) <= (hz) ? 2                              \
+   : _PWM_HZ8(64, mode) <= (hz) ? 3                             \
+   : _PWM_HZ8(256, mode) <= (hz) ? 4 : 5)
+#define _PWM_TIMER2_CS(hz, mode)                                \
+  (_PWM_HZ8(1, mode) <= (hz) ? 1                                \
+   : _PWM_HZ8(8, mode) <= (hz) ? 2                              \
+   : _PWM_HZ8(32, mode) <= (hz) ? 3                             \
+   : _PWM_HZ8(64, mode) <= (hz) ? 4                             \
+   : _PWM_HZ8(128, mode) <= (hz) ? 5                            \
+   : _PWM_HZ8(256, mode) <= (hz) ? 6 : 7)
+
+/* timer 1, TOP for a prescaler and the smallest prescaler that fits */
+#define _PWM_TOP1(hz, mode, div)                                \
+  ((mode) == PWM_FAST ? F_CPU / (div) / (hz) - 1                \
+   : F_CPU / (div) / (hz) / 2)
+#define _PWM_DIV1(hz, mode)                                     \
+  (_PWM_TOP1(hz, mode, 1) <= 0xFFFF ? 1                         \
+   : _PWM_TOP1(hz, mode, 8) <= 0xFFFF ? 8                       \
+   : _PWM_TOP1(hz, mode, 64) <= 0xFFFF ? 64                     \
+   : _PWM_TOP1(hz, mode, 256) <= 0xFFFF ? 256 : 1024)
+#define _PWM_TIMER1_CS(div)                                     \
+  ((div) == 1 ? 1 : (div) == 8 ? 2 : (div) == 64 ? 3 : (div) == 256 ? 4 : 5)
+
+/* the mode, clock select and TOP arguments of pwm_start */
+#define PWM_TIMER0(hz, mode) (mode), _PWM_TIMER0_CS(hz, mode), 0xFF
+#define PWM_TIMER1(hz, mode)                                    \
+  (mode), _PWM_TIMER1_CS(_PWM_DIV1(hz, mode)),                  \
+    _PWM_TOP1(hz, mode, _PWM_DIV1(hz, mode))
+#define PWM_TIMER2(hz, mode) (mode), _PWM_TIMER2_CS(hz, mode), 0xFF
+/* OC0B on the tick of timer.c, the clock select and TOP are the
+   tick's */
+#define PWM_TIMER0_TICK PWM_FAST, 0, 0
+
+/*
+  starts the timer of the channel (unless its other channel already
+  did, with the same settings) and connects the pin (an output, non
+  inverting, at a duty of 0). ui_top is ignored for timers 0 and 2.
+*/
+uint8_t pwm_start(const EPwmChannel e_channel, const EPwmMode e_mode,
+                  const uint8_t ui_cs, const uint16_t ui_top);
+/* disconnects the pin, the timer is stopped and released with its
+   last channel */
+void pwm_stop(const EPwmChannel e_channel);
+
+/* duty in counts from 0 to pwm_top, shown from the next period */
+void pwm_set(const EPwmChannel e_channel, const uint16_t ui_value);
+uint16_t pwm_top(const EPwmChannel e_channel);
+
+/*
+  changes the frequency of timer 1, the ICR1 register is not double
+  buffered so it is written right after the end of a period (waits
+  for up to a period, on the overflow flag). when timer 1 is stopped,
+  or its overflow interrupt is enabled (and clears the flag), it is
+  written at once and a counter already past the new TOP runs on to
+  0xFFFF. the duty of both channels is in counts, so should be scaled
+  by the caller.
+*/
+void pwm_set_top(const uint16_t ui_top);
+
+/* timer 2 fast pwm on OC2B with a prescaler of 32 (1953Hz) */
 void pwm_init(void);
 
 inline
@@ -0,0 +1,179 @@
+#include <avr/io.h>
+#include <util/atomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ranger.h"
+#include "icr-capture.h"
+#include "timer.h"
+
+/* sound travels 2mm in 11.6 ticks of 0.5us (there and back), as a 16
+   bit fraction: 65536 / 11.6 */
+#define RANGER_MM_PER_TICK_Q16 5650
+
+/* the trigger needs 10us, the first count can be cut short */
+#define RANGER_TRIGGER_COUNTS (10 / TIMER_MICROS_PER_COUNT + 2)
+
+/* last trigger in milliseconds and on the capture timebase, and the
+   rising edge of its echo */
+static uint32_t ui_ranger_triggered;
+static uint32_t ui_ranger_trigger_stamp;
+static uint32_t ui_ranger_rising;
+static bool b_ranger_waiting;
+static bool b_ranger_high;
+
+/* last three readings (the oldest first) and the average in 1/16mm */
+static uint16_t pui_ranger_raw[3];
+static uint16_t ui_ranger_ema;
+static SRangerStats s_ranger_stats;
+
+/*
+  forces OC0B high and lets the compare unit clear it
+  RANGER_TRIGGER_COUNTS later, the compare is not used by the timer
+  interrupts.
+*/
+static
+void ranger_trigger(void) {
+  uint8_t ui_clear;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    /* set on compare, and force it */
+    TCCR0A |= _BV(COM0B1) | _BV(COM0B0);
+    TCCR0B |= _BV(FOC0B);
+    /* clear on compare, within the counting range of timer 0 */
+    ui_clear = TCNT0 + RANGER_TRIGGER_COUNTS;
+#if !defined TIMER_TICKLESS
+    if (ui_clear >= TIMER_COUNTS_PER_TICK) {
+      ui_clear -= TIMER_COUNTS_PER_TICK;
+    }
+#endif
+    OCR0B = ui_clear;
+    TCCR0A &= ~_BV(COM0B0);
+  }
+
+  ui_ranger_triggered = timer_millis();
+  ui_ranger_trigger_stamp = icr_capture_now();
+  b_ranger_waiting = true;
+  b_ranger_high = false;
+}
+
+bool ranger_init(void) {
+  uint8_t i;
+
+  for (i = 0; i < 3; i++) {
+    pui_ranger_raw[i] = RANGER_MAX_MM;
+  }
+  ui_ranger_ema = (uint16_t)RANGER_MAX_MM << 4;
+  ranger_stats_reset();
+
+  /* OC0B output, low until the compare unit drives it */
+  PORTD &= ~_BV(PORTD5);
+  DDRD |= _BV(DDD5);
+
+  if (!icr_capture_start(ICR_CAPTURE_EDGES)) {
+    return false;
+  }
+  ranger_trigger();
+  return true;
+}
+
+void ranger_stop(void) {
+  icr_capture_stop();
+  TCCR0A &= ~(_BV(COM0B1) | _BV(COM0B0));
+  b_ranger_waiting = false;
+}
+
+static inline
+uint16_t ranger_median(const uint16_t a, const uint16_t b, const uint16_t c) {
+  if (a > b) {
+    return b > c ? b : (a > c ? c : a);
+  }
+  return a > c ? a : (b > c ? c : b);
+}
+
+static
+void ranger_filter(const uint16_t ui_mm) {
+  uint16_t ui_median;
+
+  pui_ranger_raw[0] = pui_ranger_raw[1];
+  pui_ranger_raw[1] = pui_ranger_raw[2];
+  pui_ranger_raw[2] = ui_mm;
+  ui_median = ranger_median(pui_ranger_raw[0],
+                            pui_ranger_raw[1],
+                            pui_ranger_raw[2]);
+
+  /* ema += (median - ema) / 2^shift, in 1/16mm so small steps are
+     not lost */
+  ui_ranger_ema += (((int32_t)ui_median << 4) - ui_ranger_ema)
+    >> RANGER_EMA_SHIFT;
+}
+
+bool ranger_poll(void) {
+  const uint32_t ui_now = timer_millis();
+  SIcrEdge s_edge;
+  uint32_t ui_mm;
+  bool b_new = false;
+
+  while (icr_capture_edge(&s_edge)) {
+    /* edges of an echo that timed out (the sensor ignores triggers
+       until it ends) are from before the trigger */
+    if (!b_ranger_waiting
+        || (int32_t)(s_edge.ui_stamp - ui_ranger_trigger_stamp) < 0) {
+      continue;
+    }
+    if (s_edge.b_rising) {
+      ui_ranger_rising = s_edge.ui_stamp;
+      b_ranger_high = true;
+      continue;
+    }
+    if (!b_ranger_high) {
+      continue;
+    }
+
+    b_ranger_waiting = false;
+    ui_mm = (s_edge.ui_stamp - ui_ranger_rising)
+      * RANGER_MM_PER_TICK_Q16 >> 16;
+    ranger_filter(ui_mm < RANGER_MAX_MM ? ui_mm : RANGER_MAX_MM);
+    s_ranger_stats.ui_readings++;
+    b_new = true;
+  }
+
+  if (b_ranger_waiting
+      && ui_now - ui_ranger_triggered >= RANGER_TIMEOUT_MS) {
+    b_ranger_waiting = false;
+    ranger_filter(RANGER_MAX_MM);
+    s_ranger_stats.ui_timeouts++;
+    b_new = true;
+  }
+
+  if (!b_ranger_waiting && ui_now - ui_ranger_triggered >= RANGER_CYCLE_MS) {
+    ranger_trigger();
+  }
+
+  return b_new;
+}
+
+uint16_t ranger_due_ms(void) {
+  const uint32_t ui_elapsed = timer_millis() - ui_ranger_triggered;
+  const uint16_t ui_wait
+    = b_ranger_waiting ? RANGER_TIMEOUT_MS : RANGER_CYCLE_MS;
+
+  return ui_elapsed < ui_wait ? ui_wait - ui_elapsed : 0;
+}
+
+uint16_t ranger_mm(void) {
+  return (ui_ranger_ema + 8) >> 4;
+}
+
+uint16_t ranger_raw_mm(void) {
+  return pui_ranger_raw[2];
+}
+
+void ranger_stats(SRangerStats* const p_stats) {
+  *p_stats = s_ranger_stats;
+}
+
+void ranger_stats_reset(void) {
+  s_ranger_stats.ui_readings = 0;
+  s_ranger_stats.ui_timeouts = 0;
+}
@@ -0,0 +1,84 @@
+#ifndef _RANGER_H
+#define _RANGER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+  Continuous ranging with one HC-SR04, as fast as the sensor allows.
+  The echo is measured by icr-capture (ICP1, arduino pin 8, 0.5us per
+  tick), and the sensor is triggered again as soon as the echo is
+  complete, but not within RANGER_CYCLE_MS of the previous trigger.
+
+  The trigger pulse is made by timer 0 on OC0B (portd pin5, arduino
+  pin 5) without an interrupt or busy wait: a forced compare sets the
+  pin and the compare unit clears it a few timer 0 counts later
+  (12-16us, 64-128us when tickless). Timer 0 keeps its millisecond
+  tick, OC0B is otherwise unused (not together with pwm on OC0B).
+
+  Each width is converted to millimetres with a multiplication and a
+  shift, and filtered by a median of the last three readings (which
+  drops single spikes and lost echoes) and an exponential moving
+  average with a weight of 1 / 2^RANGER_EMA_SHIFT.
+
+    ranger_init();
+    while (1) {
+      if (ranger_poll()) {
+        ui_mm = ranger_mm();
+      }
+    }
+*/
+
+/* minimum time between two triggers, the HC-SR04 datasheet asks for
+   60ms so an echo from a far wall can not be taken for the next
+   one. where there is no far wall (indoors) it can be lowered */
+#if !defined(RANGER_CYCLE_MS)
+  #define RANGER_CYCLE_MS 60
+#endif
+/* no echo after this is out of range (the HC-SR04 gives up after
+   38ms) */
+#if !defined(RANGER_TIMEOUT_MS)
+  #define RANGER_TIMEOUT_MS 40
+#endif
+/* reading used for an echo that is out of range */
+#if !defined(RANGER_MAX_MM)
+  #define RANGER_MAX_MM 4000
+#endif
+#if !defined(RANGER_EMA_SHIFT)
+  #define RANGER_EMA_SHIFT 2
+#endif
+
+typedef struct {
+  /* echoes measured, and triggers without an echo in time */
+  uint16_t ui_readings;
+  uint16_t ui_timeouts;
+} SRangerStats;
+
+/* starts icr-capture and the first trigger, needs timer_init and
+   interrupts enabled. false if timer 1 is used by another module */
+bool ranger_init(void);
+void ranger_stop(void);
+
+/* takes the completed echo and triggers the next one when due, call
+   at least every millisecond (or see ranger_due_ms). returns true
+   when there is a new reading. */
+bool ranger_poll(void);
+
+/*
+  milliseconds until ranger_poll has a timeout or a trigger to do, 0
+  if it is due now. built with ICR_CAPTURE_EVENT the edges of the echo
+  are posted, so a task that runs ranger_poll can be started again
+  after this, and at once from the handler of the event, instead of
+  every millisecond.
+*/
+uint16_t ranger_due_ms(void);
+
+/* filtered distance in millimetres */
+uint16_t ranger_mm(void);
+/* last reading before the filter, RANGER_MAX_MM if out of range */
+uint16_t ranger_raw_mm(void);
+
+void ranger_stats(SRangerStats* const p_stats);
+void ranger_stats_reset(void);
+
+#endif
@@ -0,0 +1,365 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "record.h"
+#include "sdcard.h"
+#include "timer.h"
+
+/* second half, the first is the SSDCard buffer */
+static uint8_t pch_record_buffer[512];
+static uint8_t* pp_record_buffers[2];
+
+static SSDFATCard* p_record_sdfatcard;
+/* the directory entry, the first cluster and the next sector to
+   write */
+static uint32_t ui_record_entry_sector;
+static uint16_t ui_record_entry_offset;
+static uint32_t ui_record_first;
+static uint32_t ui_record_cluster;
+static uint8_t ui_record_sector;
+/* main program, the half to write next, the bytes written (with the
+   header) and the error that ended recording */
+static bool b_record_wav;
+static bool b_record_running;
+static uint8_t ui_record_write;
+static uint32_t ui_record_bytes;
+static uint8_t ui_record_error;
+
+/* halves filled, waiting to be written (the main program frees them) */
+static volatile bool pb_record_full[2];
+/* isr, the filling half and position */
+static volatile uint8_t ui_record_half;
+static volatile uint16_t ui_record_position;
+/* cycles per sample (TOP + 1) and the remainder of F_CPU / rate, as
+   in audio.c */
+static uint16_t ui_record_period;
+static uint16_t ui_record_remainder;
+static uint16_t ui_record_rate;
+static uint16_t ui_record_carry;
+
+static SRecordStats s_record_stats;
+
+/* 8 bit PCM mono, the rates and sizes are filled in */
+static const uint8_t pui_record_wav_header[RECORD_WAV_HEADER] PROGMEM = {
+  'R', 'I', 'F', 'F', 0, 0, 0, 0, 'W', 'A', 'V', 'E',
+  /* format, channels, rate, bytes per second, block align, bits */
+  'f', 'm', 't', ' ', 16, 0, 0, 0, 1, 0, 1, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 8, 0,
+  'd', 'a', 't', 'a', 0, 0, 0, 0
+};
+
+static
+void record_put_uint32(uint8_t* const pui_data, const uint32_t ui_value) {
+  pui_data[0] = ui_value;
+  pui_data[1] = ui_value >> 8;
+  pui_data[2] = ui_value >> 16;
+  pui_data[3] = ui_value >> 24;
+}
+
+/* the sizes of the riff and data chunks for ui_size bytes of samples */
+static
+void record_wav_sizes(uint8_t* const pui_header, const uint32_t ui_size) {
+  record_put_uint32(pui_header + 4, ui_size + RECORD_WAV_HEADER - 8);
+  record_put_uint32(pui_header + 40, ui_size);
+}
+
+/*
+  the next sector of the file, following the chain into the next
+  cluster. false at the end of the chain (or a broken fat), the file
+  is full.
+*/
+static
+bool record_sector_next(uint32_t* const p_sector) {
+  uint32_t ui_next;
+
+  if (ui_record_sector >= p_record_sdfatcard->ui_sectors_per_cluster) {
+    /* both buffers hold samples, so read the fat unbuffered */
+    ui_next = fat32_cluster_lookup_spi(p_record_sdfatcard,
+                                       ui_record_cluster);
+    if (ui_next < 2 || ui_next >= 0x0FFFFFF8) {
+      s_record_stats.b_full = true;
+      return false;
+    }
+    ui_record_cluster = ui_next;
+    ui_record_sector = 0;
+  }
+
+  *p_sector = fat32_cluster_sector(p_record_sdfatcard,
+                                   ui_record_cluster,
+                                   ui_record_sector);
+  ui_record_sector++;
+  return true;
+}
+
+/* writes ui_size bytes of a half (padded to a sector) to the next
+   sector, false when recording has to end */
+static
+bool record_write(const uint8_t* const pch_data, const uint16_t ui_size) {
+  const uint16_t ui_start = timer_stamp();
+  uint32_t ui_sector;
+  uint16_t ui_elapsed;
+
+  /* the previous sector is programmed before the fat is read */
+  ui_record_error = sdcard_wait_ready();
+  if (ui_record_error != 0 || !record_sector_next(&ui_sector)) {
+    return false;
+  }
+  ui_record_error = sdcard_sector_write_begin(p_record_sdfatcard->p_sdcard,
+                                              ui_sector,
+                                              pch_data);
+  if (ui_record_error != 0) {
+    return false;
+  }
+
+  ui_elapsed = timer_stamp() - ui_start;
+  if (ui_elapsed > s_record_stats.ui_write_max) {
+    s_record_stats.ui_write_max = ui_elapsed;
+  }
+  s_record_stats.ui_sectors++;
+  ui_record_bytes += ui_size;
+  return true;
+}
+
+static
+void record_sampling_stop(void) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    ADCSRA = 0;
+    TIMSK1 = 0;
+    TCCR1B = 0;
+  }
+  timer_release(1, TIMER_OWNER_RECORD);
+}
+
+uint8_t record_start(SSDFATCard* const p_sdfatcard,
+                     const char* pch_path,
+                     const uint16_t ui_rate,
+                     const uint8_t ui_channel,
+                     const bool b_wav) {
+  SSDCard* const p_sdcard = p_sdfatcard->p_sdcard;
+  uint32_t ui_size;
+  uint8_t ui_adps;
+  uint8_t r;
+
+  if (ui_rate == 0 || ui_rate > RECORD_RATE_MAX) {
+    return RECORD_ERROR_RATE;
+  }
+
+  r = fat32_file_locate_entry(p_sdfatcard,
+                              pch_path,
+                              &ui_record_first,
+                              &ui_size,
+                              &ui_record_entry_sector,
+                              &ui_record_entry_offset);
+  if (r != 0) {
+    return r;
+  }
+  /* empty files have no cluster */
+  if (ui_record_first < 2) {
+    return RECORD_ERROR_EMPTY;
+  }
+  if (!timer_claim(1, TIMER_OWNER_RECORD)) {
+    return RECORD_ERROR_TIMER;
+  }
+
+  p_record_sdfatcard = p_sdfatcard;
+  ui_record_cluster = ui_record_first;
+  ui_record_sector = 0;
+  b_record_wav = b_wav;
+  ui_record_write = 0;
+  ui_record_bytes = 0;
+  ui_record_error = 0;
+
+  /* the SSDCard buffer is used for samples from now on */
+  pp_record_buffers[0] = p_sdcard->pch_sector;
+  pp_record_buffers[1] = pch_record_buffer;
+  p_sdcard->ui_sector = 0xFFFFFFFF;
+  pb_record_full[0] = false;
+  pb_record_full[1] = false;
+  ui_record_half = 0;
+  ui_record_position = 0;
+
+  if (b_wav) {
+    /* the sizes are written by record_stop, until then the player
+       reads up to the size of the file */
+    memcpy_P(p_sdcard->pch_sector, pui_record_wav_header,
+             RECORD_WAV_HEADER);
+    record_put_uint32(p_sdcard->pch_sector + 24, ui_rate);
+    record_put_uint32(p_sdcard->pch_sector + 28, ui_rate);
+    record_wav_sizes(p_sdcard->pch_sector, 0xFFFFFFFF - RECORD_WAV_HEADER);
+    ui_record_position = RECORD_WAV_HEADER;
+  }
+
+  ui_record_period = F_CPU / ui_rate;
+  ui_record_remainder = F_CPU % ui_rate;
+  ui_record_rate = ui_rate;
+  ui_record_carry = 0;
+
+  memset(&s_record_stats, 0, sizeof(SRecordStats));
+
+  /* the slowest adc clock (F_CPU / 2^ui_adps) that converts within a
+     sample, at most 128 */
+  ui_adps = 7;
+  while ((F_CPU >> ui_adps) < (uint32_t)ui_rate * 14) {
+    ui_adps--;
+  }
+
+  /* AVCC reference, left adjusted so ADCH is the 8 bit sample */
+  ADMUX = _BV(REFS0) | _BV(ADLAR) | (ui_channel & 0x07);
+  if (ui_channel < 6) {
+    DIDR0 |= _BV(ui_channel);
+  }
+  /* the first conversion after enabling takes 25 adc clocks, done
+     before the timer starts */
+  ADCSRA = _BV(ADEN) | _BV(ADSC) | ui_adps;
+  while (ADCSRA & _BV(ADSC)) {}
+  /* then a conversion at each timer 1 compare match B */
+  ADCSRB = _BV(ADTS2) | _BV(ADTS0);
+  ADCSRA = _BV(ADEN) | _BV(ADATE) | _BV(ADIE) | _BV(ADIF) | ui_adps;
+
+  b_record_running = true;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    /* timer 1 in ctc mode (4), counting to OCR1A at F_CPU, compare
+       match B at the start of each period */
+    TCCR1A = 0;
+    TCNT1 = 0;
+    OCR1A = ui_record_period - 1;
+    OCR1B = 0;
+    TIFR1 = _BV(OCF1B);
+    TIMSK1 = _BV(OCIE1B);
+    TCCR1B = _BV(WGM12) | _BV(CS10);
+  }
+  return 0;
+}
+
+bool record_poll(void) {
+  if (!b_record_running) {
+    return false;
+  }
+  if (pb_record_full[ui_record_write]) {
+    if (!record_write(pp_record_buffers[ui_record_write], 512)) {
+      record_sampling_stop();
+      b_record_running = false;
+      return false;
+    }
+    pb_record_full[ui_record_write] = false;
+    ui_record_write ^= 1;
+  }
+  return true;
+}
+
+uint8_t record_stop(void) {
+  SSDCard* const p_sdcard = p_record_sdfatcard->p_sdcard;
+  uint32_t ui_first_sector;
+  uint16_t ui_position;
+  uint16_t ui_size;
+  uint8_t r;
+
+  record_sampling_stop();
+  b_record_running = false;
+
+  /* the filled halves in order, then the part of the filling one */
+  ui_position = ui_record_position;
+  while (ui_record_error == 0 && !s_record_stats.b_full) {
+    if (pb_record_full[ui_record_write]) {
+      ui_size = 512;
+    } else if (ui_record_write == ui_record_half && ui_position > 0) {
+      memset(pp_record_buffers[ui_record_write] + ui_position, 0,
+             512 - ui_position);
+      ui_size = ui_position;
+      ui_position = 0;
+    } else {
+      break;
+    }
+    if (!record_write(pp_record_buffers[ui_record_write], ui_size)) {
+      break;
+    }
+    pb_record_full[ui_record_write] = false;
+    ui_record_write ^= 1;
+  }
+
+  if (ui_record_error == 0) {
+    ui_record_error = sdcard_wait_ready();
+  }
+  if (ui_record_error != 0) {
+    return ui_record_error;
+  }
+
+  /* both buffers held samples */
+  p_sdcard->ui_sector = 0xFFFFFFFF;
+
+  if (b_record_wav && ui_record_bytes >= RECORD_WAV_HEADER) {
+    ui_first_sector = fat32_cluster_sector(p_record_sdfatcard,
+                                           ui_record_first, 0);
+    r = sdcard_sector_read(p_sdcard, ui_first_sector);
+    if (r != 0) {
+      return r;
+    }
+    record_wav_sizes(p_sdcard->pch_sector,
+                     ui_record_bytes - RECORD_WAV_HEADER);
+    r = sdcard_sector_write(p_sdcard, ui_first_sector,
+                            p_sdcard->pch_sector);
+    if (r != 0) {
+      return r;
+    }
+  }
+
+  return fat32_file_set_size(p_record_sdfatcard,
+                             ui_record_entry_sector,
+                             ui_record_entry_offset,
+                             ui_record_bytes);
+}
+
+void record_stats(SRecordStats* const p_stats) {
+  const uint32_t ui_header = b_record_wav ? RECORD_WAV_HEADER : 0;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    *p_stats = s_record_stats;
+  }
+  p_stats->ui_samples
+    = ui_record_bytes > ui_header ? ui_record_bytes - ui_header : 0;
+}
+
+ISR(TIMER1_COMPB_vect) {
+  /* the next period, one cycle longer when the remainder has added
+     up to a cycle (as in audio.c), the counter has just been
+     cleared. the isr clears OCF1B, so the next compare match
+     triggers the adc again */
+  if (ui_record_carry >= ui_record_rate - ui_record_remainder) {
+    ui_record_carry -= ui_record_rate - ui_record_remainder;
+    OCR1A = ui_record_period;
+  } else {
+    ui_record_carry += ui_record_remainder;
+    OCR1A = ui_record_period - 1;
+  }
+}
+
+ISR(ADC_vect) {
+  const uint8_t ui_sample = ADCH;
+  uint8_t ui_half = ui_record_half;
+  uint16_t ui_position = ui_record_position;
+
+  /* both halves are waiting for the card */
+  if (pb_record_full[ui_half]) {
+    s_record_stats.ui_dropped++;
+    return;
+  }
+
+  pp_record_buffers[ui_half][ui_position] = ui_sample;
+  if (++ui_position == 512) {
+    /* filled, to be written by the main program */
+    pb_record_full[ui_half] = true;
+    ui_half ^= 1;
+    ui_record_half = ui_half;
+    ui_position = 0;
+    if (pb_record_full[ui_half]) {
+      s_record_stats.ui_overruns++;
+    }
+  }
+  ui_record_position = ui_position;
+}
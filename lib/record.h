@@ -0,0 +1,99 @@
+#ifndef _RECORD_H
+#define _RECORD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdcard-fat.h"
+
+/*
+  Audio recording from an adc input to a file on the card at an exact
+  sample rate. Timer 1 in ctc mode triggers a conversion at each
+  compare match B (the adc auto trigger), the period alternates
+  between the two whole numbers of cycles around F_CPU / rate as in
+  audio.c. The adc interrupt stores the result (unsigned 8 bit, the
+  high byte of the left adjusted result) into two sector sized
+  halves, the SSDCard buffer and a static one, and while it fills one
+  the main program writes the other to the next sector of the file:
+
+    record_start(&g_sdfatcard, "/rec.wav", 22050, 0, true);
+    while (record_poll() && !done) {}
+    record_stop();
+
+  The file must already exist with clusters allocated for the
+  recording (e.g. created on a pc, as for upload.h), recording ends
+  when it is full. The sectors are written in order with
+  sdcard_sector_write_begin, so the card programs a sector while the
+  next half is sampled. record_stop writes the last part of a half,
+  the sizes of the WAV header and the size in the directory entry. A
+  WAV file (8 bit PCM mono) or raw samples (unsigned 8 bit, as the
+  raw files of the player) can be recorded.
+
+  When the adc finds both halves still waiting for the card the
+  samples are dropped (the recording then has a gap) and counted. The
+  longest write, from waiting for the card to finish the previous
+  sector to the data of the next one accepted, must stay under the
+  time of a half (512 samples, 11.6ms at 44.1kHz), so 512 samples per
+  write time is the rate the card sustains. The times are measured
+  with timer_stamp (64 cycle units), so timer_init must have been
+  called.
+*/
+
+/* highest rate, a conversion takes 13.5 adc clocks and the adc clock
+   is at most F_CPU / 16 (1MHz, enough for 8 bits) */
+#define RECORD_RATE_MAX (F_CPU / 16 / 14)
+
+/* errors of record_start, or the error of the sdcard/fat layer */
+/* a rate of 0 or above RECORD_RATE_MAX */
+#define RECORD_ERROR_RATE 0x01
+/* timer 1 is used by another module */
+#define RECORD_ERROR_TIMER 0x02
+/* the file has no clusters */
+#define RECORD_ERROR_EMPTY 0x03
+
+/* size of the WAV header before the samples */
+#define RECORD_WAV_HEADER 44
+
+typedef struct {
+  /* samples written to the file */
+  uint32_t ui_samples;
+  /* samples lost as both halves were waiting for the card */
+  uint32_t ui_dropped;
+  /* times the adc found both halves full, the gaps in the recording */
+  uint16_t ui_overruns;
+  /* sectors written, and the longest write in units of 64 cycles */
+  uint32_t ui_sectors;
+  uint16_t ui_write_max;
+  /* the file ran out of clusters */
+  bool b_full;
+} SRecordStats;
+
+/*
+  starts recording adc input ui_channel (0 to 7, referenced to AVCC)
+  at ui_rate into the file pch_path, with a WAV header if b_wav.
+  returns 0, one of the RECORD_ERROR codes or the error of
+  fat32_file_locate_entry.
+*/
+uint8_t record_start(SSDFATCard* const p_sdfatcard,
+                     const char* pch_path,
+                     const uint16_t ui_rate,
+                     const uint8_t ui_channel,
+                     const bool b_wav);
+
+/*
+  writes a half that has been filled, call from the main loop at
+  least once per half. returns false once recording has ended, the
+  file is full or a write failed.
+*/
+bool record_poll(void);
+
+/*
+  stops sampling, writes what has been sampled and updates the header
+  and the file size. returns 0 or the error of the sdcard/fat layer
+  (also one that ended the recording in record_poll).
+*/
+uint8_t record_stop(void);
+
+void record_stats(SRecordStats* const p_stats);
+
+#endif
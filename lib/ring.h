@@ -0,0 +1,155 @@
+#ifndef _RING_H
+#define _RING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+  Single producer, single consumer ring buffers that are safe to
+  share between an ISR and the main program, e.g. the ISR pushes and
+  the main program pops (or the reverse).
+
+  RING_DEFINE(name, type, size) generates the type name_t and the
+  functions below, all prefixed with name_. size must be a power of
+  two (from 2 up to 256) so indices are wrapped with a mask instead of
+  a division, one element is always kept free to distinguish full
+  from empty. E.g.
+
+    RING_DEFINE(rx_ring, uint8_t, 64)
+    static rx_ring_t rx;
+
+  The indices are single bytes, so reads and writes of them are atomic
+  on the avr. Only the producer writes ui_head and only the consumer
+  writes ui_tail, the compiler barriers order the element access
+  against the index update so that an element is always complete
+  before it is published. Use from more than one producer (or
+  consumer) must be serialised by the caller, e.g. with cli.
+
+    void    name_init(name_t*)
+    bool    name_empty(const name_t*)
+    uint8_t name_count(const name_t*)        elements queued
+    uint8_t name_free(const name_t*)         elements that can be pushed
+    bool    name_push(name_t*, type)         false if full
+    bool    name_pop(name_t*, type*)         false if empty
+    uint8_t name_push_span(name_t*, const type*, uint8_t n)
+    uint8_t name_pop_span(name_t*, type*, uint8_t n)
+    uint8_t name_discard(name_t*, uint8_t n)
+
+  The span variants copy as many elements as possible (up to n) and
+  publish them with a single index update, the number copied is
+  returned. discard drops up to n of the oldest elements, it is a
+  consumer operation, so when called by the producer the consumer
+  must be excluded (e.g. interrupts disabled).
+*/
+
+/* stops the compiler reordering memory accesses across the barrier */
+#define RING_BARRIER() __asm__ __volatile__ ("" ::: "memory")
+
+#define RING_DEFINE(name, type, size)                                   \
+  typedef char name##_size_check                                        \
+    [(size) >= 2 && (size) <= 256 && ((size) & ((size) - 1)) == 0       \
+     ? 1 : -1];                                                         \
+                                                                        \
+  typedef struct {                                                      \
+    volatile uint8_t ui_head;                                           \
+    volatile uint8_t ui_tail;                                           \
+    type p_data[size];                                                  \
+  } name##_t;                                                           \
+                                                                        \
+  static inline                                                         \
+  void name##_init(name##_t* const p_ring) {                            \
+    p_ring->ui_head = 0;                                                \
+    p_ring->ui_tail = 0;                                                \
+  }                                                                     \
+                                                                        \
+  static inline                                                         \
+  bool name##_empty(const name##_t* const p_ring) {                     \
+    return p_ring->ui_head == p_ring->ui_tail;                          \
+  }                                                                     \
+                                                                        \
+  static inline                                                         \
+  uint8_t name##_count(const name##_t* const p_ring) {                  \
+    return (uint8_t)(p_ring->ui_head - p_ring->ui_tail) & ((size) - 1); \
+  }                                                                     \
+                                                                        \
+  static inline                                                         \
+  uint8_t name##_free(const name##_t* const p_ring) {                   \
+    return ((size) - 1) - name##_count(p_ring);                         \
+  }                                                                     \
+                                                                        \
+  static inline                                                         \
+  bool name##_push(name##_t* const p_ring, const type data) {           \
+    const uint8_t ui_head = p_ring->ui_head;                            \
+    const uint8_t ui_next = (ui_head + 1) & ((size) - 1);               \
+    if (ui_next == p_ring->ui_tail) {                                   \
+      return false;                                                     \
+    }                                                                   \
+    p_ring->p_data[ui_head] = data;                                     \
+    RING_BARRIER();                                                     \
+    p_ring->ui_head = ui_next;                                          \
+    return true;                                                        \
+  }                                                                     \
+                                                                        \
+  static inline                                                         \
+  bool name##_pop(name##_t* const p_ring, type* const p_data) {         \
+    const uint8_t ui_tail = p_ring->ui_tail;                            \
+    if (ui_tail == p_ring->ui_head) {                                   \
+      return false;                                                     \
+    }                                                                   \
+    RING_BARRIER();                                                     \
+    *p_data = p_ring->p_data[ui_tail];                                  \
+    RING_BARRIER();                                                     \
+    p_ring->ui_tail = (ui_tail + 1) & ((size) - 1);                     \
+    return true;                                                        \
+  }                                                                     \
+                                                                        \
+  static inline                                                         \
+  uint8_t name##_push_span(name##_t* const p_ring,                      \
+                           const type* p_data,                          \
+                           uint8_t ui_count) {                          \
+    uint8_t ui_head = p_ring->ui_head;                                  \
+    const uint8_t ui_free = name##_free(p_ring);                        \
+    uint8_t i;                                                          \
+    if (ui_count > ui_free) {                                           \
+      ui_count = ui_free;                                               \
+    }                                                                   \
+    for (i = 0; i < ui_count; i++) {                                    \
+      p_ring->p_data[ui_head] = *p_data++;                              \
+      ui_head = (ui_head + 1) & ((size) - 1);                           \
+    }                                                                   \
+    RING_BARRIER();                                                     \
+    p_ring->ui_head = ui_head;                                          \
+    return ui_count;                                                    \
+  }                                                                     \
+                                                                        \
+  static inline                                                         \
+  uint8_t name##_pop_span(name##_t* const p_ring,                       \
+                          type* p_data,                                 \
+                          uint8_t ui_count) {                           \
+    uint8_t ui_tail = p_ring->ui_tail;                                  \
+    const uint8_t ui_used = name##_count(p_ring);                       \
+    uint8_t i;                                                          \
+    if (ui_count > ui_used) {                                           \
+      ui_count = ui_used;                                               \
+    }                                                                   \
+    RING_BARRIER();                                                     \
+    for (i = 0; i < ui_count; i++) {                                    \
+      *p_data++ = p_ring->p_data[ui_tail];                              \
+      ui_tail = (ui_tail + 1) & ((size) - 1);                           \
+    }                                                                   \
+    RING_BARRIER();                                                     \
+    p_ring->ui_tail = ui_tail;                                          \
+    return ui_count;                                                    \
+  }                                                                     \
+                                                                        \
+  static inline                                                         \
+  uint8_t name##_discard(name##_t* const p_ring, uint8_t ui_count) {    \
+    const uint8_t ui_used = name##_count(p_ring);                       \
+    if (ui_count > ui_used) {                                           \
+      ui_count = ui_used;                                               \
+    }                                                                   \
+    p_ring->ui_tail = (p_ring->ui_tail + ui_count) & ((size) - 1);      \
+    return ui_count;                                                    \
+  }
+
+#endif
@@ -0,0 +1,326 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
+
+#include "sched.h"
+#include "ring.h"
+#include "timer.h"
+
+#if (SCHED_WHEEL_SLOTS & (SCHED_WHEEL_SLOTS - 1)) != 0
+  #error "SCHED_WHEEL_SLOTS must be a power of two"
+#endif
+
+#define SCHED_WHEEL_MASK (SCHED_WHEEL_SLOTS - 1)
+
+typedef struct {
+  uint8_t ui_event;
+  uint16_t ui_data;
+} SSchedEvent;
+
+RING_DEFINE(sched_queue, SSchedEvent, SCHED_QUEUE_SIZE)
+
+static sched_queue_t s_sched_queue;
+static FSchedEvent f_sched_handlers[SCHED_EVENTS];
+static SSchedTask* p_sched_wheel[SCHED_WHEEL_SLOTS];
+/* the due tasks of the slot being run, unlinked from the wheel */
+static SSchedTask* p_sched_due;
+/* next millisecond of the wheel to be checked */
+static uint32_t ui_sched_time;
+
+/* written from interrupts, read with interrupts disabled */
+static volatile uint16_t ui_sched_posted;
+static volatile uint16_t ui_sched_dropped;
+static volatile uint8_t ui_sched_queue_max;
+static uint32_t ui_sched_handler_max;
+static uint16_t ui_sched_wakeups;
+static uint32_t ui_sched_idle_micros;
+static uint16_t ui_sched_wake_late_max;
+
+/* microseconds since the stamp, up to 262ms */
+static inline
+uint32_t sched_elapsed_us(const uint16_t ui_stamp) {
+  return (uint32_t)(uint16_t)(timer_stamp() - ui_stamp)
+    * (TIMER_CYCLES_PER_STAMP / (F_CPU / 1000000));
+}
+
+static
+void sched_insert(SSchedTask* const p_task) {
+  uint32_t ui_slot_time = p_task->ui_deadline;
+
+  /* a deadline that has passed goes into the slot checked next, not
+     into one a round away */
+  if ((int32_t)(ui_slot_time - ui_sched_time) < 0) {
+    ui_slot_time = ui_sched_time;
+  }
+
+  p_task->p_next = p_sched_wheel[ui_slot_time & SCHED_WHEEL_MASK];
+  p_sched_wheel[ui_slot_time & SCHED_WHEEL_MASK] = p_task;
+  p_task->b_scheduled = true;
+}
+
+/* unlinks the task from a list, true if it was in it */
+static
+bool sched_unlink(SSchedTask** pp_task, SSchedTask* const p_task) {
+  for (; *pp_task != NULL; pp_task = &((*pp_task)->p_next)) {
+    if (*pp_task == p_task) {
+      *pp_task = p_task->p_next;
+      return true;
+    }
+  }
+  return false;
+}
+
+static
+void sched_remove(SSchedTask* const p_task) {
+  uint8_t i;
+  /* a task due in the slot being run (started or stopped by a task
+     run before it) is on the due list, not on the wheel */
+  bool b_found = sched_unlink(&p_sched_due, p_task);
+
+  for (i = 0; !b_found && i < SCHED_WHEEL_SLOTS; i++) {
+    b_found = sched_unlink(&(p_sched_wheel[i]), p_task);
+  }
+  p_task->b_scheduled = false;
+}
+
+void sched_init(void) {
+  sched_queue_init(&s_sched_queue);
+  memset(f_sched_handlers, 0, sizeof(f_sched_handlers));
+  memset(p_sched_wheel, 0, sizeof(p_sched_wheel));
+  p_sched_due = NULL;
+  ui_sched_time = timer_millis();
+  sched_stats_reset();
+}
+
+void sched_task_init(SSchedTask* const p_task,
+                     const FSchedTask f_run,
+                     void* const p_arg) {
+  memset(p_task, 0, sizeof(SSchedTask));
+  p_task->f_run = f_run;
+  p_task->p_arg = p_arg;
+}
+
+void sched_start(SSchedTask* const p_task,
+                 const uint16_t ui_delay,
+                 const uint16_t ui_period) {
+  if (p_task->b_scheduled) {
+    sched_remove(p_task);
+  }
+  p_task->ui_deadline = timer_millis() + ui_delay;
+  p_task->ui_period = ui_period;
+  sched_insert(p_task);
+}
+
+void sched_stop(SSchedTask* const p_task) {
+  if (p_task->b_scheduled) {
+    sched_remove(p_task);
+  }
+}
+
+void sched_event_handler(const uint8_t ui_event, const FSchedEvent f_handler) {
+  if (ui_event < SCHED_EVENTS) {
+    f_sched_handlers[ui_event] = f_handler;
+  }
+}
+
+bool sched_post(const uint8_t ui_event, const uint16_t ui_data) {
+  const SSchedEvent s_event = { ui_event, ui_data };
+  bool b_queued;
+  uint8_t ui_count;
+
+  /* interrupts do not nest, so this only excludes the main program
+     when it posts, which keeps the queue single producer */
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    b_queued = sched_queue_push(&s_sched_queue, s_event);
+    if (b_queued) {
+      ui_sched_posted++;
+      ui_count = sched_queue_count(&s_sched_queue);
+      if (ui_count > ui_sched_queue_max) {
+        ui_sched_queue_max = ui_count;
+      }
+    } else {
+      ui_sched_dropped++;
+    }
+  }
+
+  return b_queued;
+}
+
+/* runs the due tasks in the slot of ui_sched_time, true if any */
+static
+bool sched_run_slot(const uint32_t ui_now) {
+  SSchedTask** pp_task = &(p_sched_wheel[ui_sched_time & SCHED_WHEEL_MASK]);
+  SSchedTask* p_task;
+  uint32_t ui_late;
+  uint32_t ui_run;
+  uint16_t ui_stamp;
+  bool b_run;
+
+  /* unlink the due tasks first, a periodic task may be inserted into
+     this slot again. they stay scheduled until they run, so a task
+     can still stop or move one that is due after it */
+  while (*pp_task != NULL) {
+    p_task = *pp_task;
+    if ((int32_t)(ui_sched_time - p_task->ui_deadline) >= 0) {
+      *pp_task = p_task->p_next;
+      p_task->p_next = p_sched_due;
+      p_sched_due = p_task;
+    } else {
+      /* due in a later round */
+      pp_task = &(p_task->p_next);
+    }
+  }
+
+  /* the slot is done, a task started from a task with no delay goes
+     into the next slot */
+  ui_sched_time++;
+
+  b_run = p_sched_due != NULL;
+  while (p_sched_due != NULL) {
+    p_task = p_sched_due;
+    p_sched_due = p_task->p_next;
+    p_task->b_scheduled = false;
+
+    ui_late = ui_now - p_task->ui_deadline;
+    if (ui_late > p_task->ui_late_max) {
+      p_task->ui_late_max = ui_late > 0xFFFF ? 0xFFFF : ui_late;
+    }
+
+    if (p_task->ui_period != 0) {
+      /* reschedule before the run, so the task can stop itself. runs
+         that were missed completely are skipped, not caught up */
+      do {
+        p_task->ui_deadline += p_task->ui_period;
+      } while ((int32_t)(ui_now - p_task->ui_deadline) >= 0);
+      sched_insert(p_task);
+    }
+
+    ui_stamp = timer_stamp();
+    p_task->f_run(p_task->p_arg);
+    ui_run = sched_elapsed_us(ui_stamp);
+
+    p_task->ui_runs++;
+    p_task->ui_run_total += ui_run;
+    if (ui_run > p_task->ui_run_max) {
+      p_task->ui_run_max = ui_run;
+    }
+  }
+
+  return b_run;
+}
+
+bool sched_run(void) {
+  SSchedEvent s_event;
+  uint32_t ui_now;
+  uint32_t ui_run;
+  uint16_t ui_stamp;
+  bool b_run = false;
+
+  while (sched_queue_pop(&s_sched_queue, &s_event)) {
+    if (s_event.ui_event < SCHED_EVENTS &&
+        f_sched_handlers[s_event.ui_event] != NULL) {
+      ui_stamp = timer_stamp();
+      f_sched_handlers[s_event.ui_event](s_event.ui_data);
+      ui_run = sched_elapsed_us(ui_stamp);
+      if (ui_run > ui_sched_handler_max) {
+        ui_sched_handler_max = ui_run;
+      }
+    }
+    b_run = true;
+  }
+
+  /* advance the wheel to the current millisecond, after a long task
+     this checks each of the slots that were passed */
+  ui_now = timer_millis();
+  while ((int32_t)(ui_now - ui_sched_time) >= 0) {
+    b_run |= sched_run_slot(ui_now);
+  }
+
+  return b_run;
+}
+
+/* earliest deadline of the scheduled tasks, false if there are none */
+static
+bool sched_next_deadline(uint32_t* const p_deadline) {
+  SSchedTask* p_task;
+  bool b_found = false;
+  uint8_t i;
+
+  for (i = 0; i < SCHED_WHEEL_SLOTS; i++) {
+    for (p_task = p_sched_wheel[i]; p_task != NULL; p_task = p_task->p_next) {
+      if (!b_found ||
+          (int32_t)(p_task->ui_deadline - *p_deadline) < 0) {
+        *p_deadline = p_task->ui_deadline;
+        b_found = true;
+      }
+    }
+  }
+
+  return b_found;
+}
+
+void sched_idle(void) {
+  uint32_t ui_deadline;
+  uint32_t ui_start;
+  uint32_t ui_wake;
+  uint32_t ui_late;
+  bool b_deadline;
+
+  b_deadline = sched_next_deadline(&ui_deadline);
+
+  /* with interrupts disabled an event can not be posted, nor the
+     deadline pass, between the check and the sleep */
+  cli();
+  if (!sched_queue_empty(&s_sched_queue) ||
+      (b_deadline && !timer_wake_at(ui_deadline))) {
+    sei();
+    return;
+  }
+
+  ui_start = timer_micros();
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  sleep_enable();
+  /* the instruction after sei is executed before any interrupt */
+  sei();
+  sleep_cpu();
+  sleep_disable();
+  ui_wake = timer_micros();
+
+  ui_sched_wakeups++;
+  ui_sched_idle_micros += ui_wake - ui_start;
+  if (b_deadline) {
+    ui_late = ui_wake - ui_deadline * 1000;
+    if ((int32_t)ui_late >= 0 && ui_late > ui_sched_wake_late_max) {
+      ui_sched_wake_late_max = ui_late > 0xFFFF ? 0xFFFF : ui_late;
+    }
+  }
+}
+
+void sched_stats(SSchedStats* const p_stats) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    p_stats->ui_posted = ui_sched_posted;
+    p_stats->ui_dropped = ui_sched_dropped;
+    p_stats->ui_queue_max = ui_sched_queue_max;
+  }
+  p_stats->ui_handler_max = ui_sched_handler_max;
+  p_stats->ui_wakeups = ui_sched_wakeups;
+  p_stats->ui_idle_micros = ui_sched_idle_micros;
+  p_stats->ui_wake_late_max = ui_sched_wake_late_max;
+}
+
+void sched_stats_reset(void) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    ui_sched_posted = 0;
+    ui_sched_dropped = 0;
+    ui_sched_queue_max = 0;
+  }
+  ui_sched_handler_max = 0;
+  ui_sched_wakeups = 0;
+  ui_sched_idle_micros = 0;
+  ui_sched_wake_late_max = 0;
+}
@@ -0,0 +1,135 @@
+#ifndef _SCHED_H
+#define _SCHED_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+  Cooperative scheduler, tasks and event handlers run from sched_run
+  in the main loop and run to completion.
+
+  Timed tasks are kept in a hashed timer wheel of SCHED_WHEEL_SLOTS
+  lists, one per millisecond (the tick of TIMER0_COMPA_vect), a task
+  is in the list of its deadline modulo the number of slots. Each tick
+  only the list of that slot is checked, so the cost does not depend
+  on the number of tasks. Deadlines are compared as the signed
+  difference to the current time, so they are correct across the
+  wrap of timer_millis (after 49.7 days) as long as a delay is under
+  24.8 days.
+
+  When there is nothing to run sched_idle puts the cpu into idle sleep
+  until the next interrupt, with TIMER_TICKLESS the timer interrupt is
+  set to the next deadline so the cpu is only woken when there is
+  work (or every 16ms).
+
+  Interrupts post events (an id and 16 bits of data) with sched_post
+  into a ring buffer, sched_run passes each to the handler registered
+  for the id. The main program never disables interrupts to take an
+  event.
+
+    static SSchedTask s_blink;
+    sched_init();
+    sched_task_init(&s_blink, blink, NULL);
+    sched_start(&s_blink, 0, 500);
+    sched_event_handler(EVENT_ECHO, echo);
+    while (1) {
+      if (!sched_run()) {
+        sched_idle();
+      }
+    }
+*/
+
+/* number of slots in the timer wheel, a power of two */
+#if !defined(SCHED_WHEEL_SLOTS)
+  #define SCHED_WHEEL_SLOTS 16
+#endif
+
+/* number of event ids, and events that can be queued (a power of
+   two) */
+#if !defined(SCHED_EVENTS)
+  #define SCHED_EVENTS 4
+#endif
+#if !defined(SCHED_QUEUE_SIZE)
+  #define SCHED_QUEUE_SIZE 16
+#endif
+
+typedef void (*FSchedTask)(void* p_arg);
+typedef void (*FSchedEvent)(uint16_t ui_data);
+
+typedef struct SSchedTask {
+  struct SSchedTask* p_next;
+  FSchedTask f_run;
+  void* p_arg;
+
+  /* timer_millis when the task is due */
+  uint32_t ui_deadline;
+  /* milliseconds between runs, 0 for a one shot task */
+  uint16_t ui_period;
+  bool b_scheduled;
+
+  /* statistics, run time in microseconds (4us resolution) and the
+     time (in milliseconds) the task started after its deadline */
+  uint16_t ui_runs;
+  uint32_t ui_run_total;
+  uint32_t ui_run_max;
+  uint16_t ui_late_max;
+} SSchedTask;
+
+typedef struct {
+  /* events posted, and not queued as the queue was full */
+  uint16_t ui_posted;
+  uint16_t ui_dropped;
+  /* most events waiting at once */
+  uint8_t ui_queue_max;
+  /* longest run of an event handler in microseconds */
+  uint32_t ui_handler_max;
+  /* times sched_idle slept, and the microseconds asleep */
+  uint16_t ui_wakeups;
+  uint32_t ui_idle_micros;
+  /* longest time from a deadline to the wake up for it, in
+     microseconds */
+  uint16_t ui_wake_late_max;
+} SSchedStats;
+
+void sched_init(void);
+
+void sched_task_init(SSchedTask* const p_task,
+                     const FSchedTask f_run,
+                     void* const p_arg);
+
+/*
+  schedules the task to run in ui_delay milliseconds, then every
+  ui_period milliseconds (if not 0). a task that is already scheduled
+  is moved.
+*/
+void sched_start(SSchedTask* const p_task,
+                 const uint16_t ui_delay,
+                 const uint16_t ui_period);
+
+void sched_stop(SSchedTask* const p_task);
+
+/* handler to call for events posted with ui_event */
+void sched_event_handler(const uint8_t ui_event, const FSchedEvent f_handler);
+
+/*
+  queues an event, safe to call from an interrupt (and from the main
+  program). returns false if the queue is full.
+*/
+bool sched_post(const uint8_t ui_event, const uint16_t ui_data);
+
+/*
+  runs the queued event handlers and the tasks that are due. returns
+  true if anything was run.
+*/
+bool sched_run(void);
+
+/*
+  idle sleep until the next interrupt, returns at once if an event is
+  queued or a task is due. call when sched_run returns false.
+*/
+void sched_idle(void);
+
+void sched_stats(SSchedStats* const p_stats);
+void sched_stats_reset(void);
+
+#endif
@@ -3,9 +3,16 @@
 #include <ctype.h>
 
 #include "sdcard-fat.h"
+#include "prof.h"
 
-/* debugging statements are only included if debug flag is set */
-#if defined(DEBUG)
+/* debugging statements are only included if debug flag is set,
+   with DEBUG_DLOG they are sent as deferred log records (see dlog.h) */
+#if defined(DEBUG) && defined(DEBUG_DLOG)
+  #include "dlog.h"
+  #include "usart_p.h"
+  #define printf_P(fmt,...) dlog("FAT> " fmt,__VA_ARGS__)
+  #define print_P(fmt) dlog0("FAT> " fmt)
+#elif defined(DEBUG)
   #include "usart_p.h"
   #define printf_P(fmt,...) usart_printf_P(PSTR("FAT> " fmt),__VA_ARGS__)
   #define print_P(fmt) printf_P(fmt, 0)
@@ -138,6 +145,25 @@ uint8_t fat32_init(SSDCard* const p_sdcard,
   return r;
 }
 
+/*
+  external definition of the inline reader, for the calls the compiler
+  does not inline (more than one call site in a module, e.g. wav.c)
+*/
+extern int16_t fat32_file_read_byte_spi(SSDFAT_File* const p_sdfile);
+
+/*
+  Calculate the absolute sector on the card of a sector within a
+  fat32 cluster.
+*/
+uint32_t fat32_cluster_sector(SSDFATCard* p_sdfatcard,
+                              uint32_t ui_cluster,
+                              uint8_t ui_sector) {
+  return
+    p_sdfatcard->ui_cluster_offset +
+    p_sdfatcard->ui_sectors_per_cluster * (ui_cluster - 2) +
+    ui_sector;
+}
+
 /*
   read a sector from a fat32 cluster, the caller is required to call
   spi 512 times to read the whole sector. during invocation, the CS is
@@ -150,9 +176,7 @@ uint8_t fat32_cluster_read(SSDFATCard* p_sdfatcard,
                            uint8_t ui_sector) {
   return sdcard_sector_read_begin(
     p_sdfatcard->p_sdcard,
-    p_sdfatcard->ui_cluster_offset +
-    p_sdfatcard->ui_sectors_per_cluster * (ui_cluster - 2) +
-    ui_sector);
+    fat32_cluster_sector(p_sdfatcard, ui_cluster, ui_sector));
 }
 
 /*
@@ -160,7 +184,6 @@ uint8_t fat32_cluster_read(SSDFATCard* p_sdfatcard,
 
   A value of 0xFFFFFFFF is an invalid cluster.
 */
-static
 uint32_t fat32_cluster_lookup(SSDFATCard* p_sdfatcard, uint32_t ui_cluster) {
   uint32_t ui_sector = ui_cluster / 128; /* 128 is the number of
                                             clusters in a sector */
@@ -181,6 +204,7 @@ uint32_t fat32_cluster_lookup(SSDFATCard* p_sdfatcard, uint32_t ui_cluster) {
   }
 
   /* read the sector where the cluster is */
+  PROF_BEGIN(PROF_FAT_LOOKUP);
   r = sdcard_sector_read(p_sdfatcard->p_sdcard,
                          p_sdfatcard->p_sdcard->ui_partition_first_sector +
                          p_sdfatcard->ui_fat_offset +
@@ -198,22 +222,72 @@ uint32_t fat32_cluster_lookup(SSDFATCard* p_sdfatcard, uint32_t ui_cluster) {
                   ui_sector_offset + 2,
                   ui_sector_offset + 3);
 
+  PROF_END(PROF_FAT_LOOKUP);
   return ui_cluster_value;
 }
 
 /*
-  Initialise a file system chain
+  Lookup a cluster value in the fat, reading the fat sector directly
+  from the spi bus so the SSDCard buffer is left untouched.
+
+  A value of 0xFFFFFFFF is an invalid cluster.
+*/
+uint32_t fat32_cluster_lookup_spi(SSDFATCard* p_sdfatcard,
+                                  uint32_t ui_cluster) {
+  uint32_t ui_sector = ui_cluster / 128;
+  uint16_t ui_sector_offset = (ui_cluster % 128) * 4;
+  uint32_t ui_cluster_value = 0;
+  uint16_t i;
+  uint8_t r;
+
+  /* cluster 0 and 1 are special */
+  if (ui_cluster < 2) {
+    print_P("Cluster number is out of range (too small)\n");
+    return 0xFFFFFFFF;
+  }
+
+  /* sector is valid by the fs */
+  if (ui_sector > p_sdfatcard->ui_fat_sectors) {
+    print_P("Cluster number is out of range (too large)\n");
+    return 0xFFFFFFFF;
+  }
+
+  r = sdcard_sector_read_begin(p_sdfatcard->p_sdcard,
+                               p_sdfatcard->p_sdcard->ui_partition_first_sector +
+                               p_sdfatcard->ui_fat_offset +
+                               ui_sector);
+  if (r != 0) {
+    print_P("Failed to read FAT\n");
+    return 0xFFFFFFFF;
+  }
+
+  /* keep the 4 (little endian) bytes of the cluster */
+  for (i = 0; i < 512; i++) {
+    r = spi_master_transmit(0xFF);
+    if (i >= ui_sector_offset && i < ui_sector_offset + 4) {
+      ui_cluster_value |= (uint32_t)r << (8 * (i - ui_sector_offset));
+    }
+  }
+  sdcard_send_command_frame_data_end();
+
+  return ui_cluster_value;
+}
+
+/*
+  Initialise a file system chain, with the fat entry of its first
+  cluster already looked up
 */
 static
-uint8_t fat32_chain_init(SSDFAT_Chain* const p_chain,
-                         SSDFATCard* const p_sdfatcard,
-                         const uint32_t ui_cluster) {
+uint8_t fat32_chain_init_next(SSDFAT_Chain* const p_chain,
+                              SSDFATCard* const p_sdfatcard,
+                              const uint32_t ui_cluster,
+                              const uint32_t ui_next_cluster) {
   uint8_t r = 0;
 
   /* setup the chain structure */
   p_chain->ui_sector = 0;
   p_chain->ui_cluster = ui_cluster;
-  p_chain->ui_next_cluster = fat32_cluster_lookup(p_sdfatcard, ui_cluster);
+  p_chain->ui_next_cluster = ui_next_cluster;
   p_chain->p_sdfatcard = p_sdfatcard;
 
   /* if cluster was not used or invalid, abort */
@@ -231,6 +305,18 @@ uint8_t fat32_chain_init(SSDFAT_Chain* const p_chain,
   return r;
 }
 
+/*
+  Initialise a file system chain
+*/
+static
+uint8_t fat32_chain_init(SSDFAT_Chain* const p_chain,
+                         SSDFATCard* const p_sdfatcard,
+                         const uint32_t ui_cluster) {
+  return fat32_chain_init_next(p_chain, p_sdfatcard, ui_cluster,
+                               fat32_cluster_lookup(p_sdfatcard,
+                                                    ui_cluster));
+}
+
 /*
   Initialise a file system chain
 */
@@ -242,6 +328,12 @@ uint8_t fat32_chain_buffer(SSDFAT_Chain* const p_chain) {
      p_chain->p_sdfatcard->p_sdcard->pch_sector[i]
        = spi_master_transmit(0xFF);
   }
+  /* the buffered sector, so sdcard_sector_read does not take the
+     buffer for another sector */
+  p_chain->p_sdfatcard->p_sdcard->ui_sector
+    = fat32_cluster_sector(p_chain->p_sdfatcard,
+                           p_chain->ui_cluster,
+                           p_chain->ui_sector);
 
   /* end of sector reached, close spi */
   return sdcard_send_command_frame_data_end();
@@ -476,10 +568,12 @@ bool is_8_3_equal(const char* pch_83_raw,
 
   Assumes a unix style path, i.e. /path/to/file.ext
  */
-uint8_t fat32_file_locate(SSDFATCard* const p_sdfatcard,
-                          const char* pch_path,
-                          uint32_t* const ui_file_cluster,
-                          uint32_t* const ui_file_size) {
+uint8_t fat32_file_locate_entry(SSDFATCard* const p_sdfatcard,
+                                const char* pch_path,
+                                uint32_t* const ui_file_cluster,
+                                uint32_t* const ui_file_size,
+                                uint32_t* const p_entry_sector,
+                                uint16_t* const p_entry_offset) {
   uint8_t r;
   SSDFAT_Chain chain;
   uint16_t ui_entry;
@@ -503,6 +597,12 @@ uint8_t fat32_file_locate(SSDFATCard* const p_sdfatcard,
  nextsegment:
   /* move to next segment */
   pch_path = pch_path_segment_end + 1;
+  /* a path ending in '/' is the directory */
+  if (*pch_path == '\0') {
+    *ui_file_cluster = ui_cluster;
+    *ui_file_size = 0;
+    return 0;
+  }
   pch_path_segment_end = strchrnul(pch_path,'/');
   if (pch_path_segment_end == pch_path) {
     /* badly formed file path */
@@ -602,12 +702,13 @@ uint8_t fat32_file_locate(SSDFATCard* const p_sdfatcard,
                 ui_cluster = *ui_file_cluster;
                 goto nextsegment;
               } else if (!(pch_sector[ui_entry + 0x0B] & 0x10) && b_is_file) {
-                /*
-                   file found
-
-                   TODO: return a reference to the directory entry for
-                   write capability
-                 */
+                /* file found */
+                if (p_entry_sector != NULL) {
+                  *p_entry_sector = fat32_cluster_sector(p_sdfatcard,
+                                                         chain.ui_cluster,
+                                                         chain.ui_sector);
+                  *p_entry_offset = ui_entry;
+                }
                 return 0;
               }
               /* file not found (file/directory does not agree) */
@@ -623,12 +724,13 @@ uint8_t fat32_file_locate(SSDFATCard* const p_sdfatcard,
               ui_cluster = *ui_file_cluster;
               goto nextsegment;
             } else if (!(pch_sector[ui_entry + 0x0B] & 0x10) && b_is_file) {
-              /*
-                 file found
-
-                 TODO: return a reference to the directory entry for
-                 write capability
-              */
+              /* file found */
+              if (p_entry_sector != NULL) {
+                *p_entry_sector = fat32_cluster_sector(p_sdfatcard,
+                                                       chain.ui_cluster,
+                                                       chain.ui_sector);
+                *p_entry_offset = ui_entry;
+              }
               return 0;
             }
             /* file not found (file/directory does not agree) */
@@ -652,6 +754,46 @@ uint8_t fat32_file_locate(SSDFATCard* const p_sdfatcard,
   return r;
 }
 
+/*
+  Locates a file identified by pch_path, returning the first cluster
+  and the size.
+ */
+uint8_t fat32_file_locate(SSDFATCard* const p_sdfatcard,
+                          const char* pch_path,
+                          uint32_t* const ui_file_cluster,
+                          uint32_t* const ui_file_size) {
+  return fat32_file_locate_entry(p_sdfatcard,
+                                 pch_path,
+                                 ui_file_cluster,
+                                 ui_file_size,
+                                 NULL,
+                                 NULL);
+}
+
+/*
+  Updates the size in a directory entry.
+ */
+uint8_t fat32_file_set_size(SSDFATCard* const p_sdfatcard,
+                            const uint32_t ui_entry_sector,
+                            const uint16_t ui_entry_offset,
+                            const uint32_t ui_file_size) {
+  SSDCard* const p_sdcard = p_sdfatcard->p_sdcard;
+  uint8_t r;
+
+  r = sdcard_sector_read(p_sdcard, ui_entry_sector);
+  if (r != 0) {
+    print_P("Failed to read directory entry\n");
+    return r;
+  }
+
+  p_sdcard->pch_sector[ui_entry_offset + 0x1C] = ui_file_size & 0xFF;
+  p_sdcard->pch_sector[ui_entry_offset + 0x1D] = ui_file_size >> 8 & 0xFF;
+  p_sdcard->pch_sector[ui_entry_offset + 0x1E] = ui_file_size >> 16 & 0xFF;
+  p_sdcard->pch_sector[ui_entry_offset + 0x1F] = ui_file_size >> 24 & 0xFF;
+
+  return sdcard_sector_write(p_sdcard, ui_entry_sector, p_sdcard->pch_sector);
+}
+
 /*
   Opens a file identified by pch_path, and populates p_sdfile with
   needed data.
@@ -663,25 +805,98 @@ uint8_t fat32_file_open(SSDFATCard* const p_sdfatcard,
                         const char* pch_path) {
   uint8_t r;
   uint32_t ui_cluster;
-
-  p_sdfile->pch_filename = pch_path;
-  p_sdfile->ui_position = 0;
+  uint32_t ui_file_size;
 
   r = fat32_file_locate(p_sdfatcard,
                         pch_path,
                         &ui_cluster,
-                        &(p_sdfile->ui_file_size));
+                        &ui_file_size);
   if (r != 0) {
     print_P("File not found\n");
     return r;
   }
 
-  r = fat32_chain_init(&(p_sdfile->s_chain),
-                       p_sdfatcard,
-                       ui_cluster);
+  r = fat32_file_open_cluster(p_sdfatcard, p_sdfile, ui_cluster, ui_file_size);
+  p_sdfile->pch_filename = pch_path;
+  return r;
+}
+
+/*
+  Opens a file by its first cluster and size, as found in its
+  directory entry.
+ */
+uint8_t fat32_file_open_cluster(SSDFATCard* const p_sdfatcard,
+                                SSDFAT_File* const p_sdfile,
+                                const uint32_t ui_cluster,
+                                const uint32_t ui_file_size) {
+  return fat32_file_open_cluster_next(p_sdfatcard, p_sdfile, ui_cluster,
+                                      fat32_cluster_lookup(p_sdfatcard,
+                                                           ui_cluster),
+                                      ui_file_size);
+}
+
+/*
+  Opens a file by its first cluster and size, with the fat entry of
+  the first cluster looked up before.
+ */
+uint8_t fat32_file_open_cluster_next(SSDFATCard* const p_sdfatcard,
+                                     SSDFAT_File* const p_sdfile,
+                                     const uint32_t ui_cluster,
+                                     const uint32_t ui_next_cluster,
+                                     const uint32_t ui_file_size) {
+  uint8_t r;
+
+  p_sdfile->pch_filename = NULL;
+  p_sdfile->ui_position = 0;
+  p_sdfile->ui_file_size = ui_file_size;
+
+  r = fat32_chain_init_next(&(p_sdfile->s_chain),
+                            p_sdfatcard,
+                            ui_cluster,
+                            ui_next_cluster);
   if (r != 0) {
     print_P("Could not init cluster\n");
   }
 
   return r;
 }
+
+/*
+  Ends the open sector read of a file, reading out the rest of the
+  sector, so that the card can be used for something else. The
+  position is kept.
+ */
+void fat32_file_pause(SSDFAT_File* const p_sdfile) {
+  uint16_t i;
+
+  if (fat32_file_idle(p_sdfile)) {
+    return;
+  }
+  for (i = p_sdfile->ui_position; i < 512; i++) {
+    spi_master_transmit(0xFF);
+  }
+  sdcard_send_command_frame_data_end();
+}
+
+/*
+  Starts the sector read of a paused file again, skipping the bytes
+  before the position.
+ */
+uint8_t fat32_file_resume(SSDFAT_File* const p_sdfile) {
+  uint8_t r;
+  uint16_t i;
+
+  if (fat32_file_idle(p_sdfile)) {
+    return 0;
+  }
+  r = fat32_cluster_read(p_sdfile->s_chain.p_sdfatcard,
+                         p_sdfile->s_chain.ui_cluster,
+                         p_sdfile->s_chain.ui_sector);
+  if (r != 0) {
+    return r;
+  }
+  for (i = 0; i < p_sdfile->ui_position; i++) {
+    spi_master_transmit(0xFF);
+  }
+  return 0;
+}
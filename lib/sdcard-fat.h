@@ -2,6 +2,7 @@
 #define _SDCARD_FAT_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "sdcard.h"
 #include "spi.h"
@@ -85,6 +86,109 @@ uint8_t fat32_file_open(SSDFATCard* const p_sdfatcard,
                         SSDFAT_File* const p_sdfile,
                         const char* pch_path);
 
+/*
+  As fat32_file_open, for a file that has been located (the first
+  cluster and size of fat32_file_locate, or of its directory entry),
+  so there is no directory scan.
+*/
+uint8_t fat32_file_open_cluster(SSDFATCard* const p_sdfatcard,
+                                SSDFAT_File* const p_sdfile,
+                                const uint32_t ui_cluster,
+                                const uint32_t ui_file_size);
+
+/*
+  As fat32_file_open_cluster, with the fat entry of the first cluster
+  (fat32_cluster_lookup of ui_cluster) read before, so the only read
+  is the start of the first sector. Splits the two reads of an open,
+  e.g. between the sectors of another file that is paused for each.
+*/
+uint8_t fat32_file_open_cluster_next(SSDFATCard* const p_sdfatcard,
+                                     SSDFAT_File* const p_sdfile,
+                                     const uint32_t ui_cluster,
+                                     const uint32_t ui_next_cluster,
+                                     const uint32_t ui_file_size);
+
+/*
+  Reading with fat32_file_read_byte_spi keeps the sector read open on
+  the spi bus between calls, so only one file can be read at a time.
+  fat32_file_pause ends the read (reading out the rest of the sector,
+  at most 512 bytes), and fat32_file_resume starts it again (a read
+  command, and the bytes before the position are skipped). Both do
+  nothing if the file is between sectors or at the end.
+*/
+void fat32_file_pause(SSDFAT_File* const p_sdfile);
+uint8_t fat32_file_resume(SSDFAT_File* const p_sdfile);
+
+/*
+  true if no sector read of the file is open, i.e. the last byte of a
+  sector (or of the file) has been read.
+*/
+static inline
+bool fat32_file_idle(const SSDFAT_File* const p_sdfile) {
+  return p_sdfile->ui_position >= 512;
+}
+
+/*
+  Locates a file identified by pch_path and returns its first cluster
+  and size. No data is read from the file.
+
+  Assumes a unix style path, i.e. /path/to/file.ext, a path ending in
+  '/' (e.g. / or /music/) locates the directory (its first cluster and
+  a size of 0).
+*/
+uint8_t fat32_file_locate(SSDFATCard* const p_sdfatcard,
+                          const char* pch_path,
+                          uint32_t* const ui_file_cluster,
+                          uint32_t* const ui_file_size);
+
+/*
+  As fat32_file_locate, also returning the location of the directory
+  entry (the absolute sector and the offset in it) for updating the
+  entry.
+*/
+uint8_t fat32_file_locate_entry(SSDFATCard* const p_sdfatcard,
+                                const char* pch_path,
+                                uint32_t* const ui_file_cluster,
+                                uint32_t* const ui_file_size,
+                                uint32_t* const p_entry_sector,
+                                uint16_t* const p_entry_offset);
+
+/*
+  Writes a new file size into the directory entry located by
+  fat32_file_locate_entry. The clusters of the file are not changed,
+  so the size must not be larger than the allocated clusters.
+
+  The entry sector is read into the buffer of the SSDCard.
+*/
+uint8_t fat32_file_set_size(SSDFATCard* const p_sdfatcard,
+                            const uint32_t ui_entry_sector,
+                            const uint16_t ui_entry_offset,
+                            const uint32_t ui_file_size);
+
+/*
+  Lookup the value of a cluster in the fat, i.e. the next cluster in
+  the chain (or end of chain marker). A value of 0xFFFFFFFF is an
+  invalid cluster.
+
+  The fat sector is read into the buffer of the SSDCard.
+*/
+uint32_t fat32_cluster_lookup(SSDFATCard* p_sdfatcard, uint32_t ui_cluster);
+
+/*
+  As fat32_cluster_lookup, but the fat sector is read directly from
+  the spi bus, so the buffer of the SSDCard is not changed.
+*/
+uint32_t fat32_cluster_lookup_spi(SSDFATCard* p_sdfatcard,
+                                  uint32_t ui_cluster);
+
+/*
+  Calculate the absolute sector on the card of a sector within a
+  cluster.
+*/
+uint32_t fat32_cluster_sector(SSDFATCard* p_sdfatcard,
+                              uint32_t ui_cluster,
+                              uint8_t ui_sector);
+
 /*
   reads a byte from the file, returns -1 on eof
 */
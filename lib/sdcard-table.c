@@ -0,0 +1,238 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "sdcard-table.h"
+
+/* debugging statements are only included if debug flag is set,
+   with DEBUG_DLOG they are sent as deferred log records (see dlog.h) */
+#if defined(DEBUG) && defined(DEBUG_DLOG)
+  #include "dlog.h"
+  #define printf_P(fmt,...) dlog("TBL> " fmt,__VA_ARGS__)
+  #define print_P(fmt) dlog0("TBL> " fmt)
+#elif defined(DEBUG)
+  #include "usart_p.h"
+  #define printf_P(fmt,...) usart_printf_P(PSTR("TBL> " fmt),__VA_ARGS__)
+  #define print_P(fmt) printf_P(fmt, 0)
+#else
+  #define printf_P(...)
+  #define print_P(...)
+#endif
+
+/*
+  Read a sector into the SSDCard buffer, counting the read if the
+  sector is not already buffered.
+*/
+static
+uint8_t table_sector_read(SSDTable* const p_table,
+                          const uint32_t ui_sector,
+                          uint8_t* const p_reads) {
+  SSDCard* const p_sdcard = p_table->p_sdfatcard->p_sdcard;
+
+  if (p_sdcard->ui_sector != ui_sector) {
+    (*p_reads)++;
+  }
+
+  return sdcard_sector_read(p_sdcard, ui_sector);
+}
+
+/*
+  Open a sorted table of fixed size records and build the fence
+  index.
+*/
+uint8_t table_open(SSDFATCard* const p_sdfatcard,
+                   SSDTable* const p_table,
+                   SSDTable_Fence* const ps_fence,
+                   const uint16_t ui_fences_max,
+                   const char* pch_path,
+                   const uint16_t ui_record_size,
+                   const uint8_t ui_key_size) {
+  uint8_t r;
+  uint32_t ui_cluster;
+  uint32_t ui_cluster_index = 0;
+  uint32_t ui_file_size;
+  uint32_t ui_file_sector;
+  const uint8_t ui_sectors_per_cluster = p_sdfatcard->ui_sectors_per_cluster;
+  SSDCard* const p_sdcard = p_sdfatcard->p_sdcard;
+  SSDTable_Fence* p_fence;
+
+  /* records must not span sectors, and must contain the key */
+  if (ui_key_size == 0 ||
+      ui_key_size > TABLE_KEY_SIZE ||
+      ui_record_size < ui_key_size ||
+      ui_record_size > 512 ||
+      512 % ui_record_size != 0) {
+    print_P("Invalid record layout\n");
+    return 0xEF;
+  }
+
+  p_table->p_sdfatcard = p_sdfatcard;
+  p_table->ui_record_size = ui_record_size;
+  p_table->ui_key_size = ui_key_size;
+  p_table->ui_fence_shift = 0;
+  p_table->ui_fences = 0;
+  p_table->ps_fence = ps_fence;
+
+  r = fat32_file_locate(p_sdfatcard, pch_path, &ui_cluster, &ui_file_size);
+  if (r != 0) {
+    print_P("Table not found\n");
+    return r;
+  }
+
+  p_table->ui_records = ui_file_size / ui_record_size;
+  p_table->ui_sectors = (p_table->ui_records * ui_record_size + 511) / 512;
+
+  /* empty table, all lookups will fail */
+  if (p_table->ui_sectors == 0) {
+    return 0;
+  }
+
+  /* a fence per sector, or per two sectors of one cluster, so that a
+     lookup reads at most two sectors */
+  if (p_table->ui_sectors > ui_fences_max) {
+    p_table->ui_fence_shift = 1;
+  }
+  if ((p_table->ui_sectors + 1) / 2 > ui_fences_max ||
+      ((uint8_t)1 << p_table->ui_fence_shift) > ui_sectors_per_cluster) {
+    printf_P("Table of %lu sectors needs more than %u fences\n",
+             p_table->ui_sectors,
+             ui_fences_max);
+    return 0xEE;
+  }
+
+  /* read the first key of each group */
+  for (ui_file_sector = 0;
+       ui_file_sector < p_table->ui_sectors;
+       ui_file_sector += (uint32_t)1 << p_table->ui_fence_shift) {
+    /* follow the chain to the cluster that holds the sector */
+    while (ui_file_sector / ui_sectors_per_cluster > ui_cluster_index) {
+      ui_cluster = fat32_cluster_lookup(p_sdfatcard, ui_cluster);
+      if (ui_cluster < 2 || ui_cluster >= 0x0FFFFFF8) {
+        print_P("Possibly broken FAT\n");
+        return 0xFA;
+      }
+      ui_cluster_index++;
+    }
+
+    p_fence = &(ps_fence[p_table->ui_fences]);
+    p_fence->ui_sector
+      = fat32_cluster_sector(p_sdfatcard,
+                             ui_cluster,
+                             ui_file_sector % ui_sectors_per_cluster);
+
+    r = sdcard_sector_read(p_sdcard, p_fence->ui_sector);
+    if (r != 0) {
+      printf_P("Failed to read sector %lX: %02X\n", p_fence->ui_sector, r);
+      return r;
+    }
+
+    memcpy(p_fence->pch_key, p_sdcard->pch_sector, ui_key_size);
+    p_table->ui_fences++;
+  }
+
+  printf_P("Opened table with %lu records, %u fences of %u sectors\n",
+           p_table->ui_records,
+           p_table->ui_fences,
+           1 << p_table->ui_fence_shift);
+
+  return 0;
+}
+
+/*
+  Binary search of the fence index, then the second sector of a group
+  of two and finally the records in the sector.
+*/
+uint8_t table_lookup(SSDTable* const p_table,
+                     const uint8_t* const pch_key,
+                     uint8_t* const pch_record,
+                     uint8_t* const p_reads) {
+  uint8_t r;
+  uint16_t ui_lo;
+  uint16_t ui_hi;
+  uint16_t ui_mid;
+  int i_cmp;
+  uint32_t ui_file_sector;
+  uint16_t ui_count;
+  const SSDTable_Fence* p_fence;
+  const uint8_t ui_key_size = p_table->ui_key_size;
+  const uint16_t ui_record_size = p_table->ui_record_size;
+  const uint8_t* const pch_sector = p_table->p_sdfatcard->p_sdcard->pch_sector;
+
+  *p_reads = 0;
+
+  /* key is before the first record */
+  if (p_table->ui_fences == 0 ||
+      memcmp(pch_key, p_table->ps_fence[0].pch_key, ui_key_size) < 0) {
+    return 0xE0;
+  }
+
+  /* find the last fence with a key not larger than the key, done in
+     memory */
+  ui_lo = 0;
+  ui_hi = p_table->ui_fences - 1;
+  while (ui_lo < ui_hi) {
+    ui_mid = (ui_lo + ui_hi + 1) / 2;
+    if (memcmp(p_table->ps_fence[ui_mid].pch_key, pch_key, ui_key_size) <= 0) {
+      ui_lo = ui_mid;
+    } else {
+      ui_hi = ui_mid - 1;
+    }
+  }
+  p_fence = &(p_table->ps_fence[ui_lo]);
+  ui_file_sector = (uint32_t)ui_lo << p_table->ui_fence_shift;
+
+  /* find the last sector in the group with a first key not larger
+     than the key (the last group could be partial) */
+  ui_lo = 0;
+  if (p_table->ui_sectors - ui_file_sector <
+      ((uint32_t)1 << p_table->ui_fence_shift)) {
+    ui_hi = p_table->ui_sectors - ui_file_sector - 1;
+  } else {
+    ui_hi = (1 << p_table->ui_fence_shift) - 1;
+  }
+  while (ui_lo < ui_hi) {
+    ui_mid = (ui_lo + ui_hi + 1) / 2;
+    r = table_sector_read(p_table, p_fence->ui_sector + ui_mid, p_reads);
+    if (r != 0) {
+      return r;
+    }
+    if (memcmp(pch_sector, pch_key, ui_key_size) <= 0) {
+      ui_lo = ui_mid;
+    } else {
+      ui_hi = ui_mid - 1;
+    }
+  }
+  ui_file_sector += ui_lo;
+
+  /* read the sector that could hold the key (normally already
+     buffered by the search) */
+  r = table_sector_read(p_table, p_fence->ui_sector + ui_lo, p_reads);
+  if (r != 0) {
+    return r;
+  }
+
+  /* number of records in sector, the last sector may be partial */
+  ui_count = 512 / ui_record_size;
+  if (ui_file_sector == p_table->ui_sectors - 1) {
+    ui_count = p_table->ui_records - ui_file_sector * ui_count;
+  }
+
+  /* find the record within the sector */
+  ui_lo = 0;
+  ui_hi = ui_count;
+  while (ui_lo < ui_hi) {
+    ui_mid = (ui_lo + ui_hi) / 2;
+    i_cmp = memcmp(pch_sector + ui_mid * ui_record_size, pch_key, ui_key_size);
+    if (i_cmp == 0) {
+      if (pch_record != NULL) {
+        memcpy(pch_record, pch_sector + ui_mid * ui_record_size, ui_record_size);
+      }
+      return 0;
+    } else if (i_cmp < 0) {
+      ui_lo = ui_mid + 1;
+    } else {
+      ui_hi = ui_mid;
+    }
+  }
+
+  return 0xE0;
+}
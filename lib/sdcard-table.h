@@ -0,0 +1,97 @@
+#ifndef _SDCARD_TABLE_H
+#define _SDCARD_TABLE_H
+
+#include <stdint.h>
+
+#include "sdcard-fat.h"
+
+/* maximum size of a record key (in bytes) */
+#if !defined(TABLE_KEY_SIZE)
+  #define TABLE_KEY_SIZE 4
+#endif
+
+typedef struct {
+  /* absolute sector on the card of the first sector in the group */
+  uint32_t ui_sector;
+
+  /* key of the first record in the group */
+  uint8_t pch_key[TABLE_KEY_SIZE];
+} SSDTable_Fence;
+
+/* sectors of a table of ui_records records of ui_record_size bytes */
+#define TABLE_SECTORS(ui_records, ui_record_size)               \
+  (((uint32_t)(ui_records) * (ui_record_size) + 511) / 512)
+
+/* fences needed for the table, one for each group of two sectors */
+#define TABLE_FENCES(ui_records, ui_record_size)                \
+  ((TABLE_SECTORS(ui_records, ui_record_size) + 1) / 2)
+
+typedef struct {
+  SSDFATCard* p_sdfatcard;
+
+  /* number of records and sectors in the file */
+  uint32_t ui_records;
+  uint32_t ui_sectors;
+
+  /* size of a record, and of its key (which is the record prefix) */
+  uint16_t ui_record_size;
+  uint8_t ui_key_size;
+
+  /* each fence covers (1 << ui_fence_shift) consecutive sectors, one
+     or two */
+  uint8_t ui_fence_shift;
+
+  /* number of fences that are in use */
+  uint16_t ui_fences;
+
+  /* in memory index of the first key of each group of sectors, held
+     by the caller */
+  SSDTable_Fence* ps_fence;
+} SSDTable;
+
+/*
+  Opens a table stored in the file identified by pch_path.
+
+  The file is a sequence of fixed size records sorted in ascending
+  order of their key. The key is the first ui_key_size bytes of the
+  record and is compared as an unsigned big endian number (i.e. with
+  memcmp). The record size must divide 512, so that no record spans
+  two sectors.
+
+  While opening, the first key of every group of sectors is read into
+  the fence index ps_fence of ui_fences_max entries. A group is one
+  sector if the index has room for a fence per sector, else two
+  (which must be in one cluster, so clusters of one sector need a
+  fence per sector). A table that needs more fences than that is
+  rejected with 0xEE, size the index for the largest table with
+  TABLE_FENCES (each fence takes 4 + TABLE_KEY_SIZE bytes of ram):
+
+    SSDTable_Fence ps_fence[TABLE_FENCES(4096, 16)];
+    table_open(&g_sdfatcard, &s_table, ps_fence, 64, "/table.bin", 16, 4);
+
+  for up to 4096 records of 16 bytes (64 fences, 512 bytes).
+*/
+uint8_t table_open(SSDFATCard* const p_sdfatcard,
+                   SSDTable* const p_table,
+                   SSDTable_Fence* const ps_fence,
+                   const uint16_t ui_fences_max,
+                   const char* pch_path,
+                   const uint16_t ui_record_size,
+                   const uint8_t ui_key_size);
+
+/*
+  Search the table for the record with the given key. On success, the
+  record is copied into pch_record (if not NULL) and 0 is
+  returned. 0xE0 is returned if there is no record with the key.
+
+  The number of sectors read from the card to perform the lookup is
+  saved into p_reads (a sector already held in the SSDCard buffer is
+  not counted). With a group size of one sector a lookup reads one
+  sector, with two sectors at most two.
+*/
+uint8_t table_lookup(SSDTable* const p_table,
+                     const uint8_t* const pch_key,
+                     uint8_t* const pch_record,
+                     uint8_t* const p_reads);
+
+#endif
@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 #include <util/delay.h>
 #include <avr/interrupt.h>
 
@@ -8,6 +9,7 @@
 #include "pins.h"
 #include "spi.h"
 #include "timer.h"
+#include "prof.h"
 
 #if !defined(CHIP_SELECT)
   #error "CHIP_SELECT must be defined as the pin connected to SDCard CS"
@@ -17,8 +19,13 @@
   #define TIMEOUT_MS 1000
 #endif
 
-/* debugging statements are only included if debug flag is set */
-#if defined(DEBUG)
+/* debugging statements are only included if debug flag is set,
+   with DEBUG_DLOG they are sent as deferred log records (see dlog.h) */
+#if defined(DEBUG) && defined(DEBUG_DLOG)
+  #include "dlog.h"
+  #define printf_P(fmt,...) dlog("SD> " fmt,__VA_ARGS__)
+  #define print_P(fmt) dlog0("SD> " fmt)
+#elif defined(DEBUG)
   #include "usart_p.h"
   #define printf_P(fmt,...) usart_printf_P(PSTR("SD> " fmt),__VA_ARGS__)
   #define print_P(fmt) printf_P(fmt,0)
@@ -269,6 +276,109 @@ uint8_t sdcard_send_command_frame_data_end() {
   return 0x00;
 }
 
+/*
+  Send a write command frame over SPI to the SD card followed by a
+  512 byte data block. If timeout occours the msb will be set, if the
+  card rejects the data block the data response token is returned
+  (0x0B for a crc error, 0x0D for a write error).
+
+  Returns once the data has been accepted, the card then programs the
+  block and is busy (holds MISO low) until it is done.
+*/
+static
+uint8_t sdcard_send_command_frame_write(const uint8_t cmd,
+                                        const uint8_t arg1,
+                                        const uint8_t arg2,
+                                        const uint8_t arg3,
+                                        const uint8_t arg4,
+                                        const uint8_t crc,
+                                        const uint8_t* const buffer) {
+  uint32_t timeout = timer_millis() + TIMEOUT_MS;
+  uint8_t r = 0;
+  size_t i;
+
+  /* drive cs low to card will receive command */
+  writePin(CHIP_SELECT,false);
+
+  /* send command frame */
+  spi_master_transmit(cmd);
+  spi_master_transmit(arg1);
+  spi_master_transmit(arg2);
+  spi_master_transmit(arg3);
+  spi_master_transmit(arg4);
+  spi_master_transmit(crc);
+
+  /* wait for result */
+  while ((r = spi_master_transmit(0xFF)) & 0x80 &&
+         timer_millis() < timeout) {}
+
+  if (r != 0) {
+    /* drive cs high */
+    writePin(CHIP_SELECT,true);
+    return r;
+  }
+
+  /* one byte gap, then the start block token */
+  spi_master_transmit(0xFF);
+  spi_master_transmit(0xFE);
+
+  /* write data */
+  for (i = 0; i < 512; i++) {
+    spi_master_transmit(buffer[i]);
+  }
+
+  /* send two (unchecked) crc bytes */
+  spi_master_transmit(0xFF);
+  spi_master_transmit(0xFF);
+
+  /* wait for data response token, xxx0sss1 */
+  timeout = timer_millis() + TIMEOUT_MS;
+  while (((r = spi_master_transmit(0xFF)) & 0x11) != 0x01 &&
+         timer_millis() < timeout) {}
+
+  /* drive cs high */
+  writePin(CHIP_SELECT,true);
+
+  if ((r & 0x11) != 0x01) {
+    return 0xFF;
+  }
+
+  /* 0x05 is data accepted */
+  r &= 0x1F;
+  return r == 0x05 ? 0 : r;
+}
+
+/*
+  Check if the card is still busy with a write, the card drives MISO
+  low until the block has been programmed.
+*/
+bool sdcard_busy(void) {
+  uint8_t r;
+
+  writePin(CHIP_SELECT,false);
+  r = spi_master_transmit(0xFF);
+  writePin(CHIP_SELECT,true);
+
+  return r != 0xFF;
+}
+
+/*
+  Wait for the card to finish a write.
+*/
+uint8_t sdcard_wait_ready(void) {
+  uint32_t timeout = timer_millis() + TIMEOUT_MS;
+  PROF_BEGIN(PROF_SD_WAIT);
+
+  while (sdcard_busy()) {
+    if (timer_millis() >= timeout) {
+      return 0xFF;
+    }
+  }
+
+  PROF_END(PROF_SD_WAIT);
+  return 0;
+}
+
 /*
   Reads the identified sector from the SC Card.
 
@@ -286,14 +396,15 @@ uint8_t sdcard_sector_read(SSDCard* const p_sdcard,
 
   /* requested sector is larger than max */
   if (ui_sector >= p_sdcard->ui_sectors) {
-    printf_P("Sector 0x%lX is larger than size supported by card: 0x%lX\n",
+    printf_P("Sector 0x%lX is larger than the size of the card: 0x%lX\n",
              ui_sector,
-             p_sdcard->ui_sector);
+             p_sdcard->ui_sectors);
 
     return 0xFE;
   }
 
   /* read sector (512 bytes) and place in buffer */
+  PROF_BEGIN(PROF_SD_READ);
   r = sdcard_send_command_frame_data(0x51,
                                      ui_sector >> 24 & 0xFF,
                                      ui_sector >> 16 & 0xFF,
@@ -302,6 +413,7 @@ uint8_t sdcard_sector_read(SSDCard* const p_sdcard,
                                      0xFF,
                                      p_sdcard->pch_sector,
                                      512);
+  PROF_END(PROF_SD_READ);
 
   /* updated sector index in memory */
   if (r == 0) {
@@ -315,23 +427,19 @@ uint8_t sdcard_sector_read(SSDCard* const p_sdcard,
   Reads the identified sector from the SC Card without using internal
   buffer.
 
-  The sector is placed into the SDCard buffer, and the associated
-  sector is written.
+  The data is not placed into the SDCard buffer, so the command is
+  always sent and the buffered sector is marked as invalid (the caller
+  may overwrite the buffer with the streamed data).
 */
 uint8_t sdcard_sector_read_begin(SSDCard* const p_sdcard,
                                  const uint32_t ui_sector) {
   uint8_t r;
 
-  /* sector is already in memeory */
-  if (ui_sector == p_sdcard->ui_sector) {
-    return 0;
-  }
-
   /* requested sector is larger than max */
   if (ui_sector >= p_sdcard->ui_sectors) {
-    printf_P("Sector 0x%lX is larger than size supported by card: 0x%lX\n",
+    printf_P("Sector 0x%lX is larger than the size of the card: 0x%lX\n",
              ui_sector,
-             p_sdcard->ui_sector);
+             p_sdcard->ui_sectors);
 
     return 0xFE;
   }
@@ -344,14 +452,71 @@ uint8_t sdcard_sector_read_begin(SSDCard* const p_sdcard,
                                            ui_sector & 0xFF,
                                            0xFF);
 
-  /* updated sector index in memory */
-  if (r == 0) {
+  /* buffer no longer reflects a known sector */
+  p_sdcard->ui_sector = 0xFFFFFFFF;
+
+  return r;
+}
+
+/*
+  Writes 512 bytes from pch_data into the identified sector, without
+  waiting for the card to program it.
+
+  If pch_data is the SDCard buffer, it is marked as holding the
+  sector, otherwise the buffer is invalidated if it held the sector.
+*/
+uint8_t sdcard_sector_write_begin(SSDCard* const p_sdcard,
+                                  const uint32_t ui_sector,
+                                  const uint8_t* const pch_data) {
+  uint8_t r;
+
+  /* requested sector is larger than max */
+  if (ui_sector >= p_sdcard->ui_sectors) {
+    printf_P("Sector 0x%lX is larger than the size of the card: 0x%lX\n",
+             ui_sector,
+             p_sdcard->ui_sectors);
+
+    return 0xFE;
+  }
+
+  /* write the sector (512 bytes) */
+  PROF_BEGIN(PROF_SD_WRITE);
+  r = sdcard_send_command_frame_write(0x58,
+                                      ui_sector >> 24 & 0xFF,
+                                      ui_sector >> 16 & 0xFF,
+                                      ui_sector >> 8 & 0xFF,
+                                      ui_sector & 0xFF,
+                                      0xFF,
+                                      pch_data);
+  PROF_END(PROF_SD_WRITE);
+
+  /* keep the buffered sector consistent with the card */
+  if (r == 0 && pch_data == p_sdcard->pch_sector) {
     p_sdcard->ui_sector = ui_sector;
+  } else if (ui_sector == p_sdcard->ui_sector) {
+    p_sdcard->ui_sector = 0xFFFFFFFF;
   }
 
   return r;
 }
 
+/*
+  Writes 512 bytes from pch_data into the identified sector, and waits
+  for the card to program it.
+*/
+uint8_t sdcard_sector_write(SSDCard* const p_sdcard,
+                            const uint32_t ui_sector,
+                            const uint8_t* const pch_data) {
+  uint8_t r = sdcard_sector_write_begin(p_sdcard, ui_sector, pch_data);
+
+  if (r != 0) {
+    printf_P("Failed to write sector %lX: %02X\n", ui_sector, r);
+    return r;
+  }
+
+  return sdcard_wait_ready();
+}
+
 /*
   Initilise SPI and communicate with the sdcard to read basic
   information.
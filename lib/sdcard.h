@@ -2,6 +2,7 @@
 #define _SDCARD_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 typedef struct  {
   uint8_t pch_csd[16];
@@ -40,6 +41,34 @@ uint8_t sdcard_sector_read(SSDCard* const p_sdcard, const uint32_t ui_sector);
 */
 uint8_t sdcard_sector_read_begin(SSDCard* const p_sdcard, const uint32_t ui_sector);
 
+/*
+  generic write of 512 bytes from pch_data, waits for the card to
+  finish programming the sector.
+*/
+uint8_t sdcard_sector_write(SSDCard* const p_sdcard,
+                            const uint32_t ui_sector,
+                            const uint8_t* const pch_data);
+
+/*
+  generic write, returns once the card has accepted the data. the card
+  is then busy programming the sector, sdcard_busy must return false
+  (or sdcard_wait_ready be called) before the next command is sent.
+  pch_data can be reused as soon as this returns.
+*/
+uint8_t sdcard_sector_write_begin(SSDCard* const p_sdcard,
+                                  const uint32_t ui_sector,
+                                  const uint8_t* const pch_data);
+
+/*
+  true while the card is programming a written sector.
+*/
+bool sdcard_busy(void);
+
+/*
+  waits until the card is no longer busy, 0xFF on timeout.
+*/
+uint8_t sdcard_wait_ready(void);
+
 /*
   Cleanup after begin call, should only be called once the expected
   number of bytes (without crc) is read from the spi bus.
@@ -0,0 +1,298 @@
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <util/delay.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sonar.h"
+#include "timer.h"
+#if defined SONAR_EVENT
+  #include "sched.h"
+#endif
+
+/* sound travels 2mm in 5.8us (there and back), as a 16 bit fraction:
+   65536 / 5.8 */
+#define SONAR_MM_PER_US_Q16 11299
+
+static const SSonarSensor* p_sonar_sensors;
+static uint8_t ui_sonar_sensors;
+static uint8_t ui_sonar_slots;
+
+/* main program, the slot that is ranging (or is next) and when it was
+   triggered (or the previous one ended) */
+static uint8_t ui_sonar_slot;
+static bool b_sonar_ranging;
+static uint32_t ui_sonar_since;
+static uint32_t pui_sonar_pinged[SONAR_SENSORS_MAX];
+
+/* written by the isrs, bit i for sensor i */
+static volatile uint8_t ui_sonar_pending;
+static volatile uint8_t ui_sonar_high;
+static volatile uint8_t ui_sonar_fresh;
+static volatile uint8_t pui_sonar_pins[3];
+static volatile uint32_t pui_sonar_rising[SONAR_SENSORS_MAX];
+static volatile uint16_t pui_sonar_mm[SONAR_SENSORS_MAX];
+static SSonarStats s_sonar_stats;
+
+/* the registers of a port are PINx, DDRx and PORTx in this order */
+static
+volatile uint8_t* sonar_pin_register(const uint8_t ui_group) {
+  switch (ui_group) {
+  case _SONAR_GROUP_B:
+    return &PINB;
+  case _SONAR_GROUP_C:
+    return &PINC;
+  default:
+    return &PIND;
+  }
+}
+
+bool sonar_init(const SSonarSensor* const p_sensors,
+                const uint8_t ui_sensors) {
+  const uint32_t ui_now = timer_millis();
+  uint8_t i;
+
+  /* the slots index pui_sonar_pinged */
+  if (ui_sensors > SONAR_SENSORS_MAX) {
+    return false;
+  }
+  for (i = 0; i < ui_sensors; i++) {
+    if (p_sensors[i].ui_slot >= SONAR_SENSORS_MAX) {
+      return false;
+    }
+  }
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    p_sonar_sensors = p_sensors;
+    ui_sonar_sensors = ui_sensors;
+    ui_sonar_slots = 0;
+    ui_sonar_pending = 0;
+    ui_sonar_high = 0;
+    ui_sonar_fresh = 0;
+
+    for (i = 0; i < ui_sensors; i++) {
+      const SSonarSensor* const p_sensor = &p_sensors[i];
+      volatile uint8_t* const p_pin
+        = sonar_pin_register(p_sensor->ui_echo_group);
+
+      if (p_sensor->ui_slot >= ui_sonar_slots) {
+        ui_sonar_slots = p_sensor->ui_slot + 1;
+      }
+      pui_sonar_mm[i] = SONAR_DISTANCE_NONE;
+
+      /* trigger low output (DDRx is before PORTx) */
+      *p_sensor->p_trigger_port &= ~p_sensor->ui_trigger_mask;
+      *(p_sensor->p_trigger_port - 1) |= p_sensor->ui_trigger_mask;
+      /* echo input (DDRx is after PINx), unmask its pin change, the
+         masks PCMSK0 to PCMSK2 follow each other */
+      *(p_pin + 1) &= ~p_sensor->ui_echo_mask;
+      (&PCMSK0)[p_sensor->ui_echo_group] |= p_sensor->ui_echo_mask;
+      PCICR |= _BV(PCIE0 + p_sensor->ui_echo_group);
+    }
+
+    for (i = 0; i < 3; i++) {
+      pui_sonar_pins[i] = *sonar_pin_register(i);
+    }
+    PCIFR = _BV(PCIF0) | _BV(PCIF1) | _BV(PCIF2);
+  }
+
+  /* the first slot is due right away */
+  ui_sonar_slot = 0;
+  b_sonar_ranging = false;
+  ui_sonar_since = ui_now - SONAR_GAP_MS;
+  for (i = 0; i < SONAR_SENSORS_MAX; i++) {
+    pui_sonar_pinged[i] = ui_now - SONAR_CYCLE_MS;
+  }
+  sonar_stats_reset();
+  return true;
+}
+
+static
+void sonar_trigger(const uint8_t ui_slot) {
+  const SSonarSensor* p_sensor;
+  uint8_t ui_mask = 0;
+  uint8_t i;
+
+  for (i = 0; i < ui_sonar_sensors; i++) {
+    p_sensor = &p_sonar_sensors[i];
+    if (p_sensor->ui_slot == ui_slot) {
+      ui_mask |= _BV(i);
+      *p_sensor->p_trigger_port |= p_sensor->ui_trigger_mask;
+    }
+  }
+
+  /* the echo starts about 450us after the trigger */
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    ui_sonar_high &= ~ui_mask;
+    ui_sonar_pending = ui_mask;
+  }
+
+  /* 10 microsecond trigger pulse */
+  _delay_us(10);
+  for (i = 0; i < ui_sonar_sensors; i++) {
+    p_sensor = &p_sonar_sensors[i];
+    if (p_sensor->ui_slot == ui_slot) {
+      *p_sensor->p_trigger_port &= ~p_sensor->ui_trigger_mask;
+    }
+  }
+}
+
+void sonar_poll(void) {
+  const uint32_t ui_now = timer_millis();
+  uint8_t ui_pending;
+  uint8_t i;
+
+  if (ui_sonar_slots == 0) {
+    return;
+  }
+
+  if (b_sonar_ranging) {
+    if (ui_sonar_pending != 0
+        && ui_now - ui_sonar_since < SONAR_TIMEOUT_MS) {
+      return;
+    }
+
+    /* the echoes still pending are out of range */
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      ui_pending = ui_sonar_pending;
+      ui_sonar_pending = 0;
+      ui_sonar_fresh |= ui_pending;
+      for (i = 0; i < ui_sonar_sensors; i++) {
+        if (ui_pending & _BV(i)) {
+          pui_sonar_mm[i] = SONAR_DISTANCE_NONE;
+          s_sonar_stats.ui_timeouts++;
+#if defined SONAR_EVENT
+          sched_post(SONAR_EVENT, i);
+#endif
+        }
+      }
+    }
+
+    b_sonar_ranging = false;
+    ui_sonar_since = ui_now;
+    ui_sonar_slot = ui_sonar_slot + 1 < ui_sonar_slots ? ui_sonar_slot + 1 : 0;
+    return;
+  }
+
+  if (ui_now - ui_sonar_since < SONAR_GAP_MS
+      || ui_now - pui_sonar_pinged[ui_sonar_slot] < SONAR_CYCLE_MS) {
+    return;
+  }
+
+  sonar_trigger(ui_sonar_slot);
+  pui_sonar_pinged[ui_sonar_slot] = ui_now;
+  ui_sonar_since = ui_now;
+  b_sonar_ranging = true;
+  s_sonar_stats.ui_pings++;
+}
+
+/* milliseconds left of ui_wait after ui_elapsed */
+static inline
+uint16_t sonar_left(const uint32_t ui_elapsed, const uint16_t ui_wait) {
+  return ui_elapsed < ui_wait ? ui_wait - ui_elapsed : 0;
+}
+
+uint16_t sonar_due_ms(void) {
+  const uint32_t ui_now = timer_millis();
+  uint16_t ui_gap;
+  uint16_t ui_cycle;
+
+  if (ui_sonar_slots == 0) {
+    return 0xFFFF;
+  }
+
+  if (b_sonar_ranging) {
+    if (ui_sonar_pending == 0) {
+      return 0;
+    }
+    return sonar_left(ui_now - ui_sonar_since, SONAR_TIMEOUT_MS);
+  }
+
+  ui_gap = sonar_left(ui_now - ui_sonar_since, SONAR_GAP_MS);
+  ui_cycle = sonar_left(ui_now - pui_sonar_pinged[ui_sonar_slot],
+                        SONAR_CYCLE_MS);
+  return ui_gap > ui_cycle ? ui_gap : ui_cycle;
+}
+
+bool sonar_distance(const uint8_t ui_sensor, uint16_t* const p_mm) {
+  bool b_fresh;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    b_fresh = ui_sonar_fresh & _BV(ui_sensor);
+    ui_sonar_fresh &= ~_BV(ui_sensor);
+    *p_mm = pui_sonar_mm[ui_sensor];
+  }
+  return b_fresh;
+}
+
+void sonar_stats(SSonarStats* const p_stats) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    *p_stats = s_sonar_stats;
+  }
+}
+
+void sonar_stats_reset(void) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    s_sonar_stats.ui_readings = 0;
+    s_sonar_stats.ui_timeouts = 0;
+    s_sonar_stats.ui_pings = 0;
+  }
+}
+
+/*
+  the echo pins of the pending sensors in the group that changed, a
+  rising edge starts the echo and a falling edge (after it) ends it.
+  a falling edge without a rising one is the end of an echo from
+  before the trigger and ignored.
+*/
+static inline
+void sonar_edge(const uint8_t ui_group, const uint8_t ui_pins) {
+  const uint32_t ui_now = timer_micros();
+  const uint8_t ui_changed = ui_pins ^ pui_sonar_pins[ui_group];
+  const SSonarSensor* p_sensor;
+  uint32_t ui_width;
+  uint8_t i;
+
+  pui_sonar_pins[ui_group] = ui_pins;
+
+  for (i = 0; i < ui_sonar_sensors; i++) {
+    p_sensor = &p_sonar_sensors[i];
+    if (!(ui_sonar_pending & _BV(i))
+        || p_sensor->ui_echo_group != ui_group
+        || !(ui_changed & p_sensor->ui_echo_mask)) {
+      continue;
+    }
+
+    if (ui_pins & p_sensor->ui_echo_mask) {
+      pui_sonar_rising[i] = ui_now;
+      ui_sonar_high |= _BV(i);
+      continue;
+    }
+    if (!(ui_sonar_high & _BV(i))) {
+      continue;
+    }
+
+    ui_width = ui_now - pui_sonar_rising[i];
+    if (ui_width > 0xFFFF) {
+      ui_width = 0xFFFF;
+    }
+    pui_sonar_mm[i] = ui_width * SONAR_MM_PER_US_Q16 >> 16;
+    ui_sonar_pending &= ~_BV(i);
+    ui_sonar_fresh |= _BV(i);
+    s_sonar_stats.ui_readings++;
+#if defined SONAR_EVENT
+    sched_post(SONAR_EVENT, i);
+#endif
+  }
+}
+
+ISR(PCINT0_vect) {
+  sonar_edge(_SONAR_GROUP_B, PINB);
+}
+
+ISR(PCINT1_vect) {
+  sonar_edge(_SONAR_GROUP_C, PINC);
+}
+
+ISR(PCINT2_vect) {
+  sonar_edge(_SONAR_GROUP_D, PIND);
+}
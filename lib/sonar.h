@@ -0,0 +1,130 @@
+#ifndef _SONAR_H
+#define _SONAR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <avr/io.h>
+
+#include "pins.h"
+
+/*
+  Ranging with several HC-SR04 (or compatible) sensors. The echo pins
+  can be any pins of ports b, c and d, the pin change interrupts of
+  the three groups (PCINT0_vect to PCINT2_vect) timestamp each edge
+  with timer_micros (4us, 0.7mm), so all sensors share the timer 0
+  timebase and no timer is needed for the ranging.
+
+  The sensors are fired in slots, sensors of one slot are triggered
+  together (they must not hear each others pings, e.g. facing away
+  from each other) and the slots take turns, so neighbouring sensors
+  never range at the same time. A slot ends when all its echoes are
+  complete (or after SONAR_TIMEOUT_MS), the next one starts after a
+  gap of SONAR_GAP_MS for the remaining echoes to die down, but not
+  before SONAR_CYCLE_MS since its previous ping (the minimum cycle of
+  the sensor).
+
+    static const SSonarSensor s_sensors[] = {
+      { SONAR_ECHO(A0), SONAR_TRIGGER(2), 0 },
+      { SONAR_ECHO(A1), SONAR_TRIGGER(4), 1 },
+      { SONAR_ECHO(A2), SONAR_TRIGGER(A3), 0 },
+    };
+    if (!sonar_init(s_sensors, 3)) { ... }
+    while (1) {
+      sonar_poll();
+      if (sonar_distance(0, &ui_mm)) { ... }
+    }
+
+  When SONAR_EVENT is defined (an event id of sched.h), the index of
+  a sensor is posted as an event when its echo completed (by the
+  interrupt) or timed out (by sonar_poll).
+*/
+
+/* the sensors are bits of a byte in the isrs */
+#if !defined(SONAR_SENSORS_MAX)
+  #define SONAR_SENSORS_MAX 8
+#elif SONAR_SENSORS_MAX > 8
+  #error "SONAR_SENSORS_MAX is more than 8"
+#endif
+
+/* no echo after this is out of range (the HC-SR04 gives up after
+   38ms) */
+#if !defined(SONAR_TIMEOUT_MS)
+  #define SONAR_TIMEOUT_MS 40
+#endif
+/* quiet time between slots */
+#if !defined(SONAR_GAP_MS)
+  #define SONAR_GAP_MS 5
+#endif
+/* minimum time between two pings of a sensor */
+#if !defined(SONAR_CYCLE_MS)
+  #define SONAR_CYCLE_MS 60
+#endif
+
+#define SONAR_DISTANCE_NONE 0xFFFF
+
+/* the pin change group (0 port b, 1 port c, 2 port d) of a pin */
+#define _SONAR_GROUP_B 0
+#define _SONAR_GROUP_C 1
+#define _SONAR_GROUP_D 2
+
+#define _SONAR_ECHO_AUX(port, pin)                            \
+  _CAT(_SONAR_GROUP_, port), _BV(_pinToPin(PORT, pin))
+#define _SONAR_TRIGGER_AUX(port, pin)                         \
+  &_CAT(PORT, port), _BV(_pinToPin(PORT, pin))
+
+/* first fields of SSonarSensor for an arduino pin number */
+#define SONAR_ECHO(pin) _SONAR_ECHO_AUX(_pinToPort(pin), pin)
+#define SONAR_TRIGGER(pin) _SONAR_TRIGGER_AUX(_pinToPort(pin), pin)
+
+typedef struct {
+  /* pin change group and bit of the echo pin */
+  uint8_t ui_echo_group;
+  uint8_t ui_echo_mask;
+  /* port register and bit of the trigger pin */
+  volatile uint8_t* p_trigger_port;
+  uint8_t ui_trigger_mask;
+  /* sensors with the same slot are triggered together */
+  uint8_t ui_slot;
+} SSonarSensor;
+
+typedef struct {
+  /* echoes measured and sensors that timed out */
+  uint16_t ui_readings;
+  uint16_t ui_timeouts;
+  /* slots fired */
+  uint16_t ui_pings;
+} SSonarStats;
+
+/*
+  sets the trigger pins to outputs and the echo pins to inputs, and
+  enables the pin change interrupts. p_sensors is kept (not copied).
+  needs timer_init. false (and nothing is set up) if ui_sensors is
+  more than SONAR_SENSORS_MAX or a slot is not below it.
+*/
+bool sonar_init(const SSonarSensor* const p_sensors,
+                const uint8_t ui_sensors);
+
+/* fires the next slot when it is due, call from the main loop (or a
+   task every millisecond) */
+void sonar_poll(void);
+
+/*
+  milliseconds until sonar_poll has something to do (a slot to fire
+  or to time out), 0 if it is due now. with SONAR_EVENT a task that
+  runs sonar_poll can be started again after this, and at once from
+  the handler of the event (the slot ends with its last echo), instead
+  of every millisecond, so a tickless timer sleeps in between.
+*/
+uint16_t sonar_due_ms(void);
+
+/*
+  last distance of a sensor in millimetres, SONAR_DISTANCE_NONE if it
+  timed out. returns false if there was no new reading since the
+  previous call.
+*/
+bool sonar_distance(const uint8_t ui_sensor, uint16_t* const p_mm);
+
+void sonar_stats(SSonarStats* const p_stats);
+void sonar_stats_reset(void);
+
+#endif
@@ -1,9 +1,12 @@
 #include <avr/io.h>
 
 void spi_master_init(void) {
-  /* Set MOSI and SCK output, all others input */
+  /* Set MOSI, SCK and SS output, all others input. SS must not be
+     an input driven low, that would switch the spi to slave mode, so
+     it is an output even when the card CS is on another pin (e.g. SS
+     is the OC1B audio output) */
   /* DDR_SPI = (1<<DD_MOSI)|(1<<DD_SCK); */
-  DDRB |= (1<<DDB3)|(1<<DDB5);
+  DDRB |= (1<<DDB2)|(1<<DDB3)|(1<<DDB5);
   /* Enable SPI, Master, set clock rate fck/2, i.e. 8MHz */
   SPCR = (1<<SPE)|(1<<MSTR);
   SPSR |= (1<<SPI2X);
@@ -0,0 +1,112 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <util/crc16.h>
+
+#include "telemetry.h"
+#include "usart.h"
+
+/* max data bytes in a cobs block */
+#define COBS_BLOCK_MAX 254
+
+typedef struct {
+  uint8_t ui_channel;
+  const uint8_t* pch_record;
+  uint8_t ui_length;
+  uint16_t ui_crc;
+} STelemetry_Frame;
+
+/*
+  byte of the unencoded frame, i.e. channel, record and crc
+*/
+static inline
+uint8_t telemetry_frame_byte(const STelemetry_Frame* const p_frame,
+                             const uint16_t i) {
+  if (i == 0) {
+    return p_frame->ui_channel;
+  } else if (i <= p_frame->ui_length) {
+    return p_frame->pch_record[i - 1];
+  } else if (i == p_frame->ui_length + 1) {
+    return p_frame->ui_crc & 0xFF;
+  }
+  return p_frame->ui_crc >> 8;
+}
+
+/*
+  next byte of the encoded frame, into the buffer or (if there is
+  none) the usart
+*/
+static inline
+void telemetry_put(uint8_t** const ppch_out, const uint8_t data) {
+  if (*ppch_out == NULL) {
+    usart_write_byte(data);
+  } else {
+    *((*ppch_out)++) = data;
+  }
+}
+
+/*
+  encodes the frame into pch_out, or writes it to the usart if
+  pch_out is NULL
+*/
+static
+void telemetry_frame(const uint8_t ui_channel,
+                     const void* const p_record,
+                     const uint8_t ui_length,
+                     uint8_t* pch_out) {
+  STelemetry_Frame s_frame;
+  const uint16_t ui_size = ui_length + 3;
+  uint16_t ui_start = 0;
+  uint16_t i;
+  uint8_t ui_code;
+
+  s_frame.ui_channel = ui_channel;
+  s_frame.pch_record = p_record;
+  s_frame.ui_length = ui_length;
+
+  /* crc of channel and record */
+  s_frame.ui_crc = _crc_ccitt_update(0xFFFF, ui_channel);
+  for (i = 0; i < ui_length; i++) {
+    s_frame.ui_crc = _crc_ccitt_update(s_frame.ui_crc, s_frame.pch_record[i]);
+  }
+
+  /* cobs encode, each block is a code byte (1 + length of block)
+     followed by the non zero bytes up to the next zero */
+  while (1) {
+    i = ui_start;
+    while (i < ui_size &&
+           i - ui_start < COBS_BLOCK_MAX &&
+           telemetry_frame_byte(&s_frame, i) != 0x00) {
+      i++;
+    }
+    ui_code = i - ui_start + 1;
+
+    telemetry_put(&pch_out, ui_code);
+    for (; ui_start < i; ui_start++) {
+      telemetry_put(&pch_out, telemetry_frame_byte(&s_frame, ui_start));
+    }
+
+    if (i >= ui_size) {
+      break;
+    }
+    if (ui_code != COBS_BLOCK_MAX + 1) {
+      /* skip the zero that ended the block */
+      ui_start++;
+    }
+  }
+
+  /* frame delimiter */
+  telemetry_put(&pch_out, 0x00);
+}
+
+void telemetry_send_bytes(const uint8_t ui_channel,
+                          const void* const p_record,
+                          const uint8_t ui_length) {
+  telemetry_frame(ui_channel, p_record, ui_length, NULL);
+}
+
+void telemetry_encode_bytes(const uint8_t ui_channel,
+                            const void* const p_record,
+                            const uint8_t ui_length,
+                            uint8_t* const pch_frame) {
+  telemetry_frame(ui_channel, p_record, ui_length, pch_frame);
+}
@@ -0,0 +1,43 @@
+#ifndef _TELEMETRY_H
+#define _TELEMETRY_H
+
+#include <stdint.h>
+
+/*
+  Binary telemetry over the usart. Each record is sent as a frame:
+
+    COBS(channel, record..., crc lo, crc hi) 0x00
+
+  where crc is the avr-libc _crc_ccitt_update over the channel and
+  record bytes (initial value 0xFFFF). COBS encoding removes all 0x00
+  bytes from the frame, so 0x00 only appears as the frame delimiter
+  and a receiver can resynchronise at any point. Records are sent in
+  the native (little endian) layout, see tools/telemetry.py for the
+  host side decoder.
+
+  The frame is written into the usart send buffer (waiting while it is
+  full), encoding is done on the fly so no extra buffer is needed.
+*/
+void telemetry_send_bytes(const uint8_t ui_channel,
+                          const void* const p_record,
+                          const uint8_t ui_length);
+
+/* send a record (normally a struct) on the channel */
+#define telemetry_send(channel, record)                         \
+  telemetry_send_bytes((channel), &(record), sizeof(record))
+
+/* encoded size of a frame of a record of up to 251 bytes, with the
+   delimiter */
+#define TELEMETRY_FRAME_SIZE(length) ((length) + 5)
+
+/*
+  encodes the frame into pch_frame (TELEMETRY_FRAME_SIZE bytes)
+  instead of the usart, e.g. for usart_bus_send which sends a message
+  from a buffer
+*/
+void telemetry_encode_bytes(const uint8_t ui_channel,
+                            const void* const p_record,
+                            const uint8_t ui_length,
+                            uint8_t* const pch_frame);
+
+#endif
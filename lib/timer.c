@@ -1,11 +1,17 @@
 #include <avr/interrupt.h>
 
 #include "timer.h"
+#include "trace.h"
 
+#if defined TIMER_TICKLESS
+/* define prescaler for timer 0 of 1024 */
+#define PRESCALER _BV(CS02) | _BV(CS00)
+#else
 /* define prescaler for timer 0 of 64 */
 #define PRESCALER _BV(CS01) | _BV(CS00)
 /* define the 8bit wraparound value for timer */
-#define COUNTER_MAX 250
+#define COUNTER_MAX TIMER_COUNTS_PER_TICK
+#endif
 /*
   64 cycles in a increment, 250 increment to overflow timer 0
 
@@ -14,31 +20,184 @@
   clock at 16MHz, so 1000 overflows in a second
 
   i.e. 1 overflow is 1 millisecond
+
+  when tickless 1024 cycles in a increment, 256 increments to overflow,
+  each overflow is 16.384 milliseconds
 */
 
 /*
   overflows every (49.7 days)
  */
-volatile uint32_t ticks = 0;
+volatile uint32_t timer_ticks = 0;
+#if defined TIMER_TICKLESS
+/* microseconds past timer_ticks at the last overflow, under 1000 */
+volatile uint16_t timer_tick_micros = 0;
+#endif
+
+volatile uint16_t timer_interrupt_count = 0;
+
+static uint8_t pe_timer_owners[TIMERS];
+
+bool timer_claim(const uint8_t ui_timer, const ETimerOwner e_owner) {
+  if (pe_timer_owners[ui_timer] != TIMER_FREE
+      && pe_timer_owners[ui_timer] != e_owner) {
+    return false;
+  }
+  pe_timer_owners[ui_timer] = e_owner;
+  return true;
+}
+
+void timer_release(const uint8_t ui_timer, const ETimerOwner e_owner) {
+  if (pe_timer_owners[ui_timer] == e_owner) {
+    pe_timer_owners[ui_timer] = TIMER_FREE;
+  }
+}
+
+ETimerOwner timer_owner(const uint8_t ui_timer) {
+  return pe_timer_owners[ui_timer];
+}
 
 void timer_init(void) {
+  /* the pins of timer 0 can still be used for output compare without
+     pwm (see ranger.c) */
+  timer_claim(0, TIMER_OWNER_TICK);
   /* initilise timer 0 counter with 0 */
   TCNT0 = 0;
+#if defined TIMER_TICKLESS
+  /* enable overflow interrupt on timer 0, the compare interrupt is
+     enabled by timer_wake_at */
+  TIMSK0 = _BV(TOIE0);
+  /* setup timer 0 in normal mode, counts 0 to 255 */
+  TCCR0A = 0;
+  /* setup timer 0 with prescaler of 1024. this line enables the
+     timer */
+  TCCR0B = PRESCALER;
+#else
   /* enable overflow interrupt on timer 0 */
   TIMSK0 = _BV(OCF0A);
   /* setup timer 0 with no pwm and ctc operation */
   TCCR0A = _BV(WGM01);
-  /* set a comparer of 250 */
-  OCR0A = COUNTER_MAX;
+  /* set a comparer of 249, in ctc mode the counter is cleared on the
+     increment after the match so counts 0 to 249 */
+  OCR0A = COUNTER_MAX - 1;
   /* setup timer 0 with prescaler of 64. this line enables the
      timer */
   TCCR0B = PRESCALER;
+#endif
+}
+
+#if defined TIMER_TICKLESS
+bool timer_wake_at(const uint32_t ui_millis) {
+  int32_t i_ticks;
+  int32_t i_micros;
+  uint16_t ui_target;
+  uint8_t ui_count;
+  bool b_wait = true;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    ui_count = TCNT0;
+    if (TIFR0 & _BV(TOV0)) {
+      /* the overflow interrupt is pending and wakes the cpu at once */
+    } else {
+      i_ticks = (int32_t)(ui_millis - timer_ticks);
+      if (i_ticks <= 0) {
+        b_wait = false;
+      } else if (i_ticks <= TIMER_MICROS_PER_OVERFLOW / 1000 + 1) {
+        /* deadline in increments from the last overflow, rounded up */
+        i_micros = i_ticks * 1000 - timer_tick_micros;
+        ui_target = (i_micros + TIMER_MICROS_PER_COUNT - 1)
+          / TIMER_MICROS_PER_COUNT;
+        if (ui_target <= (uint16_t)ui_count + 1) {
+          /* due, or too close to set the compare safely */
+          b_wait = false;
+        } else if (ui_target <= 0xFF) {
+          OCR0A = ui_target;
+          TIFR0 = _BV(OCF0A);
+          TIMSK0 |= _BV(OCIE0A);
+        }
+      }
+      /* otherwise the next overflow comes first */
+    }
+  }
+
+  return b_wait;
 }
+#endif
+
+#if defined TIMER_BENCHMARK
+#define TIMER_BENCHMARK_CALLS 256
+
+/* results are stored here, so the calls are not optimised away */
+static volatile uint32_t ui_sink;
 
-uint32_t timer_millis(void) {
-  return ticks;
+/* runs expr TIMER_BENCHMARK_CALLS times, result is the cycles taken */
+#define TIMER_BENCHMARK_LOOP(result, expr)                      \
+  do {                                                          \
+    uint16_t i;                                                 \
+    uint32_t ui_start = timer_cycles();                         \
+    for (i = 0; i < TIMER_BENCHMARK_CALLS; i++) {               \
+      ui_sink = (expr);                                         \
+    }                                                           \
+    (result) = timer_cycles() - ui_start;                       \
+  } while (0)
+
+/* average cycles per call, rounded, without the loop overhead */
+static
+uint16_t timer_benchmark_average(const uint32_t ui_total,
+                                 const uint32_t ui_empty) {
+  if (ui_total <= ui_empty) {
+    return 0;
+  }
+  return (ui_total - ui_empty + TIMER_BENCHMARK_CALLS / 2)
+    / TIMER_BENCHMARK_CALLS;
 }
 
+void timer_benchmark(STimerBenchmark* const p_benchmark) {
+  uint32_t ui_empty;
+  uint32_t ui_total;
+
+  TIMER_BENCHMARK_LOOP(ui_empty, i);
+
+  TIMER_BENCHMARK_LOOP(ui_total, timer_millis());
+  p_benchmark->ui_millis = timer_benchmark_average(ui_total, ui_empty);
+  TIMER_BENCHMARK_LOOP(ui_total, timer_micros());
+  p_benchmark->ui_micros = timer_benchmark_average(ui_total, ui_empty);
+  TIMER_BENCHMARK_LOOP(ui_total, timer_cycles());
+  p_benchmark->ui_cycles = timer_benchmark_average(ui_total, ui_empty);
+  TIMER_BENCHMARK_LOOP(ui_total, timer_stamp());
+  p_benchmark->ui_stamp = timer_benchmark_average(ui_total, ui_empty);
+}
+#endif
+
+#if defined TIMER_TICKLESS
+ISR(TIMER0_OVF_vect) {
+  /* the counter has run on since the overflow */
+  TRACE_ENTER_LATENCY(TRACE_TIMER0,
+                      TCNT0 * (uint16_t)(TIMER_CYCLES_PER_COUNT / 8));
+  uint32_t ui_ticks = timer_ticks + TIMER_MICROS_PER_OVERFLOW / 1000;
+  uint16_t ui_micros = timer_tick_micros + TIMER_MICROS_PER_OVERFLOW % 1000;
+  if (ui_micros >= 1000) {
+    ui_micros -= 1000;
+    ui_ticks++;
+  }
+  timer_ticks = ui_ticks;
+  timer_tick_micros = ui_micros;
+  timer_interrupt_count++;
+  TRACE_EXIT(TRACE_TIMER0);
+}
+
+ISR(TIMER0_COMPA_vect) {
+  /* one shot, only wakes the cpu (see timer_wake_at) */
+  TIMSK0 &= ~_BV(OCIE0A);
+  timer_interrupt_count++;
+}
+#else
 ISR(TIMER0_COMPA_vect) {
-  ticks++;
+  /* the counter has run on since it was cleared by the match */
+  TRACE_ENTER_LATENCY(TRACE_TIMER0,
+                      TCNT0 * (uint16_t)(TIMER_CYCLES_PER_COUNT / 8));
+  timer_ticks++;
+  timer_interrupt_count++;
+  TRACE_EXIT(TRACE_TIMER0);
 }
+#endif
@@ -2,8 +2,224 @@
 #define _TIMER_H
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+
+#if defined TIMER_TICKLESS
+/* timer 0 runs freely with a prescaler of 1024 and overflows after
+   256 increments (16.384ms at 16MHz), the overflow interrupt adds the
+   elapsed time and the compare interrupt is only used to wake up at a
+   deadline (see timer_wake_at). 61 interrupts a second instead of
+   1000, at a resolution of 64us. */
+  #define TIMER_CYCLES_PER_COUNT 1024
+  #define TIMER_MICROS_PER_OVERFLOW 16384
+#else
+/* timer 0 increments every 64 cycles and is cleared after 250
+   increments, i.e. every millisecond at 16MHz */
+  #define TIMER_CYCLES_PER_COUNT 64
+  #define TIMER_COUNTS_PER_TICK 250
+#endif
+/* timer_stamp is in units of 64 cycles in both modes */
+#define TIMER_CYCLES_PER_STAMP 64
+#define TIMER_MICROS_PER_COUNT (TIMER_CYCLES_PER_COUNT / (F_CPU / 1000000))
+
+/*
+  milliseconds since timer_init, incremented by TIMER0_COMPA_vect (or
+  at each overflow by TIMER0_OVF_vect when tickless, with the
+  remainder in timer_tick_micros). overflows every (49.7 days)
+ */
+extern volatile uint32_t timer_ticks;
+#if defined TIMER_TICKLESS
+extern volatile uint16_t timer_tick_micros;
+#endif
+
+/* timer 0 interrupts since timer_init (wraps) */
+extern volatile uint16_t timer_interrupt_count;
 
 void timer_init(void);
-uint32_t timer_millis(void);
+
+/*
+  reads the milliseconds and the microseconds since then (from the
+  timer 0 counter) as a consistent pair. when the counter has been
+  cleared (or overflowed) but the interrupt has not yet run (e.g. if
+  called with interrupts disabled) the pending tick is included, so
+  the microseconds can exceed 1000.
+ */
+static inline
+void timer_read(uint32_t* const p_ticks, uint16_t* const p_micros) {
+  uint8_t ui_count;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    *p_ticks = timer_ticks;
+    ui_count = TCNT0;
+#if defined TIMER_TICKLESS
+    *p_micros = timer_tick_micros;
+    if ((TIFR0 & _BV(TOV0)) && ui_count < 128) {
+      *p_ticks += TIMER_MICROS_PER_OVERFLOW / 1000;
+      *p_micros += TIMER_MICROS_PER_OVERFLOW % 1000;
+    }
+#else
+    *p_micros = 0;
+    if ((TIFR0 & _BV(OCF0A)) && ui_count < TIMER_COUNTS_PER_TICK / 2) {
+      (*p_ticks)++;
+    }
+#endif
+  }
+  *p_micros += ui_count * (uint16_t)TIMER_MICROS_PER_COUNT;
+}
+
+/*
+  milliseconds since timer_init, the 4 byte read is atomic so does not
+  tear when the interrupt fires during the read.
+ */
+static inline
+uint32_t timer_millis(void) {
+  uint32_t ui_ticks;
+#if defined TIMER_TICKLESS
+  uint16_t ui_micros;
+  timer_read(&ui_ticks, &ui_micros);
+  return ui_ticks + ui_micros / 1000;
+#else
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    ui_ticks = timer_ticks;
+  }
+  return ui_ticks;
+#endif
+}
+
+/*
+  microseconds since timer_init, with a resolution of 4us (one timer 0
+  increment, 64us when tickless). overflows every 71.6 minutes. can be
+  used from an isr.
+ */
+static inline
+uint32_t timer_micros(void) {
+  uint32_t ui_ticks;
+  uint16_t ui_micros;
+  timer_read(&ui_ticks, &ui_micros);
+  return ui_ticks * 1000 + ui_micros;
+}
+
+/*
+  cpu cycles since timer_init, with a resolution of 64 cycles (1024
+  when tickless). overflows every 268 seconds, so only differences are
+  useful.
+ */
+static inline
+uint32_t timer_cycles(void) {
+  uint32_t ui_ticks;
+  uint16_t ui_micros;
+  timer_read(&ui_ticks, &ui_micros);
+  return ui_ticks * (F_CPU / 1000) + ui_micros * (uint32_t)(F_CPU / 1000000);
+}
+
+/*
+  short time stamp for profiling, in units of 64 cycles (4us, timer 0
+  increments unless tickless) and overflows every 262ms. only the low
+  16 bits of ticks are used, so it is cheaper than timer_cycles. the
+  difference of two stamps (as uint16_t) is the elapsed time.
+ */
+static inline
+uint16_t timer_stamp(void) {
+#if defined TIMER_TICKLESS
+  uint32_t ui_ticks;
+  uint16_t ui_micros;
+  timer_read(&ui_ticks, &ui_micros);
+  return (uint16_t)ui_ticks * (uint16_t)(F_CPU / 1000 / TIMER_CYCLES_PER_STAMP)
+    + ui_micros / (TIMER_CYCLES_PER_STAMP / (F_CPU / 1000000));
+#else
+  uint16_t ui_ticks;
+  uint8_t ui_count;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    /* low half of the (little endian) ticks */
+    ui_ticks = *(volatile uint16_t*)&timer_ticks;
+    ui_count = TCNT0;
+    if ((TIFR0 & _BV(OCF0A)) && ui_count < TIMER_COUNTS_PER_TICK / 2) {
+      ui_ticks++;
+    }
+  }
+  return ui_ticks * TIMER_COUNTS_PER_TICK + ui_count;
+#endif
+}
+
+/* convert a difference of timer_stamp into cycles */
+#define TIMER_STAMP_CYCLES(stamp) ((uint32_t)(stamp) * TIMER_CYCLES_PER_STAMP)
+
+/* number of timer 0 interrupts so far, the difference over a second
+   is the interrupt rate */
+static inline
+uint16_t timer_interrupts(void) {
+  uint16_t ui_count;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    ui_count = timer_interrupt_count;
+  }
+  return ui_count;
+}
+
+/*
+  makes sure an interrupt wakes the cpu from sleep by ui_millis. when
+  tickless the compare interrupt is set to the deadline if it is
+  before the next overflow (otherwise the overflow wakes the cpu
+  first, and this is called again), with the tick each millisecond
+  there is nothing to do. returns false if ui_millis has (almost)
+  been reached, so the caller should not sleep. call with interrupts
+  disabled, so the deadline can not pass before the sleep.
+ */
+#if defined TIMER_TICKLESS
+bool timer_wake_at(const uint32_t ui_millis);
+#else
+static inline
+bool timer_wake_at(const uint32_t ui_millis) {
+  return (int32_t)(ui_millis - timer_millis()) > 0;
+}
+#endif
+
+/*
+  owners of the three timers. a module claims the timer it
+  reconfigures, so two modules that need the same timer are found
+  when they start rather than by a wrong timing. timer_init claims
+  timer 0.
+*/
+typedef enum {
+  TIMER_FREE,
+  /* timer.c, the millisecond tick */
+  TIMER_OWNER_TICK,
+  /* icr-pulse.c, icr-capture.c */
+  TIMER_OWNER_ICR,
+  /* pwm.c */
+  TIMER_OWNER_PWM,
+  /* bam595.c */
+  TIMER_OWNER_BAM,
+  /* audio.c */
+  TIMER_OWNER_AUDIO,
+  /* record.c */
+  TIMER_OWNER_RECORD
+} ETimerOwner;
+
+#define TIMERS 3
+
+/* true if ui_timer was free or is already claimed by e_owner */
+bool timer_claim(const uint8_t ui_timer, const ETimerOwner e_owner);
+/* frees ui_timer if it is claimed by e_owner */
+void timer_release(const uint8_t ui_timer, const ETimerOwner e_owner);
+ETimerOwner timer_owner(const uint8_t ui_timer);
+
+#if defined TIMER_BENCHMARK
+/* cost of each accessor in cycles, including the store of the result */
+typedef struct {
+  uint16_t ui_millis;
+  uint16_t ui_micros;
+  uint16_t ui_cycles;
+  uint16_t ui_stamp;
+} STimerBenchmark;
+
+/*
+  measures the accessors by timing a loop of calls with timer_cycles
+  (the loop overhead is subtracted), must be called after timer_init
+  with interrupts enabled. the timer interrupt can fire during a
+  loop, adding under a cycle to the average.
+ */
+void timer_benchmark(STimerBenchmark* const p_benchmark);
+#endif
 
 #endif
@@ -0,0 +1,200 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+
+#include "trace.h"
+
+#if defined TRACE
+#include "ring.h"
+#include "timer.h"
+#include "usart_fmt.h"
+
+typedef struct {
+  uint8_t ui_id;
+  uint8_t ui_latency;
+  uint16_t ui_stamp;
+} STraceRecord;
+
+RING_DEFINE(trace_ring, STraceRecord, TRACE_RING_SIZE)
+
+/* written by the isrs, read by trace_poll */
+static trace_ring_t s_trace_ring;
+static volatile uint16_t ui_trace_dropped;
+
+/* state of trace_poll */
+static STraceStats s_trace_stats[TRACE_IDS];
+static uint16_t ui_trace_enter[TRACE_IDS];
+static uint8_t ui_trace_entered;
+static uint8_t ui_trace_periodic;
+
+static const char pch_trace_timer0[] PROGMEM = "timer0";
+static const char pch_trace_usart_rx[] PROGMEM = "usart_rx";
+static const char pch_trace_usart_udre[] PROGMEM = "usart_udre";
+static const char pch_trace_icr[] PROGMEM = "icr";
+static const char pch_trace_cli[] PROGMEM = "cli";
+static const char pch_trace_app[] PROGMEM = "app";
+
+/* names in the order of ETraceId */
+static const char* const pch_trace_names[TRACE_IDS] PROGMEM = {
+  pch_trace_timer0,
+  pch_trace_usart_rx,
+  pch_trace_usart_udre,
+  pch_trace_icr,
+  pch_trace_cli,
+  pch_trace_app
+};
+#endif
+
+#if defined TRACE_SIMAVR
+/* the marks on port c as signals of the vcd file written by simavr */
+#include <simavr/avr/avr_mcu_section.h>
+
+AVR_MCU(F_CPU, "atmega328p");
+AVR_MCU_VCD_FILE("trace.vcd", 1000);
+
+const struct avr_mmcu_vcd_trace_t trace_vcd[] _MMCU_ = {
+  { AVR_MCU_VCD_SYMBOL("TRACE"), .mask = (1 << TRACE_IDS) - 1, .what = (void*)&PORTC, },
+};
+#endif
+
+#if defined TRACE || defined TRACE_GPIO
+static
+void trace_reset(void) {
+#if defined TRACE
+  uint8_t i;
+
+  memset(s_trace_stats, 0, sizeof(s_trace_stats));
+  for (i = 0; i < TRACE_IDS; i++) {
+    s_trace_stats[i].ui_period_min = 0xFFFF;
+  }
+  /* the first entry after a reset starts the periods */
+  ui_trace_periodic = 0;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    ui_trace_dropped = 0;
+  }
+#endif
+}
+
+void trace_init(void) {
+#if defined TRACE_GPIO
+  PORTC &= ~((1 << TRACE_IDS) - 1);
+  DDRC |= (1 << TRACE_IDS) - 1;
+#endif
+#if defined TRACE
+  trace_ring_init(&s_trace_ring);
+  ui_trace_entered = 0;
+#endif
+  trace_reset();
+}
+#endif
+
+#if defined TRACE
+void trace_mark(const uint8_t ui_id, const uint8_t ui_latency) {
+  STraceRecord s_record;
+
+  s_record.ui_id = ui_id;
+  s_record.ui_latency = ui_latency;
+  /* masked so a mark from the main program (or TRACE_APP) does not
+     interleave with one from an isr, the ring has one producer */
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    s_record.ui_stamp = timer_stamp();
+    if (!trace_ring_push(&s_trace_ring, s_record)) {
+      ui_trace_dropped++;
+    }
+  }
+}
+
+void trace_poll(void) {
+  STraceRecord s_record;
+  STraceStats* p_stats;
+  uint16_t ui_elapsed;
+  uint8_t ui_id;
+  uint8_t ui_bit;
+
+  while (trace_ring_pop(&s_trace_ring, &s_record)) {
+    ui_id = s_record.ui_id & ~TRACE_EXIT_FLAG;
+    if (ui_id >= TRACE_IDS) {
+      continue;
+    }
+    p_stats = &(s_trace_stats[ui_id]);
+    ui_bit = _BV(ui_id);
+
+    if (s_record.ui_id & TRACE_EXIT_FLAG) {
+      /* an exit without its entry (lost or before the reset) is
+         ignored */
+      if (ui_trace_entered & ui_bit) {
+        ui_elapsed = s_record.ui_stamp - ui_trace_enter[ui_id];
+        if (ui_elapsed > p_stats->ui_run_max) {
+          p_stats->ui_run_max = ui_elapsed;
+        }
+        ui_trace_entered &= ~ui_bit;
+      }
+      continue;
+    }
+
+    if (ui_trace_periodic & ui_bit) {
+      ui_elapsed = s_record.ui_stamp - ui_trace_enter[ui_id];
+      if (ui_elapsed < p_stats->ui_period_min) {
+        p_stats->ui_period_min = ui_elapsed;
+      }
+      if (ui_elapsed > p_stats->ui_period_max) {
+        p_stats->ui_period_max = ui_elapsed;
+      }
+    }
+    if (s_record.ui_latency > p_stats->ui_latency_max) {
+      p_stats->ui_latency_max = s_record.ui_latency;
+    }
+    p_stats->ui_count++;
+    ui_trace_enter[ui_id] = s_record.ui_stamp;
+    ui_trace_entered |= ui_bit;
+    ui_trace_periodic |= ui_bit;
+  }
+}
+
+void trace_stats(const ETraceId e_id, STraceStats* const p_stats) {
+  memcpy(p_stats, &(s_trace_stats[e_id]), sizeof(STraceStats));
+}
+
+uint16_t trace_dropped(void) {
+  uint16_t ui_dropped;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    ui_dropped = ui_trace_dropped;
+  }
+  return ui_dropped;
+}
+
+void trace_dump(void) {
+  const STraceStats* p_stats;
+  uint8_t i;
+
+  trace_poll();
+  usart_fmt_P(PSTR("trace: id count run_max period_min period_max"
+                   " jitter latency_max (cycles), dropped %u\n"),
+              trace_dropped());
+  for (i = 0; i < TRACE_IDS; i++) {
+    p_stats = &(s_trace_stats[i]);
+    if (p_stats->ui_count == 0) {
+      continue;
+    }
+    usart_fmt_P(PSTR("trace: %S %u %lu"),
+                (const char*)(uintptr_t)pgm_read_word(&(pch_trace_names[i])),
+                p_stats->ui_count,
+                TIMER_STAMP_CYCLES(p_stats->ui_run_max));
+    if (p_stats->ui_count > 1) {
+      usart_fmt_P(PSTR(" %lu %lu %lu"),
+                  TIMER_STAMP_CYCLES(p_stats->ui_period_min),
+                  TIMER_STAMP_CYCLES(p_stats->ui_period_max),
+                  TIMER_STAMP_CYCLES(p_stats->ui_period_max
+                                     - p_stats->ui_period_min));
+    } else {
+      usart_fmt_P(PSTR(" - - -"));
+    }
+    usart_fmt_P(PSTR(" %u\n"), p_stats->ui_latency_max * 8);
+  }
+
+  trace_reset();
+}
+#endif
@@ -0,0 +1,118 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+#include <avr/io.h>
+
+/*
+  Interrupt tracer. The instrumented isrs (and sections with
+  interrupts disabled) mark their entry and exit:
+
+    ISR(TIMER0_COMPA_vect) {
+      TRACE_ENTER_LATENCY(TRACE_TIMER0, TCNT0 * 8);
+      ...
+      TRACE_EXIT(TRACE_TIMER0);
+    }
+
+  Built with -DTRACE each mark pushes a record (id, timer_stamp and,
+  where the hardware allows, the latency) into a ring buffer that
+  trace_poll drains in the main program into statistics per id:
+  the number of runs, the longest run, the shortest and longest time
+  between entries (the difference is the jitter of a periodic
+  interrupt) and the worst latency. The latency is the time from the
+  interrupt condition to the isr, known for timer interrupts from the
+  counter (timer 0 compare: TCNT0, input capture: TCNT1 - ICR1), in
+  units of 8 cycles (0.5us). Run time and periods are in timer_stamp
+  units (64 cycles).
+
+  Built with -DTRACE_GPIO each id also drives a pin of port c (A0 to
+  A5 on an arduino) high while it runs, for a logic analyser or the
+  vcd output of simavr (-DTRACE_SIMAVR, which needs the installed
+  simavr headers and adds the vcd description to the elf file, so
+  run_avr writes trace.vcd). The pins cost two instructions per isr,
+  so show the timing with almost no disturbance.
+
+  Without either define the macros are empty.
+*/
+
+typedef enum {
+  TRACE_TIMER0,
+  TRACE_USART_RX,
+  TRACE_USART_UDRE,
+  TRACE_ICR,
+  /* sections with interrupts disabled */
+  TRACE_CLI,
+  /* free for the application, also marked by the bam595 isrs */
+  TRACE_APP,
+  TRACE_IDS
+} ETraceId;
+
+#if !defined(TRACE_RING_SIZE)
+  #define TRACE_RING_SIZE 64
+#endif
+
+#if defined TRACE_GPIO
+  #define _TRACE_PIN_ON(id) (PORTC |= _BV(id))
+  #define _TRACE_PIN_OFF(id) (PORTC &= ~_BV(id))
+#else
+  #define _TRACE_PIN_ON(id)
+  #define _TRACE_PIN_OFF(id)
+#endif
+
+#if defined TRACE
+typedef struct {
+  uint16_t ui_count;
+  /* longest run, in timer_stamp units */
+  uint16_t ui_run_max;
+  /* shortest and longest time between entries, in timer_stamp units */
+  uint16_t ui_period_min;
+  uint16_t ui_period_max;
+  /* worst latency in units of 8 cycles, 0 if not known */
+  uint8_t ui_latency_max;
+} STraceStats;
+
+/* flag of the record id for an exit */
+#define TRACE_EXIT_FLAG 0x80
+
+void trace_mark(const uint8_t ui_id, const uint8_t ui_latency);
+
+  #define TRACE_ENTER(id)                                       \
+    do { _TRACE_PIN_ON(id); trace_mark((id), 0); } while (0)
+  #define TRACE_ENTER_LATENCY(id, latency)                      \
+    do {                                                        \
+      const uint16_t _trace_latency = (latency);                \
+      _TRACE_PIN_ON(id);                                        \
+      trace_mark((id), _trace_latency > 0xFF ? 0xFF : _trace_latency); \
+    } while (0)
+  #define TRACE_EXIT(id)                                        \
+    do { trace_mark((id) | TRACE_EXIT_FLAG, 0); _TRACE_PIN_OFF(id); } while (0)
+#else
+  #define TRACE_ENTER(id) do { _TRACE_PIN_ON(id); } while (0)
+  #define TRACE_ENTER_LATENCY(id, latency) do { _TRACE_PIN_ON(id); } while (0)
+  #define TRACE_EXIT(id) do { _TRACE_PIN_OFF(id); } while (0)
+#endif
+
+/* to be used right after cli and right before sei */
+#define TRACE_CLI_BEGIN() TRACE_ENTER(TRACE_CLI)
+#define TRACE_CLI_END() TRACE_EXIT(TRACE_CLI)
+
+#if defined TRACE || defined TRACE_GPIO
+/* sets the trace pins to outputs, clears the statistics */
+void trace_init(void);
+#endif
+
+#if defined TRACE
+/* drains the ring buffer into the statistics, needs to be called
+   often enough that the ring does not fill (e.g. each main loop) */
+void trace_poll(void);
+
+void trace_stats(const ETraceId e_id, STraceStats* const p_stats);
+
+/* records lost as the ring was full */
+uint16_t trace_dropped(void);
+
+/* writes the statistics with usart_fmt (in cycles) and resets them */
+void trace_dump(void);
+#endif
+
+#endif
@@ -0,0 +1,182 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "upload.h"
+#include "sdcard.h"
+#include "timer.h"
+#include "usart.h"
+
+/* second sector buffer, the first is the SSDCard buffer */
+static uint8_t pch_upload_buffer[512];
+
+typedef struct {
+  SSDFATCard* p_sdfatcard;
+  uint32_t ui_cluster;
+  /* next sector to write within the cluster */
+  uint8_t ui_sector;
+} SUpload_Position;
+
+/*
+  Absolute sector of the next sector of the file, following the chain
+  into the next cluster when needed. Reads the fat, so the card must
+  not be busy.
+*/
+static
+uint8_t upload_sector_next(SUpload_Position* const p_position,
+                           uint32_t* const p_sector) {
+  uint32_t ui_next;
+
+  if (p_position->ui_sector >= p_position->p_sdfatcard->ui_sectors_per_cluster) {
+    /* the SSDCard buffer holds data, so read the fat unbuffered */
+    ui_next = fat32_cluster_lookup_spi(p_position->p_sdfatcard,
+                                       p_position->ui_cluster);
+    if (ui_next >= 0x0FFFFFF8) {
+      /* end of chain (or invalid), file is not large enough */
+      return 0xDF;
+    }
+    if (ui_next < 2) {
+      return 0xFA;
+    }
+    p_position->ui_cluster = ui_next;
+    p_position->ui_sector = 0;
+  }
+
+  *p_sector = fat32_cluster_sector(p_position->p_sdfatcard,
+                                   p_position->ui_cluster,
+                                   p_position->ui_sector);
+  p_position->ui_sector++;
+
+  return 0;
+}
+
+uint8_t upload_file(SSDFATCard* const p_sdfatcard,
+                    const char* pch_path,
+                    const uint32_t ui_size,
+                    SUploadStats* const p_stats) {
+  SSDCard* const p_sdcard = p_sdfatcard->p_sdcard;
+  uint8_t* const p_buffers[2] = { p_sdcard->pch_sector, pch_upload_buffer };
+  SUpload_Position s_position;
+  SUsartStats s_usart_before;
+  SUsartStats s_usart_after;
+  uint32_t ui_file_size;
+  uint32_t ui_entry_sector;
+  uint16_t ui_entry_offset;
+  uint32_t ui_sector;
+  uint32_t ui_received = 0;
+  uint32_t ui_start = 0;
+  uint32_t ui_last;
+  uint16_t ui_fill = 0;
+  uint8_t ui_filling = 0;
+  uint8_t* p_write = NULL;
+  bool b_waiting = false;
+  bool b_data;
+  uint8_t data;
+  uint8_t r;
+
+  memset(p_stats, 0, sizeof(SUploadStats));
+
+  r = fat32_file_locate_entry(p_sdfatcard,
+                              pch_path,
+                              &(s_position.ui_cluster),
+                              &ui_file_size,
+                              &ui_entry_sector,
+                              &ui_entry_offset);
+  if (r != 0) {
+    return r;
+  }
+  /* empty files have no cluster */
+  if (s_position.ui_cluster < 2) {
+    return 0xDF;
+  }
+  s_position.p_sdfatcard = p_sdfatcard;
+  s_position.ui_sector = 0;
+
+  /* the SSDCard buffer is used for data from now on */
+  p_sdcard->ui_sector = 0xFFFFFFFF;
+
+  usart_stats(&s_usart_before);
+  ui_last = timer_millis();
+
+  while (ui_received < ui_size || ui_fill > 0 || p_write != NULL) {
+    /* move the received bytes into the filling buffer */
+    b_data = false;
+    while (ui_fill < 512 &&
+           ui_received < ui_size &&
+           usart_get_char(&data)) {
+      p_buffers[ui_filling][ui_fill++] = data;
+      ui_received++;
+      b_data = true;
+    }
+    if (b_data) {
+      ui_last = timer_millis();
+      if (ui_start == 0) {
+        ui_start = ui_last;
+      }
+    } else if (timer_millis() - ui_last > UPLOAD_TIMEOUT_MS) {
+      /* no data, or the card did not finish a write */
+      return ui_fill < 512 && ui_received < ui_size ? 0xDE : 0xFF;
+    }
+
+    /* hand over a complete sector (the last is padded with zeros) */
+    if (p_write == NULL &&
+        ui_fill > 0 &&
+        (ui_fill == 512 || ui_received == ui_size)) {
+      memset(p_buffers[ui_filling] + ui_fill, 0, 512 - ui_fill);
+      p_write = p_buffers[ui_filling];
+      ui_filling ^= 1;
+      ui_fill = 0;
+    }
+
+    if (p_write == NULL) {
+      continue;
+    }
+
+    /* write once the card has programmed the previous sector */
+    if (sdcard_busy()) {
+      if (ui_fill == 512 && !b_waiting) {
+        /* both buffers are full */
+        b_waiting = true;
+        p_stats->ui_card_waits++;
+      }
+      continue;
+    }
+    b_waiting = false;
+
+    r = upload_sector_next(&s_position, &ui_sector);
+    if (r != 0) {
+      return r;
+    }
+    r = sdcard_sector_write_begin(p_sdcard, ui_sector, p_write);
+    if (r != 0) {
+      return r;
+    }
+    p_write = NULL;
+  }
+
+  r = sdcard_wait_ready();
+  if (r != 0) {
+    return r;
+  }
+
+  p_stats->ui_bytes = ui_received;
+  p_stats->ui_millis = timer_millis() - ui_start;
+
+  usart_stats(&s_usart_after);
+  p_stats->ui_stalls
+    = s_usart_after.ui_rx_stalls - s_usart_before.ui_rx_stalls;
+  p_stats->ui_rx_overruns
+    = s_usart_after.ui_rx_overruns - s_usart_before.ui_rx_overruns;
+
+  p_sdcard->ui_sector = 0xFFFFFFFF;
+  r = fat32_file_set_size(p_sdfatcard,
+                          ui_entry_sector,
+                          ui_entry_offset,
+                          ui_size);
+  if (r != 0) {
+    return r;
+  }
+
+  return p_stats->ui_rx_overruns == 0 ? 0 : 0xDD;
+}
@@ -0,0 +1,51 @@
+#ifndef _UPLOAD_H
+#define _UPLOAD_H
+
+#include <stdint.h>
+
+#include "sdcard-fat.h"
+
+/* abort when no data is received for this time */
+#if !defined(UPLOAD_TIMEOUT_MS)
+  #define UPLOAD_TIMEOUT_MS 2000
+#endif
+
+typedef struct {
+  /* bytes received and written */
+  uint32_t ui_bytes;
+  /* from the first byte received to the last sector written */
+  uint32_t ui_millis;
+  /* times the sender was stopped by flow control */
+  uint16_t ui_stalls;
+  /* times both buffers were full, waiting on the card */
+  uint16_t ui_card_waits;
+  /* bytes lost as the receive buffer was full (0 unless flow control
+     failed) */
+  uint16_t ui_rx_overruns;
+} SUploadStats;
+
+/*
+  Receives ui_size bytes from the usart into the file identified by
+  pch_path, then sets the file size in the directory entry.
+
+  The file must already exist with enough clusters allocated for
+  ui_size bytes (e.g. created on a pc), no clusters are allocated.
+
+  Two sector buffers are used (the SSDCard buffer and a static one),
+  one is filled from the usart receive buffer while the other is
+  written to the card. Writes use sdcard_sector_write_begin, so the
+  card programs the sector while the next one is received. The usart
+  should be built with flow control (USART_FLOW_XONXOFF or
+  USART_FLOW_RTS), so the sender is stopped while the main loop is
+  busy writing to the card.
+
+  Returns 0 on success, 0xDF if the file is too small, 0xDE on a
+  receive timeout, 0xDD if received data was lost, or the error of
+  the sdcard/fat layer.
+*/
+uint8_t upload_file(SSDFATCard* const p_sdfatcard,
+                    const char* pch_path,
+                    const uint32_t ui_size,
+                    SUploadStats* const p_stats);
+
+#endif
@@ -1,4 +1,5 @@
 #include <avr/interrupt.h>
+#include <util/atomic.h>
 #include <stdbool.h>
 
 #if defined USE_PRINTF
@@ -6,27 +7,144 @@
   #include <stdarg.h>
 #endif
 
-#if defined PIN_ERROR
+#if defined PIN_ERROR || defined USART_BUS_DE || defined USART_FLOW_RTS
   #include <pins.h>
 #endif
 
+#if defined BAUD
+  #if BAUD > F_CPU / 8
+    #error "BAUD is not achievable with F_CPU, even with U2X"
+  #endif
+  /* computes UBRR_VALUE and USE_2X, warns (errors with -Werror) when
+     the baud rate error is larger than BAUD_TOL percent */
+  #include <util/setbaud.h>
+#endif
+
 #include "usart.h"
-#include "queue.h"
+#include "ring.h"
+#include "prof.h"
+#include "trace.h"
+
+#if defined USART_TIMESTAMP
+  #include "timer.h"
+#endif
+
+#if defined USART_RX_EVENT
+  #include "sched.h"
+#endif
+
+#if defined USART_SLEEP
+  #include <avr/sleep.h>
+#endif
+
+#if defined USART_BUS && !defined BAUD
+  #error "USART_BUS requires BAUD"
+#endif
 
-#define SEND_BUFFER_SIZE 255
-#define RECEIVE_BUFFER_SIZE 50
+/* buffer sizes must be a power of two (at most 256) */
+#if !defined(SEND_BUFFER_SIZE)
+  #define SEND_BUFFER_SIZE 256
+#endif
+#if !defined(RECEIVE_BUFFER_SIZE)
+  #define RECEIVE_BUFFER_SIZE 64
+#endif
 #define PRINTF_BUFFER_SIZE 128
 
-uint8_t usart_sending[SEND_BUFFER_SIZE];
-uint8_t usart_sending_head = 0;
-uint8_t usart_sending_tail = 0;
+/* receive flow control, the sender is stopped when the receive buffer
+   holds USART_FLOW_STOP bytes and restarted once it is down to
+   USART_FLOW_START. the stop level leaves room for the bytes the
+   sender (e.g. a usb serial bridge) has in flight. */
+#if defined USART_FLOW_XONXOFF || defined USART_FLOW_RTS
+  #define USART_FLOW
+  #if !defined(USART_FLOW_STOP)
+    #define USART_FLOW_STOP (RECEIVE_BUFFER_SIZE / 2)
+  #endif
+  #if !defined(USART_FLOW_START)
+    #define USART_FLOW_START (RECEIVE_BUFFER_SIZE / 4)
+  #endif
+  #define USART_XON  0x11
+  #define USART_XOFF 0x13
+#endif
+
+RING_DEFINE(usart_send_ring, uint8_t, SEND_BUFFER_SIZE)
+RING_DEFINE(usart_receive_ring, uint8_t, RECEIVE_BUFFER_SIZE)
+
+/* written by main, read by USART_UDRE_vect */
+static usart_send_ring_t usart_sending;
 bool usart_is_sending = false;
 
-uint8_t usart_receiving[RECEIVE_BUFFER_SIZE];
-uint8_t usart_receiving_head = 0;
-uint8_t usart_receiving_tail = 0;
+/* written by USART_RX_vect, read by main */
+static usart_receive_ring_t usart_receiving;
+
+#if defined USART_BUS
+/* address of this node on the bus */
+static uint8_t usart_bus_address = USART_BUS_BROADCAST;
+/* address frame to send before the data in the send buffer */
+static volatile uint8_t usart_bus_tx_address;
+static volatile bool usart_bus_tx_pending = false;
+/* set while usart_bus_send is filling the send buffer */
+static volatile bool usart_bus_tx_active = false;
+
+/* UCSR0A bits that must be preserved, the others are flags (TXC0 is
+   cleared by writing one, the error flags must be written zero) */
+#define USART_UCSR0A_MODE (_BV(U2X0) | _BV(MPCM0))
+#endif
+
+#if defined USART_TIMESTAMP
+/* timer_micros of the last USART_STAMP_BYTE sent (loaded into UDR0)
+   and received, and the number of them, written by the isrs */
+static volatile uint32_t usart_tx_stamp_micros;
+static volatile uint8_t usart_tx_stamps = 0;
+static volatile uint32_t usart_rx_stamp_micros;
+static volatile uint8_t usart_rx_stamps = 0;
+#endif
+
+#if defined USART_FLOW
+/* sender has been asked to stop */
+static volatile bool usart_rx_stopped = false;
+#if defined USART_FLOW_XONXOFF
+/* XON or XOFF to send ahead of the send buffer, 0 if none */
+static volatile uint8_t usart_flow_char = 0;
+#endif
+#endif
+
+#if defined USART_SLEEP
+/*
+  idle sleep until the next interrupt, unless the send buffer no
+  longer has ui_free bytes free. checked with interrupts disabled, and
+  sleep follows sei immediately, so the interrupt that changes the
+  buffer can not be missed.
+ */
+static
+void usart_wait_send(const uint8_t ui_free) {
+  cli();
+  if (usart_send_ring_free(&usart_sending) == ui_free) {
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    sleep_disable();
+  } else {
+    sei();
+  }
+}
+#else
+  #define usart_wait_send(ui_free)
+#endif
+
+/* error counters, see usart_stats */
+static uint16_t usart_tx_dropped = 0;
+static volatile uint16_t usart_rx_overruns = 0;
+static volatile uint16_t usart_rx_data_overruns = 0;
+static volatile uint16_t usart_rx_frame_errors = 0;
+static volatile uint16_t usart_rx_stalls = 0;
 
 void usart_init(uint16_t ubrr) {
+#if defined USART_FLOW_RTS
+  /* sender may send */
+  writePin(USART_FLOW_RTS, false);
+  setMode(USART_FLOW_RTS, output);
+#endif
   /* Set baud rate */
   UBRR0H = (uint8_t)(ubrr>>8);
   UBRR0L = (uint8_t)(ubrr & 0xFF);
@@ -36,6 +154,103 @@ void usart_init(uint16_t ubrr) {
   UCSR0C = (3<<UCSZ00);
 }
 
+#if defined BAUD
+/*
+  initilise the usart with the UBRR and U2X settings calculated at
+  compile time for BAUD. the double speed mode is only used when
+  needed to keep the error within tolerance.
+ */
+void usart_init_baud(void) {
+#if USE_2X
+  UCSR0A |= _BV(U2X0);
+#else
+  UCSR0A &= ~_BV(U2X0);
+#endif
+  usart_init(UBRR_VALUE);
+}
+#endif
+
+#if defined USART_BUS
+/*
+  initilise the usart as a node on a multi-processor bus, 9bit frames
+  where the 9th bit marks an address frame. with MPCM0 set the
+  hardware discards all data frames, so the receive interrupt only
+  fires for address frames until this node is addressed.
+ */
+void usart_bus_init(const uint8_t address) {
+  usart_bus_address = address;
+#if defined USART_BUS_DE
+  /* driver disabled, i.e. listening */
+  writePin(USART_BUS_DE, false);
+  setMode(USART_BUS_DE, output);
+#endif
+  /* Set baud rate */
+  UBRR0H = (uint8_t)(UBRR_VALUE>>8);
+  UBRR0L = (uint8_t)(UBRR_VALUE & 0xFF);
+  /* Only receive address frames */
+#if USE_2X
+  UCSR0A = _BV(U2X0) | _BV(MPCM0);
+#else
+  UCSR0A = _BV(MPCM0);
+#endif
+  /* Enable receiver and transmitter */
+  UCSR0B = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0) | _BV(UCSZ02);
+  /* Set frame format: 9data, 1stop bit, no parity */
+  UCSR0C = (3<<UCSZ00);
+}
+
+/*
+  sends a message to a node (or to all with USART_BUS_BROADCAST), an
+  address frame is sent and then the data frames. waits for the
+  previous message to be passed to the hardware first. returns the
+  number of bytes of data sent.
+ */
+uint16_t usart_bus_send(const uint8_t address,
+                        const uint8_t* data,
+                        const uint16_t length) {
+  uint16_t sent;
+
+  /* wait for the previous message */
+  while (usart_bus_tx_pending ||
+         !usart_send_ring_empty(&usart_sending)) {}
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    usart_bus_tx_address = address;
+    usart_bus_tx_pending = true;
+    usart_bus_tx_active = true;
+#if defined USART_BUS_DE
+    /* driver is released by USART_TX_vect once the message is done */
+    writePin(USART_BUS_DE, true);
+    UCSR0B &= ~_BV(TXCIE0);
+#endif
+    UCSR0B |= _BV(UDRIE0);
+  }
+
+  sent = usart_write(data, length, USART_BLOCK);
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    usart_bus_tx_active = false;
+#if defined USART_BUS_DE
+    /* fires at once if the last frame has already been sent */
+    UCSR0B |= _BV(TXCIE0);
+#endif
+  }
+
+  return sent;
+}
+#endif
+
+#if defined USART_BUS
+/*
+  on the bus (9bit frames) only usart_bus_send writes, data without an
+  address frame would be taken as part of the previous message
+ */
+static inline
+bool usart_bus_refused(void) {
+  return (UCSR0B & _BV(UCSZ02)) && !usart_bus_tx_active;
+}
+#endif
+
 /*
   copies data into the send buffer. if length is 0, then it is assumed
   that the data is text and terminated by a null byte.
@@ -43,19 +258,30 @@ void usart_init(uint16_t ubrr) {
 void usart_write_bytes(const uint8_t* const data, uint16_t length) {
   const uint8_t* x = data;
   bool r = false;
-  while((length == 0 && *x != '\0') || (length > x - data)) {
-    if (*x == '\n' && !r && length == 0) {
-      r = queue_enqueue(usart_sending,
-                        SEND_BUFFER_SIZE,
-                        &usart_sending_head,
-                        usart_sending_tail,
-                        '\r');
+
+#if defined USART_BUS
+  if (usart_bus_refused()) {
+    if (length == 0) {
+      while (*x++ != '\0') {
+        usart_tx_dropped++;
+      }
+    }
+    usart_tx_dropped += length;
+    return;
+  }
+#endif
+
+  if (length > 0) {
+    /* binary data */
+    usart_write(data, length, USART_BLOCK);
+    return;
+  }
+
+  while(*x != '\0') {
+    if (*x == '\n' && !r) {
+      r = usart_send_ring_push(&usart_sending, '\r');
     } else {
-      if (queue_enqueue(usart_sending,
-                        SEND_BUFFER_SIZE,
-                        &usart_sending_head,
-                        usart_sending_tail,
-                        *x)) {
+      if (usart_send_ring_push(&usart_sending, *x)) {
         x++;
         r = false;
       }
@@ -66,11 +292,104 @@ void usart_write_bytes(const uint8_t* const data, uint16_t length) {
   }
 }
 
+/*
+  copies binary data into the send buffer, when the buffer is full the
+  policy decides to wait or to drop data. returns the number of bytes
+  of data that were accepted, bytes that are not accepted (or are
+  discarded from the buffer) are counted in the tx_dropped statistic.
+ */
+uint16_t usart_write(const uint8_t* data,
+                     uint16_t length,
+                     const EUsartPolicy policy) {
+  uint16_t accepted = 0;
+  uint8_t n;
+
+#if defined USART_BUS
+  if (usart_bus_refused()) {
+    usart_tx_dropped += length;
+    return 0;
+  }
+#endif
+
+  switch (policy) {
+  case USART_ALL_OR_NOTHING:
+    if (length > usart_send_ring_free(&usart_sending)) {
+      usart_tx_dropped += length;
+      return 0;
+    }
+    break;
+  case USART_DROP_OLDEST:
+    /* only the tail of the message can fit into the buffer */
+    if (length > SEND_BUFFER_SIZE - 1) {
+      usart_tx_dropped += length - (SEND_BUFFER_SIZE - 1);
+      data += length - (SEND_BUFFER_SIZE - 1);
+      length = SEND_BUFFER_SIZE - 1;
+    }
+    /* make space by discarding the oldest bytes, the isr is the
+       consumer so is masked while doing this */
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      TRACE_CLI_BEGIN();
+      n = usart_send_ring_free(&usart_sending);
+      if (length > n) {
+        usart_tx_dropped
+          += usart_send_ring_discard(&usart_sending, length - n);
+      }
+      TRACE_CLI_END();
+    }
+    break;
+  default:
+    break;
+  }
+
+  while (length > 0) {
+    n = usart_send_ring_push_span(&usart_sending,
+                                  data,
+                                  length > 0xFF ? 0xFF : length);
+    data += n;
+    length -= n;
+    accepted += n;
+    /* unmask the usart data register interrupt, triggers firing of
+       the the USART_UDRE_vect ISR */
+    UCSR0B |= _BV(UDRIE0);
+
+    if (n == 0 && policy == USART_DROP_NEWEST) {
+      usart_tx_dropped += length;
+      break;
+    }
+    if (n == 0) {
+      usart_wait_send(0);
+    }
+  }
+
+  return accepted;
+}
+
+/*
+  copies a single byte into the send buffer, waits if the buffer is
+  full. no translation of the byte is performed.
+ */
+void usart_write_byte(const uint8_t data) {
+#if defined USART_BUS
+  if (usart_bus_refused()) {
+    usart_tx_dropped++;
+    return;
+  }
+#endif
+  while (!usart_send_ring_push(&usart_sending, data)) {
+    /* ensure the buffer is being drained */
+    UCSR0B |= _BV(UDRIE0);
+    usart_wait_send(0);
+  }
+  /* unmask the usart data register interrupt */
+  UCSR0B |= _BV(UDRIE0);
+}
+
 #if defined USE_PRINTF
 void usart_printf(const char *__fmt, ...) {
   char buffer[PRINTF_BUFFER_SIZE];
   va_list ap;
   int length = 0;
+  PROF_BEGIN(PROF_USART_PRINTF);
   va_start(ap, __fmt);
   length = vsnprintf(buffer, PRINTF_BUFFER_SIZE, __fmt, ap);
   va_end(ap);
@@ -81,46 +400,234 @@ void usart_printf(const char *__fmt, ...) {
   } else {
     usart_write_bytes((uint8_t*)buffer, 0);
   }
+  PROF_END(PROF_USART_PRINTF);
+}
+#endif
+
+void usart_stats(SUsartStats* const p_stats) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    p_stats->ui_tx_dropped = usart_tx_dropped;
+    p_stats->ui_rx_overruns = usart_rx_overruns;
+    p_stats->ui_rx_data_overruns = usart_rx_data_overruns;
+    p_stats->ui_rx_frame_errors = usart_rx_frame_errors;
+    p_stats->ui_rx_stalls = usart_rx_stalls;
+  }
+}
+
+void usart_stats_reset(void) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    usart_tx_dropped = 0;
+    usart_rx_overruns = 0;
+    usart_rx_data_overruns = 0;
+    usart_rx_frame_errors = 0;
+    usart_rx_stalls = 0;
+  }
+}
+
+/*
+  waits until the send buffer is empty, i.e. all data has been passed
+  to the hardware.
+ */
+void usart_flush(void) {
+  while (!usart_send_ring_empty(&usart_sending)) {
+    usart_wait_send(usart_send_ring_free(&usart_sending));
+  }
+}
+
+#if defined USART_TIMESTAMP
+uint8_t usart_tx_stamp(uint32_t* const p_micros) {
+  uint8_t ui_stamps;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    *p_micros = usart_tx_stamp_micros;
+    ui_stamps = usart_tx_stamps;
+  }
+  return ui_stamps;
+}
+
+uint8_t usart_rx_stamp(uint32_t* const p_micros) {
+  uint8_t ui_stamps;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    *p_micros = usart_rx_stamp_micros;
+    ui_stamps = usart_rx_stamps;
+  }
+  return ui_stamps;
 }
 #endif
 
 bool usart_data_pending(void) {
-  return usart_receiving_head != usart_receiving_tail;
+  return !usart_receive_ring_empty(&usart_receiving);
 }
 
+#if defined USART_FLOW
+/*
+  asks the sender to stop (or restart), must be called with interrupts
+  disabled.
+ */
+static
+void usart_flow_signal(const bool b_stop) {
+  usart_rx_stopped = b_stop;
+#if defined USART_FLOW_RTS
+  /* rts is active low, high stops the sender */
+  if (b_stop) {
+    writePin(USART_FLOW_RTS, true);
+  } else {
+    writePin(USART_FLOW_RTS, false);
+  }
+#else
+  usart_flow_char = b_stop ? USART_XOFF : USART_XON;
+  UCSR0B |= _BV(UDRIE0);
+#endif
+}
+#endif
+
 bool usart_get_char(uint8_t* data) {
-  return queue_dequeue(usart_receiving,
-                       RECEIVE_BUFFER_SIZE,
-                       usart_receiving_head,
-                       &usart_receiving_tail,
-                       data);
+#if defined USART_FLOW
+  const bool b_data = usart_receive_ring_pop(&usart_receiving, data);
+  if (usart_rx_stopped &&
+      usart_receive_ring_count(&usart_receiving) <= USART_FLOW_START) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      usart_flow_signal(false);
+    }
+  }
+  return b_data;
+#else
+  return usart_receive_ring_pop(&usart_receiving, data);
+#endif
 }
 
 ISR(USART_UDRE_vect) {
   uint8_t data;
-  if (queue_dequeue(usart_sending,
-                    SEND_BUFFER_SIZE,
-                    usart_sending_head,
-                    &usart_sending_tail,
-                    &data)) {
+  TRACE_ENTER(TRACE_USART_UDRE);
+  PROF_BEGIN(PROF_USART_UDRE_ISR);
+#if defined USART_FLOW_XONXOFF
+  /* flow control overtakes the buffered data */
+  if (usart_flow_char != 0) {
+    UDR0 = usart_flow_char;
+    usart_flow_char = 0;
+    PROF_END(PROF_USART_UDRE_ISR);
+    TRACE_EXIT(TRACE_USART_UDRE);
+    return;
+  }
+#endif
+#if defined USART_BUS
+  if (usart_bus_tx_pending) {
+    /* address frame, 9th bit set */
+    UCSR0B |= _BV(TXB80);
+#if defined USART_BUS_DE
+    UCSR0A = (UCSR0A & USART_UCSR0A_MODE) | _BV(TXC0);
+#endif
+    UDR0 = usart_bus_tx_address;
+    usart_bus_tx_pending = false;
+    PROF_END(PROF_USART_UDRE_ISR);
+    TRACE_EXIT(TRACE_USART_UDRE);
+    return;
+  }
+#endif
+  if (usart_send_ring_pop(&usart_sending, &data)) {
+#if defined USART_BUS
+    UCSR0B &= ~_BV(TXB80);
+#if defined USART_BUS_DE
+    /* clear transmit complete, so it is only set after the last frame */
+    UCSR0A = (UCSR0A & USART_UCSR0A_MODE) | _BV(TXC0);
+#endif
+#endif
     /* Put data into buffer, sends the data */
     UDR0 = data;
+#if defined USART_TIMESTAMP
+    if (data == USART_STAMP_BYTE) {
+      usart_tx_stamp_micros = timer_micros();
+      usart_tx_stamps++;
+    }
+#endif
   } else {
     /* mask the interrupt */
     UCSR0B &= ~_BV(UDRIE0);
+#if defined USART_BUS_DE
+    /* release the driver once the last frame has been shifted out */
+    if (!usart_bus_tx_active) {
+      UCSR0B |= _BV(TXCIE0);
+    }
+#endif
+  }
+  PROF_END(PROF_USART_UDRE_ISR);
+  TRACE_EXIT(TRACE_USART_UDRE);
+}
+
+#if defined USART_BUS_DE
+ISR(USART_TX_vect) {
+  UCSR0B &= ~_BV(TXCIE0);
+  /* the buffer can have been refilled since the interrupt was enabled */
+  if (!usart_bus_tx_active &&
+      !usart_bus_tx_pending &&
+      usart_send_ring_empty(&usart_sending)) {
+    writePin(USART_BUS_DE, false);
   }
 }
+#endif
 
 ISR(USART_RX_vect) {
+  TRACE_ENTER(TRACE_USART_RX);
+  PROF_BEGIN(PROF_USART_RX_ISR);
+  /* status flags are only valid before UDR0 is read */
+  uint8_t status = UCSR0A;
+#if defined USART_BUS
+  /* as is the 9th bit */
+  const bool b_address = UCSR0B & _BV(RXB80);
+#endif
   uint8_t data = UDR0;
-  if (!queue_enqueue(usart_receiving,
-                     RECEIVE_BUFFER_SIZE,
-                     &usart_receiving_head,
-                     usart_receiving_tail,
-                     data)) {
+#if defined USART_TIMESTAMP && defined USART_BUS
+  /* an address frame (e.g. of node 0) is not a frame delimiter */
+  if (data == USART_STAMP_BYTE && !b_address) {
+    usart_rx_stamp_micros = timer_micros();
+    usart_rx_stamps++;
+  }
+#elif defined USART_TIMESTAMP
+  if (data == USART_STAMP_BYTE) {
+    usart_rx_stamp_micros = timer_micros();
+    usart_rx_stamps++;
+  }
+#endif
+  if (status & _BV(DOR0)) {
+    /* hardware buffer overrun, byte(s) lost before this one */
+    usart_rx_data_overruns++;
+  }
+  if (status & _BV(FE0)) {
+    usart_rx_frame_errors++;
+  }
+#if defined USART_BUS
+  if (b_address) {
+    /* receive the following data frames only when addressed */
+    if (data == usart_bus_address || data == USART_BUS_BROADCAST) {
+      UCSR0A = status & _BV(U2X0);
+    } else {
+      UCSR0A = (status & _BV(U2X0)) | _BV(MPCM0);
+    }
+    PROF_END(PROF_USART_RX_ISR);
+    TRACE_EXIT(TRACE_USART_RX);
+    return;
+  }
+#endif
+  if (!usart_receive_ring_push(&usart_receiving, data)) {
+    usart_rx_overruns++;
 #if defined PIN_ERROR
     /* Occours when receive buffer full */
     writePin(PIN_ERROR, true);
 #endif
   }
+#if defined USART_RX_EVENT
+  /* one event when data arrives in an empty buffer, the handler reads
+     all of it */
+  else if (usart_receive_ring_count(&usart_receiving) == 1) {
+    sched_post(USART_RX_EVENT, 0);
+  }
+#endif
+#if defined USART_FLOW
+  if (!usart_rx_stopped &&
+      usart_receive_ring_count(&usart_receiving) >= USART_FLOW_STOP) {
+    usart_flow_signal(true);
+    usart_rx_stalls++;
+  }
+#endif
+  PROF_END(PROF_USART_RX_ISR);
+  TRACE_EXIT(TRACE_USART_RX);
 }
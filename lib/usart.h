@@ -4,13 +4,91 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+/* behaviour of usart_write when the send buffer is full */
+typedef enum {
+  /* wait for the buffer to drain (as usart_write_bytes), in idle
+     sleep when built with USART_SLEEP */
+  USART_BLOCK,
+  /* write what fits, drop the rest of the data */
+  USART_DROP_NEWEST,
+  /* discard the oldest bytes in the buffer to make space */
+  USART_DROP_OLDEST,
+  /* write the whole data only if it fits, otherwise drop it */
+  USART_ALL_OR_NOTHING
+} EUsartPolicy;
+
+typedef struct {
+  /* bytes not sent due to the write policy */
+  uint16_t ui_tx_dropped;
+  /* bytes lost as the receive buffer was full */
+  uint16_t ui_rx_overruns;
+  /* hardware data overruns (DOR) and frame errors (FE) */
+  uint16_t ui_rx_data_overruns;
+  uint16_t ui_rx_frame_errors;
+  /* times the sender was stopped by flow control (USART_FLOW_XONXOFF
+     or USART_FLOW_RTS) */
+  uint16_t ui_rx_stalls;
+} SUsartStats;
+
 void usart_init(uint16_t ubrr);
+#if defined BAUD
+void usart_init_baud(void);
+#endif
 void usart_write_bytes(const uint8_t* const data, uint16_t length);
+void usart_write_byte(const uint8_t data);
+uint16_t usart_write(const uint8_t* data,
+                     uint16_t length,
+                     const EUsartPolicy policy);
+
+#if defined USART_BUS
+/*
+  multi-processor communication mode, 9bit frames with the 9th bit
+  set for the address frame that starts each message. a node only
+  receives the data frames of messages sent to its address (or to
+  USART_BUS_BROADCAST), the others are discarded by the hardware
+  without an interrupt. the address frame is not put into the receive
+  buffer. with USART_BUS_DE defined that pin enables the RS-485
+  driver while a message is being sent. while on the bus the other
+  writers (usart_write, usart_write_bytes, usart_write_byte and so
+  usart_fmt and telemetry_send) drop their data, counted in
+  ui_tx_dropped, as it would have no address frame.
+ */
+#define USART_BUS_BROADCAST 0xFF
+void usart_bus_init(const uint8_t address);
+uint16_t usart_bus_send(const uint8_t address,
+                        const uint8_t* data,
+                        const uint16_t length);
+#endif
+
 #if defined USE_PRINTF
 void usart_printf(const char *__fmt, ...);
 #endif
 
+void usart_flush(void);
+
+#if defined USART_TIMESTAMP
+/*
+  the isrs record timer_micros when USART_STAMP_BYTE (the telemetry
+  frame delimiter) is loaded into the transmitter and when it is
+  received. these return the time of the last one and the number of
+  them sent (or received) so far, which lets the caller match the
+  stamp to a frame.
+ */
+#define USART_STAMP_BYTE 0x00
+uint8_t usart_tx_stamp(uint32_t* const p_micros);
+uint8_t usart_rx_stamp(uint32_t* const p_micros);
+#endif
+
+/*
+  when USART_RX_EVENT is defined (an event id of sched.h) the receive
+  isr posts it when a byte arrives in the empty receive buffer, the
+  handler should read until usart_get_char returns false.
+ */
 bool usart_data_pending(void);
 bool usart_get_char(uint8_t* data);
 
+/* atomic copy of the error counters, and clearing of them */
+void usart_stats(SUsartStats* const p_stats);
+void usart_stats_reset(void);
+
 #endif
@@ -0,0 +1,219 @@
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+#include "usart.h"
+#include "usart_fmt.h"
+
+/* digits needed for a 32bit value in decimal */
+#define DIGITS_MAX 10
+
+static inline
+char usart_fmt_read(const char* const pch, const bool b_progmem) {
+  return b_progmem ? pgm_read_byte(pch) : *pch;
+}
+
+static
+void usart_fmt_char(const char c) {
+  if (c == '\n') {
+    usart_write_byte('\r');
+  }
+  usart_write_byte(c);
+}
+
+/*
+  Write a string, right aligned in the field width.
+*/
+static
+void usart_fmt_string(const char* pch,
+                      const bool b_progmem,
+                      uint8_t ui_width) {
+  const char* pch_end = pch;
+  char c;
+
+  if (ui_width > 0) {
+    while (usart_fmt_read(pch_end, b_progmem) != '\0') {
+      pch_end++;
+    }
+    while (ui_width > pch_end - pch) {
+      usart_write_byte(' ');
+      ui_width--;
+    }
+  }
+
+  while ((c = usart_fmt_read(pch++, b_progmem)) != '\0') {
+    usart_fmt_char(c);
+  }
+}
+
+/*
+  Write a number, the digits are stored in reverse order. When padded
+  with '0' the sign is written before the padding.
+*/
+static
+void usart_fmt_digits(const char* const pch_digits,
+                      uint8_t ui_count,
+                      uint8_t ui_width,
+                      const char ch_pad,
+                      const bool b_negative) {
+  uint8_t ui_length = ui_count + (b_negative ? 1 : 0);
+
+  if (b_negative && ch_pad == '0') {
+    usart_write_byte('-');
+  }
+  while (ui_width > ui_length) {
+    usart_write_byte(ch_pad);
+    ui_width--;
+  }
+  if (b_negative && ch_pad != '0') {
+    usart_write_byte('-');
+  }
+  while (ui_count > 0) {
+    usart_write_byte(pch_digits[--ui_count]);
+  }
+}
+
+/*
+  Convert to decimal. Once the value fits into 16bits the cheaper 16bit
+  division is used, so small values never use the 32bit division.
+*/
+static
+uint8_t usart_fmt_decimal(char* const pch_digits, uint32_t ui_value) {
+  uint8_t ui_count = 0;
+  uint16_t ui_short;
+
+  while (ui_value > 0xFFFF) {
+    pch_digits[ui_count++] = '0' + ui_value % 10;
+    ui_value /= 10;
+  }
+
+  ui_short = ui_value;
+  do {
+    pch_digits[ui_count++] = '0' + ui_short % 10;
+    ui_short /= 10;
+  } while (ui_short != 0);
+
+  return ui_count;
+}
+
+/*
+  Convert to hex, only shifts are needed.
+*/
+static
+uint8_t usart_fmt_hex(char* const pch_digits,
+                      uint32_t ui_value,
+                      const char ch_alpha) {
+  uint8_t ui_count = 0;
+  uint8_t ui_nibble;
+
+  do {
+    ui_nibble = ui_value & 0x0F;
+    pch_digits[ui_count++]
+      = ui_nibble < 10 ? '0' + ui_nibble : ch_alpha + ui_nibble - 10;
+    ui_value >>= 4;
+  } while (ui_value != 0);
+
+  return ui_count;
+}
+
+static
+void usart_vfmt(const char* pch_fmt, const bool b_progmem, va_list ap) {
+  char pch_digits[DIGITS_MAX];
+  uint8_t ui_count;
+  uint8_t ui_width;
+  char ch_pad;
+  bool b_long;
+  bool b_negative;
+  uint32_t ui_value;
+  char c;
+
+  while ((c = usart_fmt_read(pch_fmt++, b_progmem)) != '\0') {
+    if (c != '%') {
+      usart_fmt_char(c);
+      continue;
+    }
+
+    /* parse flags, width and length */
+    ch_pad = ' ';
+    ui_width = 0;
+    b_long = false;
+    b_negative = false;
+
+    c = usart_fmt_read(pch_fmt++, b_progmem);
+    if (c == '0') {
+      ch_pad = '0';
+      c = usart_fmt_read(pch_fmt++, b_progmem);
+    }
+    while (c >= '0' && c <= '9') {
+      ui_width = ui_width * 10 + c - '0';
+      c = usart_fmt_read(pch_fmt++, b_progmem);
+    }
+    if (c == 'l') {
+      b_long = true;
+      c = usart_fmt_read(pch_fmt++, b_progmem);
+    }
+
+    switch (c) {
+    case 'c':
+      usart_fmt_char((char)va_arg(ap, int));
+      break;
+    case 's':
+      usart_fmt_string(va_arg(ap, const char*), false, ui_width);
+      break;
+    case 'S':
+      usart_fmt_string(va_arg(ap, const char*), true, ui_width);
+      break;
+    case 'd':
+    case 'i':
+      if (b_long) {
+        int32_t i_value = va_arg(ap, long);
+        b_negative = i_value < 0;
+        ui_value = b_negative ? -(uint32_t)i_value : (uint32_t)i_value;
+      } else {
+        int16_t i_value = va_arg(ap, int);
+        b_negative = i_value < 0;
+        ui_value = (uint16_t)(b_negative ? 0 - (uint16_t)i_value : i_value);
+      }
+      ui_count = usart_fmt_decimal(pch_digits, ui_value);
+      usart_fmt_digits(pch_digits, ui_count, ui_width, ch_pad, b_negative);
+      break;
+    case 'u':
+    case 'x':
+    case 'X':
+      if (b_long) {
+        ui_value = va_arg(ap, unsigned long);
+      } else {
+        ui_value = (uint16_t)va_arg(ap, unsigned int);
+      }
+      if (c == 'u') {
+        ui_count = usart_fmt_decimal(pch_digits, ui_value);
+      } else {
+        ui_count = usart_fmt_hex(pch_digits, ui_value, c == 'x' ? 'a' : 'A');
+      }
+      usart_fmt_digits(pch_digits, ui_count, ui_width, ch_pad, false);
+      break;
+    case '\0':
+      /* format string ends with '%' */
+      return;
+    default:
+      /* '%%' and unsupported conversions are written as is */
+      usart_write_byte(c);
+      break;
+    }
+  }
+}
+
+void usart_fmt(const char* pch_fmt, ...) {
+  va_list ap;
+  va_start(ap, pch_fmt);
+  usart_vfmt(pch_fmt, false, ap);
+  va_end(ap);
+}
+
+void usart_fmt_P(const char* pch_fmt, ...) {
+  va_list ap;
+  va_start(ap, pch_fmt);
+  usart_vfmt(pch_fmt, true, ap);
+  va_end(ap);
+}
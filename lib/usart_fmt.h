@@ -0,0 +1,25 @@
+#ifndef _USART_FMT_H
+#define _USART_FMT_H
+
+#include <avr/pgmspace.h>
+
+/*
+  Light weight formatted output that is written directly into the
+  usart send buffer. There is no intermediate buffer (so no length
+  limit) and avr-libc vfprintf is not used.
+
+  Supported conversions are a subset of printf:
+    %c %s %d %i %u %x %X %%
+    %S for a string located in program memory
+  with an optional '0' flag, field width and 'l' length modifier. As
+  with usart_write_bytes in text mode, '\n' is sent as "\r\n".
+*/
+void usart_fmt(const char* pch_fmt, ...);
+
+/*
+  As usart_fmt, but the format string is located in program memory
+  and is read in place, e.g. usart_fmt_P(PSTR("%u\n"), x);
+*/
+void usart_fmt_P(const char* pch_fmt, ...);
+
+#endif
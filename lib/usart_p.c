@@ -5,6 +5,7 @@
 #include <avr/pgmspace.h>
 
 #include "usart.h"
+#include "prof.h"
 
 #define PRINTF_BUFFER_SIZE 128
 
@@ -14,6 +15,7 @@ void usart_printf_P(const char *__fmt, ...) {
   va_list ap;
   int length = 0;
   uint16_t i;
+  PROF_BEGIN(PROF_USART_PRINTF);
   for (i = 0; i < PRINTF_BUFFER_SIZE - 1; i++) {
     fmt[i] = pgm_read_byte(__fmt + i);
     if (fmt[i] == 0x00) {
@@ -32,5 +34,6 @@ void usart_printf_P(const char *__fmt, ...) {
   } else {
     usart_write_bytes((uint8_t*)buffer, 0);
   }
+  PROF_END(PROF_USART_PRINTF);
 }
 #endif
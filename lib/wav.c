@@ -0,0 +1,305 @@
+#include <stdbool.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+
+#include "wav.h"
+#include "audio.h"
+
+/* ima adpcm step sizes, by step index */
+static const uint16_t pui_wav_steps[89] PROGMEM = {
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+  19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+  50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+  130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+  337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+  876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+  2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+  5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+  15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+#define WAV_STEP_INDEX_MAX 88
+
+#define WAV_NO_NIBBLE 0xFF
+
+/* a signed 16 bit sample as unsigned, for audio_sample_set */
+#define WAV_SAMPLE_U16(sample) ((uint16_t)(sample) ^ 0x8000)
+
+static
+bool wav_read_uint16(SSDFAT_File* const p_sdfile, uint16_t* const p_value) {
+  int16_t lo, hi;
+
+  if ((lo = fat32_file_read_byte_spi(p_sdfile)) < 0
+      || (hi = fat32_file_read_byte_spi(p_sdfile)) < 0) {
+    return false;
+  }
+  *p_value = (uint16_t)lo | (uint16_t)hi << 8;
+  return true;
+}
+
+static
+bool wav_read_uint32(SSDFAT_File* const p_sdfile, uint32_t* const p_value) {
+  uint16_t lo, hi;
+
+  if (!wav_read_uint16(p_sdfile, &lo) || !wav_read_uint16(p_sdfile, &hi)) {
+    return false;
+  }
+  *p_value = (uint32_t)lo | (uint32_t)hi << 16;
+  return true;
+}
+
+static
+bool wav_read_id(SSDFAT_File* const p_sdfile, char* const pch_id) {
+  uint8_t i;
+  int16_t byte;
+
+  for (i = 0; i < 4; i++) {
+    if ((byte = fat32_file_read_byte_spi(p_sdfile)) < 0) {
+      return false;
+    }
+    pch_id[i] = byte;
+  }
+  return true;
+}
+
+static
+bool wav_skip(SSDFAT_File* const p_sdfile, uint32_t ui_size) {
+  while (ui_size-- > 0) {
+    if (fat32_file_read_byte_spi(p_sdfile) < 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+  reads the chunks up to the data chunk, and limits the file to the
+  data
+*/
+static
+uint8_t wav_header(SWav* const p_wav, SSDFAT_File* const p_sdfile) {
+  char pch_id[4];
+  uint32_t ui_size;
+  uint32_t ui_rate;
+  uint16_t ui_channels = 0;
+  uint16_t ui_bits;
+  bool b_fmt = false;
+
+  if (!wav_read_id(p_sdfile, pch_id) || !wav_read_uint32(p_sdfile, &ui_size)) {
+    return WAV_ERROR_READ;
+  }
+  if (memcmp(pch_id, "RIFF", 4) != 0) {
+    return WAV_ERROR_FORMAT;
+  }
+  if (!wav_read_id(p_sdfile, pch_id)) {
+    return WAV_ERROR_READ;
+  }
+  if (memcmp(pch_id, "WAVE", 4) != 0) {
+    return WAV_ERROR_FORMAT;
+  }
+
+  while (1) {
+    if (!wav_read_id(p_sdfile, pch_id)
+        || !wav_read_uint32(p_sdfile, &ui_size)) {
+      return WAV_ERROR_READ;
+    }
+
+    if (memcmp(pch_id, "fmt ", 4) == 0) {
+      if (ui_size < 16) {
+        return WAV_ERROR_FORMAT;
+      }
+      /* format, channels, rate, bytes per second (not used), block
+         align and bits per sample */
+      if (!wav_read_uint16(p_sdfile, &p_wav->ui_format)
+          || !wav_read_uint16(p_sdfile, &ui_channels)
+          || !wav_read_uint32(p_sdfile, &ui_rate)
+          || !wav_skip(p_sdfile, 4)
+          || !wav_read_uint16(p_sdfile, &p_wav->ui_block_align)
+          || !wav_read_uint16(p_sdfile, &ui_bits)
+          || !wav_skip(p_sdfile, ui_size - 16 + (ui_size & 1))) {
+        return WAV_ERROR_READ;
+      }
+      b_fmt = true;
+    } else if (memcmp(pch_id, "data", 4) == 0) {
+      break;
+    } else if (!wav_skip(p_sdfile, ui_size + (ui_size & 1))) {
+      return WAV_ERROR_READ;
+    }
+  }
+
+  if (!b_fmt) {
+    return WAV_ERROR_FORMAT;
+  }
+  if (ui_channels != 1 || ui_rate > 0xFFFF) {
+    return WAV_ERROR_UNSUPPORTED;
+  }
+  switch (p_wav->ui_format) {
+  case WAV_FORMAT_PCM:
+    if (ui_bits != 8 && ui_bits != 16) {
+      return WAV_ERROR_UNSUPPORTED;
+    }
+    break;
+  case WAV_FORMAT_IMA_ADPCM:
+    /* the block header is 4 bytes */
+    if (ui_bits != 4 || p_wav->ui_block_align <= 4) {
+      return WAV_ERROR_UNSUPPORTED;
+    }
+    break;
+  default:
+    return WAV_ERROR_UNSUPPORTED;
+  }
+  p_wav->ui_rate = ui_rate;
+  p_wav->ui_bits = ui_bits;
+
+  /* the position and size are both relative to the current sector, so
+     the read ends (and closes the sector) at the end of the data */
+  if (ui_size < p_sdfile->ui_file_size - p_sdfile->ui_position) {
+    p_sdfile->ui_file_size = p_sdfile->ui_position + ui_size;
+  }
+  return 0;
+}
+
+uint8_t wav_open(SWav* const p_wav, SSDFAT_File* const p_sdfile) {
+  uint8_t r;
+
+  p_wav->p_sdfile = p_sdfile;
+  p_wav->i_predictor = 0;
+  p_wav->ui_index = 0;
+  p_wav->ui_block_left = 0;
+  p_wav->ui_nibble = WAV_NO_NIBBLE;
+
+  r = wav_header(p_wav, p_sdfile);
+  if (r != 0) {
+    /* end the file here, which reads out the rest of the sector */
+    p_sdfile->ui_file_size = p_sdfile->ui_position;
+    fat32_file_read_byte_spi(p_sdfile);
+  }
+  return r;
+}
+
+/*
+  decodes one ima adpcm nibble. the difference is step * (nibble & 7
+  + 0.5) / 4, made of shifts of the step as in the reference decoder,
+  and the predictor is clamped with 16 bit unsigned comparisons.
+*/
+static inline
+uint16_t wav_adpcm_decode(int16_t* const p_predictor,
+                          uint8_t* const p_index,
+                          const uint8_t ui_nibble) {
+  const uint16_t ui_step = pgm_read_word(&pui_wav_steps[*p_index]);
+  uint16_t ui_predictor = *p_predictor;
+  uint16_t ui_diff = ui_step >> 3;
+
+  if (ui_nibble & 4) {
+    ui_diff += ui_step;
+  }
+  if (ui_nibble & 2) {
+    ui_diff += ui_step >> 1;
+  }
+  if (ui_nibble & 1) {
+    ui_diff += ui_step >> 2;
+  }
+
+  /* the distance to the limit is predictor + 32768 below and 32767 -
+     predictor above, both 0 to 65535 */
+  if (ui_nibble & 8) {
+    ui_predictor = ui_diff > (uint16_t)(ui_predictor + 0x8000)
+      ? 0x8000 : ui_predictor - ui_diff;
+  } else {
+    ui_predictor = ui_diff > (uint16_t)(0x7FFF - ui_predictor)
+      ? 0x7FFF : ui_predictor + ui_diff;
+  }
+  *p_predictor = ui_predictor;
+
+  /* the index moves by -1, -1, -1, -1, 2, 4, 6, 8 */
+  if (ui_nibble & 4) {
+    *p_index += ((ui_nibble & 3) + 1) << 1;
+    if (*p_index > WAV_STEP_INDEX_MAX) {
+      *p_index = WAV_STEP_INDEX_MAX;
+    }
+  } else if (*p_index > 0) {
+    (*p_index)--;
+  }
+
+  return WAV_SAMPLE_U16(ui_predictor);
+}
+
+static
+uint16_t wav_fill_adpcm(SWav* const p_wav, uint8_t* pui_buffer,
+                        const uint16_t ui_size) {
+  SSDFAT_File* const p_sdfile = p_wav->p_sdfile;
+  int16_t i_predictor = p_wav->i_predictor;
+  uint8_t ui_index = p_wav->ui_index;
+  uint16_t i = 0;
+  int16_t byte;
+
+  /* the high nibble left over by the last fill */
+  if (p_wav->ui_nibble != WAV_NO_NIBBLE) {
+    audio_sample_set(pui_buffer, i++,
+                     wav_adpcm_decode(&i_predictor, &ui_index,
+                                      p_wav->ui_nibble));
+    p_wav->ui_nibble = WAV_NO_NIBBLE;
+  }
+
+  while (i < ui_size) {
+    if (p_wav->ui_block_left == 0) {
+      /* block header, the first sample and the step index */
+      uint16_t ui_predictor;
+      int16_t index;
+      if (!wav_read_uint16(p_sdfile, &ui_predictor)
+          || (index = fat32_file_read_byte_spi(p_sdfile)) < 0
+          || fat32_file_read_byte_spi(p_sdfile) < 0) {
+        break;
+      }
+      i_predictor = ui_predictor;
+      ui_index = index > WAV_STEP_INDEX_MAX ? WAV_STEP_INDEX_MAX : index;
+      p_wav->ui_block_left = p_wav->ui_block_align - 4;
+      audio_sample_set(pui_buffer, i++, WAV_SAMPLE_U16(i_predictor));
+      continue;
+    }
+
+    if ((byte = fat32_file_read_byte_spi(p_sdfile)) < 0) {
+      break;
+    }
+    p_wav->ui_block_left--;
+
+    /* low nibble first */
+    audio_sample_set(pui_buffer, i++,
+                     wav_adpcm_decode(&i_predictor, &ui_index, byte & 0x0F));
+    if (i < ui_size) {
+      audio_sample_set(pui_buffer, i++,
+                       wav_adpcm_decode(&i_predictor, &ui_index, byte >> 4));
+    } else {
+      p_wav->ui_nibble = byte >> 4;
+    }
+  }
+
+  p_wav->i_predictor = i_predictor;
+  p_wav->ui_index = ui_index;
+  return i;
+}
+
+uint16_t wav_fill(void* p_arg, uint8_t* pui_buffer, const uint16_t ui_size) {
+  SWav* const p_wav = p_arg;
+  SSDFAT_File* const p_sdfile = p_wav->p_sdfile;
+  uint16_t i;
+  int16_t lo = 0;
+  int16_t byte;
+
+  if (p_wav->ui_format == WAV_FORMAT_IMA_ADPCM) {
+    return wav_fill_adpcm(p_wav, pui_buffer, ui_size);
+  }
+
+  for (i = 0; i < ui_size; i++) {
+    /* 16 bit samples are signed little endian, 8 bit unsigned */
+    if ((p_wav->ui_bits == 16
+         && (lo = fat32_file_read_byte_spi(p_sdfile)) < 0)
+        || (byte = fat32_file_read_byte_spi(p_sdfile)) < 0) {
+      break;
+    }
+    audio_sample_set(pui_buffer, i,
+                     p_wav->ui_bits == 16
+                     ? WAV_SAMPLE_U16((uint16_t)byte << 8 | lo)
+                     : (uint16_t)byte << 8);
+  }
+  return i;
+}
@@ -0,0 +1,75 @@
+#ifndef _WAV_H
+#define _WAV_H
+
+#include <stdint.h>
+
+#include "sdcard-fat.h"
+
+/*
+  Reads the samples of a RIFF WAVE file on the card for the audio
+  player (see audio.h), as samples of its output (8 or 16 bit, see
+  audio_sample_set). wav_open reads the header up to the data chunk,
+  taking the format and sample rate from the fmt chunk, and wav_fill
+  (a FAudioFill) reads and converts the samples:
+
+  * PCM, 8 bit mono
+  * PCM, 16 bit mono, only the high byte for an 8 bit output
+  * IMA ADPCM, 4 bit mono: decoded to 16 bits, 4 bits per sample from
+    the card instead of 8
+
+  IMA ADPCM blocks start with a header (the first sample and the step
+  index), so the decoder recovers from a bad block at the next one.
+  The decoder uses a table of steps and shifts, no multiplication, and
+  16 bit arithmetic only. Stereo files are not supported.
+
+    fat32_file_open(&g_sdfatcard, &s_sdfile, "/music.wav");
+    if (wav_open(&s_wav, &s_sdfile) == 0) {
+      audio_start(s_wav.ui_rate, wav_fill, &s_wav);
+      ...
+    }
+
+  Reading stops at the end of the data chunk, any chunks after it are
+  not read.
+*/
+
+#define WAV_FORMAT_PCM 0x0001
+#define WAV_FORMAT_IMA_ADPCM 0x0011
+
+/* errors of wav_open, the sector read is closed */
+/* the file ended before the data chunk */
+#define WAV_ERROR_READ 0x01
+/* not a RIFF WAVE file, or no fmt chunk before the data */
+#define WAV_ERROR_FORMAT 0x02
+/* a format, number of channels or sample size that is not supported */
+#define WAV_ERROR_UNSUPPORTED 0x03
+
+typedef struct {
+  SSDFAT_File* p_sdfile;
+
+  /* from the fmt chunk */
+  uint16_t ui_format;
+  uint16_t ui_rate;
+  uint8_t ui_bits;
+  uint16_t ui_block_align;
+
+  /* ima adpcm decoder, bytes left in the block (0 at the start of the
+     next block), and the high nibble of the last byte if it has not
+     been decoded (0xFF if none) */
+  int16_t i_predictor;
+  uint8_t ui_index;
+  uint16_t ui_block_left;
+  uint8_t ui_nibble;
+} SWav;
+
+/*
+  reads the header of the file opened in p_sdfile (at position 0),
+  leaving it at the first sample. returns 0 or one of the WAV_ERROR
+  codes.
+*/
+uint8_t wav_open(SWav* const p_wav, SSDFAT_File* const p_sdfile);
+
+/* fills up to ui_size samples, 0 at the end of the data (a FAudioFill,
+   p_arg is the SWav) */
+uint16_t wav_fill(void* p_arg, uint8_t* pui_buffer, const uint16_t ui_size);
+
+#endif
@@ -0,0 +1,146 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/delay.h>
+
+#include "usart.h"
+#include "usart_fmt.h"
+#include "sdcard.h"
+#include "sdcard-fat.h"
+#include "timer.h"
+#include "record.h"
+#include "prof.h"
+
+#include "pins.h"
+
+/*
+  PORTB
+  pin5 |-> pin13 (SCK)
+  pin4 |-> pin12 (MISO)
+  pin3 |-> pin11 (MOSI)
+  pin2 |-> pin10 (output/SS)
+  pin1 |-> pin9  (error pin, defined in makefile)
+
+  PORTC
+  pin0 |-> A0 (audio input, RECORD_CHANNEL in the makefile)
+
+  Connected to: SD Card
+  Arduino pin13 (SCK) connected to (SCK)
+  Arduino pin12 (MISO) connected to (DO)
+  Arduino pin11 (MOSI) connected to (DI)
+  Arduino pin10 (SS) connected to (CS)
+
+  Connected to: microphone amplifier
+  Output biased at half of AVCC (e.g. a MAX4466 or MAX9814 module)
+  connected to A0
+
+  Description:
+  Program records the adc input into an existing file on the SD card
+  (see record.h) at RECORD_RATE, as an 8 bit mono WAV file (or raw
+  samples with 'make RAW=1') that the sdcard program plays back. The
+  file must have clusters allocated for the recording, e.g. created
+  on a pc with
+
+    dd if=/dev/zero of=/media/card/rec.wav bs=1M count=8
+
+  Recording starts on reset and ends after RECORD_SECONDS, when any
+  character is received or when the file is full. The led is lit
+  while recording. Then the program writes
+
+    Samples <n>, dropped <n> (<n> gaps), sectors <n>, write <n>us
+    Card rate <n> samples/s
+
+  the card rate is 512 samples per longest write, the highest rate
+  this card kept up with during the recording.
+*/
+
+SSDCard g_sdcard;
+SSDFATCard g_sdfatcard;
+
+int main(void) {
+  SRecordStats s_stats;
+  uint32_t ui_start;
+  uint32_t ui_card_rate;
+  uint8_t data;
+  uint8_t r;
+
+  /* flash led on on boot */
+  writePin(PIN_ERROR, true);
+  setMode(PIN_ERROR, output);
+  _delay_ms(250);
+  writePin(PIN_ERROR, false);
+
+  usart_init_baud();
+  timer_init();
+
+  /* enable interrupts, used for timer, usart and the adc */
+  sei();
+
+  /* initilise the sdcard interface (includes spi) */
+  r = sdcard_init(&g_sdcard);
+  if (r != 0) {
+    usart_fmt_P(PSTR("Could not init sdcard\n"));
+    goto end;
+  }
+
+  /* initilise the fat partition structure */
+  r = fat32_init(&g_sdcard, &g_sdfatcard);
+  if (r != 0) {
+    usart_fmt_P(PSTR("Could not init fat\n"));
+    goto end;
+  }
+
+#if defined PROF
+  prof_reset();
+#endif
+#if defined RECORD_RAW
+  r = record_start(&g_sdfatcard, RECORD_NAME, RECORD_RATE, RECORD_CHANNEL,
+                   false);
+#else
+  r = record_start(&g_sdfatcard, RECORD_NAME, RECORD_RATE, RECORD_CHANNEL,
+                   true);
+#endif
+  if (r != 0) {
+    usart_fmt_P(PSTR("Could not start recording: %02X\n"), r);
+    goto end;
+  }
+  writePin(PIN_ERROR, true);
+
+  ui_start = timer_millis();
+  while (record_poll()
+         && timer_millis() - ui_start < RECORD_SECONDS * 1000UL
+         && !usart_get_char(&data)) {}
+
+  r = record_stop();
+  writePin(PIN_ERROR, false);
+  if (r != 0) {
+    usart_fmt_P(PSTR("Recording failed: %02X\n"), r);
+    goto end;
+  }
+
+  record_stats(&s_stats);
+  /* a half of 512 samples per longest write, in stamps of 64 cycles */
+  ui_card_rate = s_stats.ui_write_max > 0
+    ? 512 * (F_CPU / TIMER_CYCLES_PER_STAMP) / s_stats.ui_write_max : 0;
+  /* stamps of 64 cycles are 4us */
+  usart_fmt_P(PSTR("Samples %lu, dropped %lu (%u gaps), sectors %lu, "
+                   "write %luus\n"),
+              s_stats.ui_samples,
+              s_stats.ui_dropped,
+              s_stats.ui_overruns,
+              s_stats.ui_sectors,
+              TIMER_STAMP_CYCLES(s_stats.ui_write_max) / (F_CPU / 1000000));
+  usart_fmt_P(PSTR("Card rate %lu samples/s%S\n"),
+              ui_card_rate,
+              s_stats.b_full ? PSTR(", file full") : PSTR(""));
+#if defined PROF
+  prof_dump();
+#endif
+
+  while (1) {}
+
+ end:
+  /* on error set led to always on */
+  writePin(PIN_ERROR, true);
+  while(1) {}
+}
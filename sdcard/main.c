@@ -5,11 +5,16 @@
 #include "usart.h"
 #include "sdcard.h"
 #include "sdcard-fat.h"
+#include "audio.h"
+#include "wav.h"
+#if defined PLAYLIST_NAME
+  #include "playlist.h"
+#endif
+#include "timer.h"
+#include "prof.h"
 
 #include "pins.h"
 
-#define MYUBRR F_CPU/16/BAUD-1
-
 #define SCK       13
 #define MISO      12
 #define MOSI      11
@@ -46,23 +51,61 @@
   Description:
   Program demonstrates playing audio files that are stored on a SD
   card and writing the output to PORTD that is connected to a R2R
-  ladder for DAC. The input file is expected to be unsigned 8bit
-  uncompressed PCM with no headers (i.e. biased at 128). In tests, the
-  system was capable of playing data sampled at 44.1KHz. To create a
-  valid file, Audacity was used to export a clip of the audio. I.e:
+  ladder for DAC. The input file is a mono WAV file (see wav.h), 8 or
+  16 bit PCM or 4 bit IMA ADPCM, played at the rate in its header. A
+  file without a header is expected to be unsigned 8bit uncompressed
+  PCM (i.e. biased at 128), sampled at AUDIO_RATE (set in the
+  makefile). To create a valid file, Audacity was used to export a
+  clip of the audio. I.e:
+    Tracks -> Mix -> Mix Stereo Down to Mono
     File -> Export -> Select "Other uncompressed files"
     Select "Options...", then
-      Headers: RAW
-      Encoding: Unsigned 8 bit PCM
+      Headers: WAV (Microsoft)
+      Encoding: IMA ADPCM (or Unsigned 8 bit PCM, with Headers: RAW)
+
+  The samples are played by the timer 1 interrupt (see audio.h) while
+  the main loop reads the file. Once finished the number of underruns
+  and the headroom are written to the usart (which takes pins 0 and 1
+  of the ladder).
+
+  Built with OUTPUT=PWM (see the makefile) the ladder is replaced by
+  a pwm dac on pin9 (OC1A) and the error led moves to pin7, with
+  OUTPUT=PWM_DUAL pin9 has the high byte and pin10 (OC1B) the low
+  byte of 16 bit samples, mixed through 3.9k and 1M resistors, and the
+  sdcard CS moves to pin8.
 */
 
 SSDCard g_sdcard;
 SSDFATCard g_sdfatcard;
+#if defined PLAYLIST_NAME
+SPlaylist g_playlist;
+#endif
+
+/*
+  fills the audio buffer from the file, the sector read stays open on
+  the spi bus between calls
+*/
+static
+uint16_t read_raw(void* p_arg, uint8_t* pui_buffer, const uint16_t ui_size) {
+  SSDFAT_File* const p_sdfile = p_arg;
+  uint16_t i;
+  int16_t byte;
+
+  for (i = 0; i < ui_size; i++) {
+    if ((byte = fat32_file_read_byte_spi(p_sdfile)) < 0) {
+      break;
+    }
+    audio_sample_set(pui_buffer, i, (uint16_t)byte << 8);
+  }
+  return i;
+}
 
 int main(void) {
   uint8_t r;
 
+#if AUDIO_OUTPUT == AUDIO_OUTPUT_R2R
   DDRD = 0xFF; /* port D to output */
+#endif
 
   /* flash led on on boot */
   writePin(PIN_ERROR, true);
@@ -76,7 +119,7 @@ int main(void) {
   /* initilise the sdcard interface (includes spi) */
   r = sdcard_init(&g_sdcard);
   if (r != 0) {
-    usart_init(MYUBRR);
+    usart_init_baud();
     usart_printf("Could not init sdcard");
     goto end;
   }
@@ -84,32 +127,119 @@ int main(void) {
   /* initilise the fat partition structure */
   r = fat32_init(&g_sdcard, &g_sdfatcard);
   if (r != 0) {
-    usart_init(MYUBRR);
+    usart_init_baud();
     usart_printf("Could not init fat");
     goto end;
   }
 
+#if defined PROF || defined PLAYLIST_NAME
+  /* for the profiler and the playlist times */
+  timer_init();
+#endif
+
+#if defined PLAYLIST_NAME
+  {
+    SAudioStats s_stats;
+    SPlaylistStats s_playlist_stats;
+
+#if defined PROF
+    prof_reset();
+#endif
+    r = playlist_open(&g_playlist, &g_sdfatcard, PLAYLIST_NAME);
+    if (r != 0) {
+      usart_init_baud();
+      usart_printf("Could not open playlist %02X", r);
+      goto end;
+    }
+    if (!audio_start(g_playlist.ui_rate, playlist_fill, &g_playlist)) {
+      usart_init_baud();
+      usart_printf("Could not start audio");
+      goto end;
+    }
+    /* the next track is prepared between the fills */
+    while (audio_poll()) {
+      playlist_poll(&g_playlist);
+    }
+    audio_stop();
+
+    usart_init_baud();
+    audio_stats(&s_stats);
+    playlist_stats(&g_playlist, &s_playlist_stats);
+    usart_printf("Samples %lu, underruns %u, fills %u, headroom %u\n",
+                 s_stats.ui_samples,
+                 s_stats.ui_underruns,
+                 s_stats.ui_fills,
+                 s_stats.ui_headroom_min);
+    /* stamps of 64 cycles are 4us */
+    usart_printf("Tracks %u, skipped %u, late %u, step %luus, switch %luus\n",
+                 s_playlist_stats.ui_tracks,
+                 s_playlist_stats.ui_skipped,
+                 s_playlist_stats.ui_late,
+                 TIMER_STAMP_CYCLES(s_playlist_stats.ui_prepare_max)
+                   / (F_CPU / 1000000),
+                 TIMER_STAMP_CYCLES(s_playlist_stats.ui_switch_max)
+                   / (F_CPU / 1000000));
+#if defined PROF
+    prof_dump();
+#endif
+  }
+#else
   {
     SSDFAT_File s_sdfile;
-    int16_t byte;
+    SWav s_wav;
+    SAudioStats s_stats;
+    bool b_started;
 
     r = fat32_file_open(&g_sdfatcard,
                         &s_sdfile,
                         FILE_NAME);
     if (r != 0) {
-      usart_init(MYUBRR);
+      usart_init_baud();
       usart_printf("Could not open file");
       goto end;
     }
 
-    /* read file byte by byte and write to portd, the delay of 17us
-       was manually calculated by timing the duration of audio
-       playback */
-    while ((byte = fat32_file_read_byte_spi(&s_sdfile)) >= 0) {
-      PORTD = byte & 0xFF;
-      _delay_us(17);
+#if defined PROF
+    prof_reset();
+#endif
+
+    /* play at the sample rate from the timer, the main loop keeps
+       the buffer filled */
+    r = wav_open(&s_wav, &s_sdfile);
+    if (r == 0) {
+      b_started = audio_start(s_wav.ui_rate, wav_fill, &s_wav);
+    } else if (r == WAV_ERROR_FORMAT) {
+      /* no header, start again as raw samples */
+      r = fat32_file_open(&g_sdfatcard,
+                          &s_sdfile,
+                          FILE_NAME);
+      b_started = r == 0 && audio_start(AUDIO_RATE, read_raw, &s_sdfile);
+    } else {
+      usart_init_baud();
+      usart_printf("Could not read wav header %02X", r);
+      goto end;
     }
+    if (!b_started) {
+      usart_init_baud();
+      usart_printf("Could not start audio");
+      goto end;
+    }
+    while (audio_poll()) {}
+    audio_stop();
+
+    usart_init_baud();
+    audio_stats(&s_stats);
+    usart_printf("Samples %lu, underruns %u, fills %u, headroom %u\n",
+                 s_stats.ui_samples,
+                 s_stats.ui_underruns,
+                 s_stats.ui_fills,
+                 s_stats.ui_headroom_min);
+#if defined PROF
+    /* the time of each fill, against the time to play a half */
+    prof_dump();
+#endif
   }
+#endif
 
   /* once finished, flash led */
   while(1) {
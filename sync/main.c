@@ -0,0 +1,168 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/delay.h>
+
+#include "usart.h"
+#include "timer.h"
+#include "telemetry.h"
+#include "clocksync.h"
+
+#include "pins.h"
+
+/*
+  PORTB
+  pin0 |-> pin8  (pulse of the global clock)
+  pin1 |-> pin9  (error pin, defined in makefile)
+
+  PORTD
+  pin0 |-> pin0  (RX)
+  pin1 |-> pin1  (TX)
+  pin2 |-> pin2  (RS-485 driver enable, with BUS=1)
+
+  Connected to: the other board
+  TX of the master connected to RX of the node and the other way
+  around, and the grounds. The TX of the node can also be connected to
+  the RX of a usb serial adapter to read the reports.
+
+  Description:
+  Program synchronises the clock of a node to the master with
+  clocksync, build the master with 'make NODE=0' and the node with
+  'make NODE=1'. The master starts an exchange with each node once a
+  second. After each exchange the node sends its clocksync_stats as a
+  telemetry frame on channel SYNC_REPORT_CHANNEL (the master discards
+  it), read with
+
+    tools/telemetry.py -p /dev/ttyUSB0 -b 250000 \
+      -c '1:<HHlLllL:syncs,dropped,offset,delay,drift,error,error_max'
+
+  offset is the measured offset of the node clock to the master in us,
+  error the difference of the node's model of the master clock to the
+  measured one at the exchange (the sync error a second after the last
+  exchange) and error_max the largest since the start.
+
+  Built with 'make BUS=1' the boards are nodes of an RS-485 bus
+  (USART_BUS, see usart.h) with their node numbers as the bus
+  addresses, pin 2 enables the driver of the transceiver. The reports
+  are sent to address SYNC_REPORT_ADDRESS, which the master does not
+  receive, a usb RS-485 adapter on the bus reads them with the
+  --bus option of tools/telemetry.py (space parity for the 9th bit,
+  the address frames are dropped).
+
+  Both boards switch pin 8 each SYNC_PULSE_MS of the master clock
+  (timer_global_micros), the node once it is synced, so the remaining
+  offset can be measured between the edges of the two pins with a
+  scope (the pins are set from the main loop, which adds some us of
+  jitter).
+*/
+
+#define SYNC_PULSE_PIN 8
+#define SYNC_PULSE_MS 10
+#define SYNC_INTERVAL_MS 1000
+#define SYNC_REPORT_CHANNEL 1
+/* on the bus the reports go to an address no board has */
+#define SYNC_REPORT_ADDRESS 0xFE
+
+/* the stats as sent in the report frame */
+typedef struct __attribute__((packed)) {
+  uint16_t ui_syncs;
+  uint16_t ui_dropped;
+  int32_t i_offset;
+  uint32_t ui_delay;
+  int32_t i_drift;
+  int32_t i_error;
+  uint32_t ui_error_max;
+} SSyncReport;
+
+#if SYNC_NODE != CLOCKSYNC_MASTER
+static
+void report(const SClockSyncStats* const p_stats) {
+  const SSyncReport s_report = {
+    p_stats->ui_syncs,
+    p_stats->ui_dropped,
+    p_stats->i_offset,
+    p_stats->ui_delay,
+    p_stats->i_drift,
+    p_stats->i_error,
+    p_stats->ui_error_max
+  };
+#if defined USART_BUS
+  uint8_t pch_frame[TELEMETRY_FRAME_SIZE(sizeof(s_report))];
+
+  telemetry_encode_bytes(SYNC_REPORT_CHANNEL, &s_report, sizeof(s_report),
+                         pch_frame);
+  usart_bus_send(SYNC_REPORT_ADDRESS, pch_frame, sizeof(pch_frame));
+#else
+  telemetry_send(SYNC_REPORT_CHANNEL, s_report);
+#endif
+}
+#endif
+
+int main(void) {
+  uint32_t ui_pulse = 0;
+  uint32_t ui_global;
+#if SYNC_NODE == CLOCKSYNC_MASTER
+  uint32_t ui_sync = 0;
+  uint8_t ui_next = 1;
+#else
+  SClockSyncStats s_stats;
+  uint16_t ui_syncs = 0;
+#endif
+
+  /* flash led on on boot */
+  writePin(PIN_ERROR, true);
+  setMode(PIN_ERROR, output);
+  _delay_ms(250);
+  writePin(PIN_ERROR, false);
+
+  writePin(SYNC_PULSE_PIN, false);
+  setMode(SYNC_PULSE_PIN, output);
+
+#if defined USART_BUS
+  usart_bus_init(SYNC_NODE);
+#else
+  usart_init_baud();
+#endif
+  timer_init();
+
+  /* enable interrupts, used for timer and usart */
+  sei();
+
+  clocksync_init(SYNC_NODE);
+
+  while (1) {
+    clocksync_poll();
+
+#if SYNC_NODE == CLOCKSYNC_MASTER
+    if (timer_millis() - ui_sync >= SYNC_INTERVAL_MS / SYNC_NODES) {
+      ui_sync += SYNC_INTERVAL_MS / SYNC_NODES;
+      clocksync_sync(ui_next);
+      ui_next = ui_next == SYNC_NODES ? 1 : ui_next + 1;
+    }
+#else
+    clocksync_stats(&s_stats);
+    if (s_stats.ui_syncs != ui_syncs) {
+      ui_syncs = s_stats.ui_syncs;
+      report(&s_stats);
+    }
+    /* led on while not synced */
+    if (!clocksync_is_synced()) {
+      writePin(PIN_ERROR, true);
+      continue;
+    }
+    writePin(PIN_ERROR, false);
+#endif
+
+    /* the pulse follows the master clock */
+    ui_global = timer_global_micros();
+    if ((int32_t)(ui_global - ui_pulse) >= 0) {
+      /* high in the odd periods, so both boards have the same level */
+      ui_pulse = ui_global / (SYNC_PULSE_MS * 1000UL);
+      if (ui_pulse & 1) {
+        writePin(SYNC_PULSE_PIN, true);
+      } else {
+        writePin(SYNC_PULSE_PIN, false);
+      }
+      ui_pulse = (ui_pulse + 1) * (SYNC_PULSE_MS * 1000UL);
+    }
+  }
+}
@@ -0,0 +1,179 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/delay.h>
+
+#include "usart.h"
+#include "usart_fmt.h"
+#include "sdcard.h"
+#include "sdcard-fat.h"
+#include "sdcard-table.h"
+#include "timer.h"
+#include "prof.h"
+
+#include "pins.h"
+
+/*
+  PORTB
+  pin5 |-> pin13 (SCK)
+  pin4 |-> pin12 (MISO)
+  pin3 |-> pin11 (MOSI)
+  pin2 |-> pin10 (output/SS)
+  pin1 |-> pin9  (error pin, defined in makefile)
+
+  Connected to: SD Card
+  Arduino pin13 (SCK) connected to (SCK)
+  Arduino pin12 (MISO) connected to (DO)
+  Arduino pin11 (MOSI) connected to (DI)
+  Arduino pin10 (SS) connected to (CS)
+
+  Description:
+  Program opens the sorted table TABLE_NAME (records of
+  TABLE_RECORD_SIZE bytes, keys of TABLE_KEY_SIZE bytes, see
+  sdcard-table.h) and looks up each key received as a line of hex
+  digits (most significant byte first, e.g. 0000012C for a 4 byte
+  key), writing
+
+    Key <key>: <record in hex>, reads <n>, <n>us
+
+  or 'not found' instead of the record. reads is the number of
+  sectors read from the card for the lookup, at most 2.
+*/
+
+SSDCard g_sdcard;
+SSDFATCard g_sdfatcard;
+SSDTable g_table;
+SSDTable_Fence g_fence[TABLE_FENCES(TABLE_RECORDS_MAX, TABLE_RECORD_SIZE)];
+
+/* value of a hex digit, or 0xFF */
+static
+uint8_t hex_digit(const uint8_t ch) {
+  if (ch >= '0' && ch <= '9') {
+    return ch - '0';
+  }
+  if (ch >= 'a' && ch <= 'f') {
+    return ch - 'a' + 10;
+  }
+  if (ch >= 'A' && ch <= 'F') {
+    return ch - 'A' + 10;
+  }
+  return 0xFF;
+}
+
+static
+void print_hex(const uint8_t* pch_data, uint16_t ui_length) {
+  while (ui_length-- > 0) {
+    usart_fmt_P(PSTR("%02X"), *pch_data++);
+  }
+}
+
+static
+void lookup(const uint8_t* pch_key) {
+  uint8_t pch_record[TABLE_RECORD_SIZE];
+  uint8_t ui_reads;
+  uint16_t ui_start;
+  uint16_t ui_stamps;
+  uint8_t r;
+
+  ui_start = timer_stamp();
+  r = table_lookup(&g_table, pch_key, pch_record, &ui_reads);
+  ui_stamps = timer_stamp() - ui_start;
+
+  usart_fmt_P(PSTR("Key "));
+  print_hex(pch_key, TABLE_KEY_SIZE);
+  if (r == 0) {
+    usart_fmt_P(PSTR(": "));
+    print_hex(pch_record, TABLE_RECORD_SIZE);
+  } else if (r == 0xE0) {
+    usart_fmt_P(PSTR(": not found"));
+  } else {
+    usart_fmt_P(PSTR(": error %02X"), r);
+  }
+  usart_fmt_P(PSTR(", reads %u, %luus\n"),
+              ui_reads,
+              TIMER_STAMP_CYCLES(ui_stamps) / (F_CPU / 1000000));
+#if defined PROF
+  prof_dump();
+#endif
+}
+
+int main(void) {
+  uint8_t pch_key[TABLE_KEY_SIZE];
+  uint8_t ui_digits = 0;
+  uint8_t ui_digit;
+  uint8_t data;
+  uint8_t r;
+
+  /* flash led on on boot */
+  writePin(PIN_ERROR, true);
+  setMode(PIN_ERROR, output);
+  _delay_ms(250);
+  writePin(PIN_ERROR, false);
+
+  usart_init_baud();
+  timer_init();
+
+  /* enable interrupts, used for timer and usart */
+  sei();
+
+  /* initilise the sdcard interface (includes spi) */
+  r = sdcard_init(&g_sdcard);
+  if (r != 0) {
+    usart_fmt_P(PSTR("Could not init sdcard\n"));
+    goto end;
+  }
+
+  /* initilise the fat partition structure */
+  r = fat32_init(&g_sdcard, &g_sdfatcard);
+  if (r != 0) {
+    usart_fmt_P(PSTR("Could not init fat\n"));
+    goto end;
+  }
+
+  r = table_open(&g_sdfatcard, &g_table,
+                 g_fence, sizeof(g_fence) / sizeof(g_fence[0]),
+                 TABLE_NAME, TABLE_RECORD_SIZE, TABLE_KEY_SIZE);
+  if (r != 0) {
+    usart_fmt_P(PSTR("Could not open table: %02X\n"), r);
+    goto end;
+  }
+  usart_fmt_P(PSTR("Table of %lu records, %u fences of %u sectors\n"),
+              g_table.ui_records,
+              g_table.ui_fences,
+              1 << g_table.ui_fence_shift);
+#if defined PROF
+  prof_reset();
+#endif
+
+  while (1) {
+    if (!usart_get_char(&data)) {
+      continue;
+    }
+    if (data == '\n' || data == '\r') {
+      if (ui_digits == 2 * TABLE_KEY_SIZE) {
+        lookup(pch_key);
+      } else if (ui_digits > 0) {
+        usart_fmt_P(PSTR("Keys have %u hex digits\n"), 2 * TABLE_KEY_SIZE);
+      }
+      ui_digits = 0;
+      continue;
+    }
+    ui_digit = hex_digit(data);
+    if (ui_digit == 0xFF || ui_digits >= 2 * TABLE_KEY_SIZE) {
+      /* ignored up to the end of the line */
+      ui_digits = 0xFF;
+      continue;
+    }
+    if (ui_digits % 2 == 0) {
+      pch_key[ui_digits / 2] = ui_digit << 4;
+    } else {
+      pch_key[ui_digits / 2] |= ui_digit;
+    }
+    ui_digits++;
+  }
+
+ end:
+  /* on error set led to always on */
+  writePin(PIN_ERROR, true);
+  while(1) {}
+}
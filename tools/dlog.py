@@ -0,0 +1,152 @@
+#!/usr/bin/env python3
+"""
+Host side formatter for the deferred log records of lib/dlog.h.
+
+A record is 0xFF, the flash address of the format string (2 bytes),
+the argument sizes (2 bits per argument: 1 = 1 byte, 2 = 2 bytes,
+3 = 4 bytes) and the raw little endian arguments. The format strings
+are read from the program memory sections of the elf file that was
+flashed, e.g.
+
+  dlog.py sdcard/main -p /dev/ttyACM0 -b 57600
+
+Any other bytes (e.g. text from usart_printf) are printed as is.
+"""
+
+import argparse
+import re
+import struct
+import sys
+
+DLOG_SYNC = 0xFF
+
+SHT_PROGBITS = 1
+SHF_ALLOC = 2
+# avr data memory is mapped from this address in the elf file
+AVR_DATA_OFFSET = 0x800000
+
+CONVERSION = re.compile(r'%([-0 #+]*)(\d*)(?:\.(\d+))?(hh|h|ll|l)?([diouxXcsSp%])')
+
+
+class Elf:
+    """Minimal reader for the flash sections of a 32bit elf file."""
+
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            self.data = f.read()
+        if self.data[:4] != b'\x7fELF' or self.data[4] != 1:
+            raise ValueError('%s is not a 32bit elf file' % path)
+        (shoff,) = struct.unpack_from('<I', self.data, 0x20)
+        shentsize, shnum = struct.unpack_from('<HH', self.data, 0x2E)
+        self.sections = []
+        for i in range(shnum):
+            (_, sh_type, flags, addr, offset, size) = \
+                struct.unpack_from('<IIIIII', self.data, shoff + i * shentsize)
+            if sh_type == SHT_PROGBITS and flags & SHF_ALLOC and \
+               addr < AVR_DATA_OFFSET:
+                self.sections.append((addr, offset, size))
+
+    def string(self, address):
+        """NUL terminated string at a flash address, None if not found."""
+        for addr, offset, size in self.sections:
+            if addr <= address < addr + size:
+                start = offset + address - addr
+                end = self.data.find(b'\x00', start, offset + size)
+                if end < 0:
+                    return None
+                return self.data[start:end].decode('latin-1')
+        return None
+
+
+def render(elf, fmt, args):
+    """printf style formatting of the raw arguments."""
+    args = list(args)
+
+    def convert(m):
+        flags, width, precision, _, conv = m.groups()
+        if conv == '%':
+            return '%'
+        if not args:
+            return '<missing>'
+        raw, size = args.pop(0)
+        if conv in 'di':
+            value = int.from_bytes(raw, 'little', signed=True)
+        else:
+            value = int.from_bytes(raw, 'little')
+        if conv == 's':
+            return '<ram 0x%04x>' % value
+        if conv == 'S':
+            value = elf.string(value) or '<flash 0x%04x>' % value
+            conv = 's'
+        if conv == 'p':
+            value, conv = '0x%04x' % value, 's'
+        if conv == 'u':
+            conv = 'd'
+        spec = '%' + flags + width + ('.' + precision if precision else '') + conv
+        return spec % value
+
+    return CONVERSION.sub(convert, fmt)
+
+
+def records(elf, stream, out):
+    pending = bytearray()
+    while True:
+        chunk = stream.read(256)
+        if not chunk:
+            # a serial port read times out, only a file or stdin ends
+            if not hasattr(stream, 'in_waiting'):
+                return
+            continue
+        pending += chunk
+        while pending:
+            if pending[0] != DLOG_SYNC:
+                end = pending.find(bytes([DLOG_SYNC]))
+                text = pending if end < 0 else pending[:end]
+                out.write(text.decode('latin-1').replace('\r', ''))
+                del pending[:len(text)]
+                continue
+            if len(pending) < 4:
+                break
+            address, sizes = struct.unpack_from('<HB', pending, 1)
+            lengths = [(1, 2, 4)[(sizes >> s & 3) - 1]
+                       for s in range(0, 8, 2) if sizes >> s & 3]
+            if len(pending) < 4 + sum(lengths):
+                break
+            fmt = elf.string(address)
+            if fmt is None:
+                # not a record, skip the sync byte
+                del pending[:1]
+                continue
+            args, offset = [], 4
+            for length in lengths:
+                args.append((bytes(pending[offset:offset + length]), length))
+                offset += length
+            out.write(render(elf, fmt, args))
+            del pending[:offset]
+        out.flush()
+
+
+def open_input(args):
+    if args.port:
+        import serial
+        return serial.Serial(args.port, args.baud, timeout=0.1)
+    if args.file == '-':
+        return sys.stdin.buffer
+    return open(args.file, 'rb')
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('elf', help='elf file that is running on the device')
+    parser.add_argument('-p', '--port', help='serial port')
+    parser.add_argument('-b', '--baud', type=int, default=57600)
+    parser.add_argument('-f', '--file', default='-',
+                        help='read from file instead of a port')
+    args = parser.parse_args()
+
+    records(Elf(args.elf), open_input(args), sys.stdout)
+
+
+if __name__ == '__main__':
+    main()
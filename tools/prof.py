@@ -0,0 +1,115 @@
+#!/usr/bin/env python3
+"""
+Report of the region profiles dumped by lib/prof.c (prof_dump).
+
+A dump is a block of text lines:
+
+  prof <interval ms> <cycles per unit>
+  prof <region> <count> <total> <min> <max>
+  ...
+  prof end
+
+with the times in units of timer_stamp. For each dump the regions are
+printed with the average, min and max in microseconds and their share
+of the interval, sorted by total time. Other lines are passed through.
+Input is read from a serial port (needs pyserial) or from a file ('-'
+is stdin), e.g.
+
+  prof.py -p /dev/ttyACM0 -b 57600
+"""
+
+import argparse
+import sys
+
+
+class Dump:
+    """Collects the lines of one dump."""
+
+    def __init__(self, interval_ms, unit_cycles):
+        self.interval_ms = interval_ms
+        self.unit_cycles = unit_cycles
+        self.regions = []
+
+    def add(self, name, count, total, minimum, maximum):
+        self.regions.append((name, count, total, minimum, maximum))
+
+    def report(self, out, f_cpu):
+        us = self.unit_cycles * 1e6 / f_cpu
+        out.write('%d ms:\n' % self.interval_ms)
+        out.write('  %-16s %8s %10s %10s %10s %10s %6s\n'
+                  % ('region', 'count', 'avg us', 'min us', 'max us',
+                     'total ms', 'share'))
+        for name, count, total, minimum, maximum in \
+                sorted(self.regions, key=lambda r: -r[2]):
+            total_us = total * us
+            share = total_us / (self.interval_ms * 10.0) \
+                if self.interval_ms else 0
+            out.write('  %-16s %8d %10.1f %10.1f %10.1f %10.2f %5.1f%%\n'
+                      % (name, count, total_us / count, minimum * us,
+                         maximum * us, total_us / 1000, share))
+        out.flush()
+
+
+def parse(lines, out, f_cpu):
+    """Reports the dumps in lines (text), other lines are echoed."""
+    dump = None
+    for line in lines:
+        fields = line.split()
+        if not fields or fields[0] != 'prof':
+            out.write(line + '\n')
+            continue
+        try:
+            if len(fields) == 3:
+                dump = Dump(int(fields[1]), int(fields[2]))
+            elif fields[1:] == ['end']:
+                if dump is not None:
+                    dump.report(out, f_cpu)
+                dump = None
+            elif len(fields) == 6 and dump is not None:
+                dump.add(fields[1], *[int(f) for f in fields[2:]])
+            else:
+                out.write(line + '\n')
+        except ValueError:
+            # garbled by a lost byte
+            out.write(line + '\n')
+
+
+def read_lines(stream):
+    pending = b''
+    while True:
+        chunk = stream.read(256)
+        if not chunk:
+            if not hasattr(stream, 'in_waiting'):
+                return
+            continue
+        pending += chunk
+        *lines, pending = pending.split(b'\n')
+        for line in lines:
+            yield line.decode('latin-1').rstrip('\r')
+
+
+def open_input(args):
+    if args.port:
+        import serial
+        return serial.Serial(args.port, args.baud, timeout=0.1)
+    if args.file == '-':
+        return sys.stdin.buffer
+    return open(args.file, 'rb')
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('-p', '--port', help='serial port')
+    parser.add_argument('-b', '--baud', type=int, default=57600)
+    parser.add_argument('-f', '--file', default='-',
+                        help='read from file instead of a port')
+    parser.add_argument('--f-cpu', type=float, default=16e6,
+                        help='clock of the device in Hz')
+    args = parser.parse_args()
+
+    parse(read_lines(open_input(args)), sys.stdout, args.f_cpu)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,190 @@
+#!/usr/bin/env python3
+"""
+Client for the SD card bridge (bridge/main.c), reads the card of a
+board into an image file, or writes an image (or part of one) back.
+
+  sdbridge.py -p /dev/ttyACM0 info
+  sdbridge.py -p /dev/ttyACM0 dump card.img
+  sdbridge.py -p /dev/ttyACM0 dump part.img --first 2048 --count 8192
+  sdbridge.py -p /dev/ttyACM0 restore part.img --first 2048
+
+The image can then be inspected with the usual tools, e.g.
+'fdisk -l card.img' or 'mount -o loop,offset=$((2048*512)) card.img'.
+
+Reads are pipelined, --depth requests of --batch sectors are kept in
+flight so the board always has the next request queued. Writes are
+sent one sector at a time, waiting for each to be acknowledged, as
+the board has no buffer to hold data while the card is busy. Needs
+pyserial.
+"""
+
+import argparse
+import struct
+import sys
+import time
+
+import serial
+
+SECTOR = 512
+SYNC = 0xA5
+
+STATUS = {
+    0xBF: 'bad request',
+    0xBE: 'bad crc',
+    0xBD: 'timeout',
+    0xBC: 'receive overrun',
+    0xFE: 'sector out of range',
+    0xFF: 'card timeout',
+}
+
+
+def crc_ccitt(data, crc=0xFFFF):
+    """Same as the avr-libc _crc_ccitt_update."""
+    for b in data:
+        crc ^= b
+        for _ in range(8):
+            if crc & 1:
+                crc = (crc >> 1) ^ 0x8408
+            else:
+                crc >>= 1
+    return crc
+
+
+class BridgeError(Exception):
+    pass
+
+
+class Bridge:
+    def __init__(self, port, baud):
+        self.port = serial.Serial(port, baud, timeout=5)
+        # opening the port resets the board, wait for the sd init
+        time.sleep(2)
+        self.port.reset_input_buffer()
+        self.tag = 0
+
+    def read_exact(self, length):
+        data = self.port.read(length)
+        if len(data) != length:
+            raise BridgeError('timeout waiting for the board')
+        return data
+
+    def request(self, op, sector=0, count=0):
+        self.tag = (self.tag + 1) & 0xFF
+        self.port.write(struct.pack('<cBIB', op, self.tag, sector, count))
+        return self.tag
+
+    def header(self, tag):
+        sync, rtag, status, count = self.read_exact(4)
+        if sync != SYNC or rtag != tag:
+            raise BridgeError('out of step with the board')
+        if status != 0:
+            raise BridgeError('status %02X %s'
+                              % (status, STATUS.get(status, '')))
+        return count
+
+    def info(self):
+        tag = self.request(b'I')
+        self.header(tag)
+        return struct.unpack('<I', self.read_exact(4))[0]
+
+    def read_response(self, tag, sector, count):
+        self.header(tag)
+        data = bytearray()
+        for i in range(count):
+            status = self.read_exact(1)[0]
+            if status != 0:
+                raise BridgeError('sector %d: status %02X %s'
+                                  % (sector + i, status,
+                                     STATUS.get(status, '')))
+            block = self.read_exact(SECTOR)
+            crc = struct.unpack('<H', self.read_exact(2))[0]
+            if crc != crc_ccitt(block):
+                raise BridgeError('sector %d: bad crc' % (sector + i))
+            data += block
+        return bytes(data)
+
+    def read(self, first, count, batch, depth, out, progress):
+        pending = []
+        sector = first
+        end = first + count
+        while sector < end or pending:
+            while sector < end and len(pending) < depth:
+                n = min(batch, end - sector)
+                pending.append((self.request(b'R', sector, n), sector, n))
+                sector += n
+            tag, start, n = pending.pop(0)
+            out.write(self.read_response(tag, start, n))
+            progress(start + n - first)
+
+    def write(self, first, image, count, progress):
+        """Writes the sectors of the image file from first, up to count
+        (None for the whole file), reading one sector at a time."""
+        done = 0
+        while count is None or done < count:
+            block = image.read(SECTOR)
+            if not block:
+                break
+            # the last sector is padded with zeros
+            block += bytes(SECTOR - len(block))
+            tag = self.request(b'W', first + done, 1)
+            self.port.write(block + struct.pack('<H', crc_ccitt(block)))
+            if self.header(tag) != 1:
+                raise BridgeError('sector %d not written' % (first + done))
+            done += 1
+            progress(done)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('-p', '--port', required=True, help='serial port')
+    parser.add_argument('-b', '--baud', type=int, default=1000000)
+    parser.add_argument('--batch', type=int, default=8,
+                        help='sectors per read request (max 255)')
+    parser.add_argument('--depth', type=int, default=4,
+                        help='read requests in flight (max 18)')
+    parser.add_argument('command', choices=['info', 'dump', 'restore'])
+    parser.add_argument('image', nargs='?')
+    parser.add_argument('--first', type=int, default=0,
+                        help='first sector')
+    parser.add_argument('--count', type=int,
+                        help='sectors (default to the end of the card)')
+    args = parser.parse_args()
+
+    if args.command != 'info' and args.image is None:
+        parser.error('an image file is required')
+    args.batch = max(1, min(args.batch, 255))
+    # each request is 7 bytes, the board has a 128 byte receive buffer
+    args.depth = max(1, min(args.depth, 18))
+
+    bridge = Bridge(args.port, args.baud)
+    sectors = bridge.info()
+    start = time.time()
+
+    def progress(done):
+        rate = done * SECTOR / max(time.time() - start, 1e-3) / 1000
+        print('\r%d sectors, %.1f KB/s' % (done, rate),
+              end='', file=sys.stderr)
+
+    try:
+        if args.command == 'info':
+            print('%d sectors (%d MiB)' % (sectors, sectors // 2048))
+        elif args.command == 'dump':
+            count = args.count
+            if count is None:
+                count = sectors - args.first
+            with open(args.image, 'wb') as out:
+                bridge.read(args.first, count, args.batch, args.depth,
+                            out, progress)
+            print(file=sys.stderr)
+        else:
+            with open(args.image, 'rb') as image:
+                bridge.write(args.first, image, args.count, progress)
+            print(file=sys.stderr)
+    except BridgeError as e:
+        print(file=sys.stderr)
+        sys.exit(str(e))
+
+
+if __name__ == '__main__':
+    main()
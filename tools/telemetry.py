@@ -0,0 +1,161 @@
+#!/usr/bin/env python3
+"""
+Host side decoder for the frames written by lib/telemetry.c.
+
+Each frame is COBS encoded and terminated with 0x00, the decoded frame
+is the channel byte, the record and a little endian crc (avr-libc
+_crc_ccitt_update, initial value 0xFFFF) over the channel and record.
+
+Records are unpacked with python struct formats given per channel, e.g.
+
+  telemetry.py -p /dev/ttyACM0 -b 1000000 -c '1:<LHB:time,echo,depth'
+
+Without a format for a channel the record is printed in hex. Input is
+read from a serial port (needs pyserial) or from a file ('-' is stdin).
+
+With --bus the frames are read from a USART_BUS (9 bit) line, e.g. a
+usb RS-485 adapter: the port uses space parity, so the 9th bit is
+taken as the parity bit, and the address frame in front of each
+message is dropped.
+"""
+
+import argparse
+import struct
+import sys
+import time
+
+
+def crc_ccitt_update(crc, data):
+    """Same as the avr-libc _crc_ccitt_update."""
+    crc ^= data
+    for _ in range(8):
+        if crc & 1:
+            crc = (crc >> 1) ^ 0x8408
+        else:
+            crc >>= 1
+    return crc
+
+
+def crc_ccitt(data, crc=0xFFFF):
+    for b in data:
+        crc = crc_ccitt_update(crc, b)
+    return crc
+
+
+def cobs_decode(data):
+    """Decode a frame (without the 0x00 delimiter), None if invalid."""
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        code = data[i]
+        if code == 0 or i + code > len(data):
+            return None
+        out += data[i + 1:i + code]
+        i += code
+        if code != 0xFF and i < len(data):
+            out.append(0)
+    return bytes(out)
+
+
+def parse_frame(encoded):
+    """Returns (channel, record) or None if the frame is corrupt."""
+    frame = cobs_decode(encoded)
+    if frame is None or len(frame) < 3:
+        return None
+    body, crc = frame[:-2], struct.unpack('<H', frame[-2:])[0]
+    if crc_ccitt(body) != crc:
+        return None
+    return body[0], body[1:]
+
+
+def frames(stream, bus=False):
+    """Yield encoded frames from a stream of bytes, without the address
+    frame of each message if bus."""
+    pending = bytearray()
+    while True:
+        chunk = stream.read(256)
+        if not chunk:
+            # a serial port read times out, only a file or stdin ends
+            if hasattr(stream, 'in_waiting'):
+                continue
+            if pending:
+                yield bytes(pending)
+            return
+        pending += chunk
+        while True:
+            end = pending.find(b'\x00')
+            if end < 0:
+                break
+            start = 1 if bus else 0
+            if end > start:
+                yield bytes(pending[start:end])
+            del pending[:end + 1]
+
+
+def open_input(args):
+    if args.port:
+        import serial
+        parity = serial.PARITY_SPACE if args.bus else serial.PARITY_NONE
+        return serial.Serial(args.port, args.baud, parity=parity,
+                             timeout=0.1)
+    if args.file == '-':
+        return sys.stdin.buffer
+    return open(args.file, 'rb')
+
+
+class Channel:
+    def __init__(self, spec):
+        parts = spec.split(':')
+        self.number = int(parts[0], 0)
+        self.format = parts[1]
+        self.names = parts[2].split(',') if len(parts) > 2 else None
+
+    def format_record(self, record):
+        try:
+            values = struct.unpack(self.format, record)
+        except struct.error:
+            return 'bad size %d: %s' % (len(record), record.hex())
+        if self.names:
+            return ' '.join('%s=%s' % kv for kv in zip(self.names, values))
+        return ' '.join(str(v) for v in values)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('-p', '--port', help='serial port')
+    parser.add_argument('-b', '--baud', type=int, default=57600)
+    parser.add_argument('-f', '--file', default='-',
+                        help='read from file instead of a port')
+    parser.add_argument('-c', '--channel', action='append', default=[],
+                        help='CH:FORMAT[:NAMES] struct format of a channel')
+    parser.add_argument('--bus', action='store_true',
+                        help='read a 9 bit USART_BUS line')
+    parser.add_argument('-s', '--stats', action='store_true',
+                        help='print frames per second instead of records')
+    args = parser.parse_args()
+
+    channels = {c.number: c for c in map(Channel, args.channel)}
+    count, errors, last = 0, 0, time.time()
+
+    for encoded in frames(open_input(args), args.bus):
+        parsed = parse_frame(encoded)
+        if parsed is None:
+            errors += 1
+            continue
+        count += 1
+        channel, record = parsed
+        if args.stats:
+            now = time.time()
+            if now - last >= 1.0:
+                print('%.1f frames/s, %d bad frames' % (count / (now - last), errors))
+                count, last = 0, now
+        elif channel in channels:
+            print('%d: %s' % (channel, channels[channel].format_record(record)))
+        else:
+            print('%d: %s' % (channel, record.hex()))
+        sys.stdout.flush()
+
+
+if __name__ == '__main__':
+    main()
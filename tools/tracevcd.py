@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+"""
+Run times of the interrupts in the trace.vcd written by simavr.
+
+Built with 'make TRACE_GPIO=1 SIMAVR=1' (see lib/trace.h) the
+instrumented isrs drive a pin of port c high while they run, and
+simavr (run_avr) records port c as the signal TRACE of trace.vcd. For
+each pin the number of runs, the average, min and max time high in
+cycles, and the load (the share of the trace it was high) are
+printed, e.g.
+
+  run_avr main
+  tracevcd.py trace.vcd
+
+The pin is set after the isr prologue and cleared before the
+epilogue, so the times leave out the entry and exit of the interrupt
+(the saving of the registers the isr uses and reti).
+"""
+
+import argparse
+import sys
+
+# bits of port c, in the order of ETraceId (trace.h)
+NAMES = ['timer0', 'usart_rx', 'usart_udre', 'icr', 'cli', 'app']
+
+UNITS = {'s': 1.0, 'ms': 1e-3, 'us': 1e-6, 'ns': 1e-9, 'ps': 1e-12,
+         'fs': 1e-15}
+
+
+class Pin:
+    """Collects the times one pin is high."""
+
+    def __init__(self):
+        self.rise = None
+        self.times = []
+
+    def change(self, time, high):
+        if high and self.rise is None:
+            self.rise = time
+        elif not high and self.rise is not None:
+            self.times.append(time - self.rise)
+            self.rise = None
+
+
+def parse_timescale(text):
+    text = text.replace('$timescale', '').replace('$end', '').strip()
+    number = text.rstrip('fpnumws ').strip()
+    unit = text[len(number):].strip()
+    return float(number or 1) * UNITS[unit]
+
+
+def parse(lines, signal):
+    """Returns the seconds per time unit, the pins of signal and the
+    time of the last change."""
+    timescale = 1e-9
+    code = None
+    width = 0
+    pins = [Pin() for i in range(len(NAMES))]
+    time = 0
+    header = []
+    for line in lines:
+        line = line.strip()
+        if not line:
+            continue
+        if line in ('$dumpvars', '$dumpall', '$dumpon', '$dumpoff', '$end'):
+            continue
+        if header or line[0] == '$':
+            # declarations, possibly over several lines
+            header.append(line)
+            if not line.endswith('$end'):
+                continue
+            fields = ' '.join(header).split()
+            header = []
+            if fields[0] == '$timescale':
+                timescale = parse_timescale(' '.join(fields))
+            elif fields[0] == '$var' and fields[4] == signal:
+                width = int(fields[2])
+                code = fields[3]
+            elif fields[0] == '$enddefinitions' and code is None:
+                raise ValueError('no signal %s' % signal)
+            continue
+        if line[0] == '#':
+            time = int(line[1:])
+        elif line[0] in 'bB':
+            value, ident = line[1:].split()
+            if ident == code:
+                value = int(value.replace('x', '0').replace('z', '0'), 2)
+                for i in range(min(width, len(pins))):
+                    pins[i].change(time, value & (1 << i))
+        elif line[1:] == code and line[0] in '01':
+            pins[0].change(time, line[0] == '1')
+    return timescale, pins, time
+
+
+def report(out, timescale, pins, end, f_cpu):
+    cycles = timescale * f_cpu
+    out.write('  %-12s %8s %10s %10s %10s %8s\n'
+              % ('pin', 'runs', 'avg cyc', 'min cyc', 'max cyc', 'load %'))
+    for name, pin in zip(NAMES, pins):
+        if not pin.times:
+            continue
+        out.write('  %-12s %8d %10.1f %10.1f %10.1f %8.2f\n'
+                  % (name, len(pin.times),
+                     sum(pin.times) * cycles / len(pin.times),
+                     min(pin.times) * cycles, max(pin.times) * cycles,
+                     100.0 * sum(pin.times) / end if end else 0.0))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('file', nargs='?', default='trace.vcd',
+                        help="vcd file ('-' is stdin)")
+    parser.add_argument('-s', '--signal', default='TRACE',
+                        help='name of the port c signal')
+    parser.add_argument('--f-cpu', type=float, default=16e6,
+                        help='clock of the device in Hz')
+    args = parser.parse_args()
+
+    stream = sys.stdin if args.file == '-' else open(args.file)
+    with stream:
+        try:
+            timescale, pins, end = parse(stream, args.signal)
+        except ValueError as e:
+            sys.exit('%s: %s' % (args.file, e))
+    report(sys.stdout, timescale, pins, end, args.f_cpu)
+
+
+if __name__ == '__main__':
+    main()
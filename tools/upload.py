@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+"""
+Uploads a file to the SD card of a board running upload/main.c.
+
+The target file must already exist on the card and be at least as
+large as the upload (e.g. create it on a pc with
+'truncate -s 4M /media/card/audio.raw'), its clusters are overwritten
+and the size in the directory entry is updated.
+
+  upload.py -p /dev/ttyACM0 -b 500000 music.raw /audio.raw
+
+Use --rtscts when the board is built with 'make FLOW=RTS', otherwise
+XON/XOFF flow control is used. Needs pyserial.
+"""
+
+import argparse
+import os
+import sys
+import time
+
+import serial
+
+
+def read_line(port):
+    line = port.readline()
+    if not line:
+        raise RuntimeError('no answer from board')
+    return line.decode('ascii', 'replace').strip()
+
+
+# resync line of upload/main.c, 8 CAN bytes
+RESYNC = b'\x18' * 8 + b'\n'
+
+
+def resync(port):
+    """Sends the resync line and waits for the board to answer READY,
+    after an error it has discarded the data up to it."""
+    port.write(RESYNC)
+    port.flush()
+    while read_line(port) != 'READY':
+        pass
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('-p', '--port', required=True, help='serial port')
+    parser.add_argument('-b', '--baud', type=int, default=500000)
+    parser.add_argument('--rtscts', action='store_true',
+                        help='hardware flow control instead of XON/XOFF')
+    parser.add_argument('--chunk', type=int, default=64,
+                        help='bytes per write to the serial port')
+    parser.add_argument('source', help='local file')
+    parser.add_argument('target', help='path on the card, e.g. /audio.raw')
+    args = parser.parse_args()
+
+    size = os.path.getsize(args.source)
+    if size == 0:
+        sys.exit('nothing to upload')
+
+    port = serial.Serial(args.port, args.baud, timeout=5,
+                         xonxoff=not args.rtscts, rtscts=args.rtscts)
+    # opening the port resets the board, wait for the boot and sd init
+    time.sleep(2)
+    port.reset_input_buffer()
+    resync(port)
+
+    port.write(('%d %s\n' % (size, args.target)).encode('ascii'))
+    answer = read_line(port)
+    if answer != 'GO':
+        sys.exit(answer)
+
+    start = time.time()
+    sent = 0
+    with open(args.source, 'rb') as f:
+        while True:
+            data = f.read(args.chunk)
+            if not data:
+                break
+            port.write(data)
+            sent += len(data)
+            print('\r%d/%d bytes' % (sent, size), end='', file=sys.stderr)
+    port.flush()
+    print(file=sys.stderr)
+
+    answer = read_line(port)
+    elapsed = time.time() - start
+    print(answer)
+    if answer.startswith('ERROR'):
+        # the board discards the data until the resync line
+        resync(port)
+        sys.exit(1)
+    print('host: %d bytes in %.2fs, %.1f KB/s'
+          % (size, elapsed, size / elapsed / 1000))
+
+    # a board built with PROFILE=1 dumps the profile after the answer
+    port.timeout = 0.5
+    lines = []
+    while True:
+        line = port.readline()
+        if not line:
+            break
+        lines.append(line.decode('ascii', 'replace').strip())
+    if lines:
+        import prof
+        prof.parse(lines, sys.stdout, 16e6)
+    if not answer.startswith('OK'):
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,194 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/delay.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usart.h"
+#include "usart_fmt.h"
+#include "sdcard.h"
+#include "sdcard-fat.h"
+#include "timer.h"
+#include "upload.h"
+#include "prof.h"
+
+#include "pins.h"
+
+/*
+  PORTB
+  pin5 |-> pin13 (SCK)
+  pin4 |-> pin12 (MISO)
+  pin3 |-> pin11 (MOSI)
+  pin2 |-> pin10 (output/SS)
+  pin1 |-> pin9  (error pin, defined in makefile)
+
+  Connected to: SD Card
+  Arduino pin13 (SCK) connected to (SCK)
+  Arduino pin12 (MISO) connected to (DO)
+  Arduino pin11 (MOSI) connected to (DI)
+  Arduino pin10 (SS) connected to (CS)
+
+  Description:
+  Program receives files over the usart and writes them to existing
+  files on the SD card (see tools/upload.py). Each upload starts with
+  a line:
+
+    <size> <path>\n
+
+  the program answers "GO" and then receives size bytes, once written
+  it answers with either
+
+    OK <bytes> <ms> <KB/s> stalls <n> waits <n>
+    ERROR <code>
+
+  The file must already exist and be at least size bytes (its clusters
+  are reused), the size in the directory entry is updated.
+
+  After an ERROR the rest of the data can still be arriving, so all
+  input is discarded until the resync line (8 CAN bytes and a newline)
+  has been received and is followed by RESYNC_QUIET_MS without input
+  (a match inside the data is followed by more data). The program then
+  answers "READY" and reads the next command. The resync line is also
+  answered with "READY" as a command, so a host can always send it
+  first.
+*/
+
+#define LINE_SIZE 64
+
+#define RESYNC "\x18\x18\x18\x18\x18\x18\x18\x18"
+#define RESYNC_CAN 0x18
+#define RESYNC_CANS 8
+#define RESYNC_QUIET_MS 100
+
+SSDCard g_sdcard;
+SSDFATCard g_sdfatcard;
+
+/*
+  reads a line (without the newline) from the usart
+*/
+static
+void read_line(char* const pch_line) {
+  uint8_t data;
+  uint8_t i = 0;
+
+  while (1) {
+    if (!usart_get_char(&data)) {
+      continue;
+    }
+    if (data == '\n') {
+      break;
+    }
+    if (data != '\r' && i < LINE_SIZE - 1) {
+      pch_line[i++] = data;
+    }
+  }
+  pch_line[i] = '\0';
+}
+
+/*
+  discards the input up to the resync line (at least RESYNC_CANS CAN
+  bytes, so one left at the end of the data does not matter) and a
+  quiet period after it
+*/
+static
+void resync(void) {
+  uint8_t data;
+  uint8_t ui_cans = 0;
+  bool b_resync = false;
+  uint32_t ui_last = timer_millis();
+
+  while (!b_resync || timer_millis() - ui_last < RESYNC_QUIET_MS) {
+    if (usart_get_char(&data)) {
+      ui_last = timer_millis();
+      b_resync = data == '\n' && ui_cans == RESYNC_CANS;
+      if (data != RESYNC_CAN) {
+        ui_cans = 0;
+      } else if (ui_cans < RESYNC_CANS) {
+        ui_cans++;
+      }
+    }
+  }
+  usart_fmt_P(PSTR("READY\n"));
+}
+
+int main(void) {
+  char pch_line[LINE_SIZE];
+  char* pch_path;
+  uint32_t ui_size;
+  uint32_t ui_rate;
+  SUploadStats s_stats;
+  uint8_t r;
+
+  /* flash led on on boot */
+  writePin(PIN_ERROR, true);
+  setMode(PIN_ERROR, output);
+  _delay_ms(250);
+  writePin(PIN_ERROR, false);
+
+  usart_init_baud();
+  timer_init();
+
+  /* enable interrupts, used for timer and usart */
+  sei();
+
+  /* initilise the sdcard interface (includes spi) */
+  r = sdcard_init(&g_sdcard);
+  if (r != 0) {
+    usart_fmt_P(PSTR("Could not init sdcard\n"));
+    goto end;
+  }
+
+  /* initilise the fat partition structure */
+  r = fat32_init(&g_sdcard, &g_sdfatcard);
+  if (r != 0) {
+    usart_fmt_P(PSTR("Could not init fat\n"));
+    goto end;
+  }
+
+  while (1) {
+    read_line(pch_line);
+    if (strcmp(pch_line, RESYNC) == 0) {
+      usart_fmt_P(PSTR("READY\n"));
+      continue;
+    }
+
+    ui_size = strtoul(pch_line, &pch_path, 10);
+    if (*pch_path != ' ' || ui_size == 0) {
+      usart_fmt_P(PSTR("ERROR usage: <size> <path>\n"));
+      continue;
+    }
+    pch_path++;
+
+    usart_fmt_P(PSTR("GO\n"));
+#if defined PROF
+    prof_reset();
+#endif
+    r = upload_file(&g_sdfatcard, pch_path, ui_size, &s_stats);
+    if (r != 0) {
+      usart_fmt_P(PSTR("ERROR %02X\n"), r);
+      /* the rest of the data is not taken as commands */
+      resync();
+      continue;
+    }
+
+    /* bytes per millisecond is (decimal) KB/s */
+    ui_rate = s_stats.ui_millis > 0
+      ? s_stats.ui_bytes / s_stats.ui_millis : 0;
+    usart_fmt_P(PSTR("OK %lu %lu %lu stalls %u waits %u\n"),
+                s_stats.ui_bytes,
+                s_stats.ui_millis,
+                ui_rate,
+                s_stats.ui_stalls,
+                s_stats.ui_card_waits);
+#if defined PROF
+    /* the sdcard, fat and usart regions of the upload */
+    prof_dump();
+#endif
+  }
+
+ end:
+  /* on error set led to always on */
+  writePin(PIN_ERROR, true);
+  while(1) {}
+}